@@ -4,6 +4,7 @@
 #include "matrix2x2.h"
 
 #include <complex>
+#include <iostream>
 
 ApplySolutionsWriter::ApplySolutionsWriter(std::unique_ptr<Writer> parentWriter, const std::string &filename,
 										   size_t bandFineChanStart, size_t nTotalFineChannels) : ForwardingWriter(std::move(parentWriter)),
@@ -14,23 +15,32 @@ ApplySolutionsWriter::ApplySolutionsWriter(std::unique_ptr<Writer> parentWriter,
 	SolutionFile solutionFile;
 	solutionFile.OpenForReading(filename.c_str());
 	
-	if(solutionFile.IntervalCount() != 1)
-		throw std::runtime_error("The provided solution file has multiple intervals, which is not supported. ");
+	if(solutionFile.IntervalCount() == 0)
+		throw std::runtime_error("The provided solution file has no solution intervals. ");
 	if(solutionFile.PolarizationCount() != 4)
 		throw std::runtime_error("The provided solution file does not have 4 polarizations, which is not supported. ");
 	
+	_nSolutionIntervals = solutionFile.IntervalCount();
 	_nSolutionChannels = solutionFile.ChannelCount();
 	_nSolutionAntennas = solutionFile.AntennaCount();
-	_solutions.resize(_nSolutionAntennas * _nSolutionChannels);
-	size_t index = 0;
-	for(size_t a = 0; a!=_nSolutionAntennas; ++a) {
-		for(size_t ch = 0; ch!=_nSolutionChannels; ++ch) {
-			for(size_t p = 0; p!=4; ++p) {
-				_solutions[index][p] = solutionFile.ReadNextSolution();
-			}
-			++index;
-		}
+	_solutionStartTime = solutionFile.StartTime();
+	if(_nSolutionIntervals > 1)
+	{
+		if(!(solutionFile.EndTime() > solutionFile.StartTime()))
+			throw std::runtime_error("The provided solution file has multiple intervals, but its header does not specify a valid time range. ");
+		_solutionIntervalDuration = (solutionFile.EndTime() - solutionFile.StartTime()) / _nSolutionIntervals;
+		std::cout << "Applying solutions with " << _nSolutionIntervals << " intervals of " << _solutionIntervalDuration << " s.\n";
+	}
+	else {
+		_solutionIntervalDuration = 0.0;
 	}
+	
+	// The solutions of all intervals are stored in one contiguous table,
+	// ordered by interval, antenna and channel, the same as in the file.
+	// This allows reading them directly into the table with one read.
+	static_assert(sizeof(MC2x2) == 4 * sizeof(std::complex<double>), "MC2x2 should consist of exactly four complex values");
+	_solutions.resize(_nSolutionIntervals * _nSolutionAntennas * _nSolutionChannels);
+	solutionFile.ReadAllSolutions(reinterpret_cast<std::complex<double>*>(_solutions.data()));
 }
 
 ApplySolutionsWriter::~ApplySolutionsWriter()
@@ -79,8 +89,9 @@ void ApplySolutionsWriter::WriteRow(double time, double timeCentroid, size_t ant
 	else
 		channelRatio = _nTotalFineChannels / _nSolutionChannels;
 
-	const MC2x2* solA = &_solutions[antenna1 * _nSolutionChannels];
-	const MC2x2* solB = &_solutions[antenna2 * _nSolutionChannels];
+	const MC2x2* intervalSolutions = &_solutions[intervalIndex(time) * _nSolutionAntennas * _nSolutionChannels];
+	const MC2x2* solA = &intervalSolutions[antenna1 * _nSolutionChannels];
+	const MC2x2* solB = &intervalSolutions[antenna2 * _nSolutionChannels];
 	MC2x2 scratch;
 	for (size_t ch = 0; ch != _nBandFineChannels; ch++)
 	{		
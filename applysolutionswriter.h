@@ -4,6 +4,7 @@
 #include "forwardingwriter.h"
 #include "matrix2x2.h"
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <vector>
@@ -19,8 +20,26 @@ class ApplySolutionsWriter : public ForwardingWriter
 
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
 
+		virtual size_t AddSpectralWindow(const std::string& name, const std::vector<Writer::ChannelInfo>& channels, double refFreq, double totalBandwidth) final override
+		{
+			throw std::runtime_error("Solutions can not be applied to rows with different channel resolutions: apply them before averaging");
+		}
+
 	private:
-		size_t _nBandFineChannels, _nSolutionAntennas, _nSolutionChannels, _bandFineChanStart, _nTotalFineChannels;
+		/**
+		 * Returns the index of the solution interval that covers the given time. Times
+		 * before the first or after the last interval use the nearest interval.
+		 */
+		size_t intervalIndex(double time) const
+		{
+			if(_nSolutionIntervals == 1 || time <= _solutionStartTime)
+				return 0;
+			size_t index = size_t((time - _solutionStartTime) / _solutionIntervalDuration);
+			return std::min(index, _nSolutionIntervals - 1);
+		}
+		
+		size_t _nBandFineChannels, _nSolutionIntervals, _nSolutionAntennas, _nSolutionChannels, _bandFineChanStart, _nTotalFineChannels;
+		double _solutionStartTime, _solutionIntervalDuration;
 		std::vector<std::complex<float>> _correctedData;
 		std::vector<MC2x2> _solutions;
 };
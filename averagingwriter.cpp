@@ -1,5 +1,8 @@
 #include "averagingwriter.h"
 
+#include <cmath>
+#include <map>
+
 #include <xmmintrin.h>
 
 #define USE_SSE
@@ -7,13 +10,16 @@
 void AveragingWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
 {
 	Buffer &buffer = getBuffer(antenna1, antenna2);
+	if(buffer._isPending)
+		writePendingRows();
+	const size_t freqAvgFactor = buffer._freqAvgFactor;
 	size_t srcIndex = 0;
-	for(size_t ch=0; ch!=_avgChannelCount*_freqAvgFactor; ++ch)
+	for(size_t ch=0; ch!=buffer._channelCount*freqAvgFactor; ++ch)
 	{
 #ifndef USE_SSE
 		for(size_t p=0; p!=4; ++p)
 		{
-			const size_t destIndex = (ch / _freqAvgFactor) * 4 + p;
+			const size_t destIndex = (ch / freqAvgFactor) * 4 + p;
 			buffer._flaggedAndUnflaggedData[destIndex] += data[srcIndex];
 			if(!flags[srcIndex])
 			{
@@ -24,7 +30,7 @@ void AveragingWriter::WriteRow(double time, double timeCentroid, size_t antenna1
 			++srcIndex;
 		}
 #else
-		const size_t destIndex = (ch / _freqAvgFactor) * 4;
+		const size_t destIndex = (ch / freqAvgFactor) * 4;
 		const __m128 dataValA = _mm_load_ps((float*) &data[srcIndex]);
 		const __m128 dataValB = _mm_load_ps((float*) &data[srcIndex+2]);
 		std::complex<float> *allDataPtr = &buffer._flaggedAndUnflaggedData[destIndex];
@@ -60,6 +66,74 @@ void AveragingWriter::WriteRow(double time, double timeCentroid, size_t antenna1
 	buffer._rowTimestepCount++;
 	buffer._interval += interval;
 	
-	if(buffer._rowTimestepCount == _timeAvgFactor)
+	if(buffer._rowTimestepCount == buffer._timeAvgFactor)
 		writeCurrentTimestep(antenna1, antenna2);
 }
+
+void AveragingWriter::initBaselineDependentFactors()
+{
+	const double
+		speedOfLight = 299792458.0,
+		earthRotationRate = 7.2921150e-5, // rad/s
+		maxPhaseChange = std::sqrt(24.0 * _maxDecorrelation);
+	double maxFrequency = 0.0;
+	for(const Writer::ChannelInfo& channel : _originalChannels)
+		maxFrequency = std::max(maxFrequency, channel.chanFreq);
+	const double
+		minWavelength = speedOfLight / maxFrequency,
+		avgTimestep = _integrationTime * _timeAvgFactor,
+		avgChannelWidth = std::fabs(_originalChannels.front().chanWidth) * _freqAvgFactor;
+	
+	// Baselines of zero length do not decorrelate, and are averaged as far as allowed
+	const size_t
+		timeMultiplierLimit = powerOfTwoFactor(_maxTimeMultiplier, _maxTimeMultiplier),
+		freqMultiplierLimit = powerOfTwoFactor(_maxFreqMultiplier, _maxFreqMultiplier);
+	
+	// Spectral window of each frequency multiplier; the band of the writer is window 0
+	std::map<size_t, size_t> windows;
+	windows.emplace(1, 0);
+	size_t minTimeMultiplier = timeMultiplierLimit, maxTimeMultiplier = 1;
+	for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
+	{
+		for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
+		{
+			const Writer::AntennaInfo &a1 = _antennae[antenna1], &a2 = _antennae[antenna2];
+			const double
+				dx = a1.x - a2.x, dy = a1.y - a2.y, dz = a1.z - a2.z,
+				phaseRatePerLength = 2.0 * M_PI * std::sqrt(dx*dx + dy*dy + dz*dz) * _fieldRadius;
+			size_t timeMultiplier, freqMultiplier;
+			if(phaseRatePerLength != 0.0)
+			{
+				const double
+					maxDuration = maxPhaseChange * minWavelength / (phaseRatePerLength * earthRotationRate),
+					maxBandwidth = maxPhaseChange * speedOfLight / phaseRatePerLength;
+				timeMultiplier = powerOfTwoFactor(maxDuration / avgTimestep, _maxTimeMultiplier);
+				freqMultiplier = powerOfTwoFactor(maxBandwidth / avgChannelWidth, _maxFreqMultiplier);
+			}
+			else {
+				timeMultiplier = timeMultiplierLimit;
+				freqMultiplier = freqMultiplierLimit;
+			}
+			// The averaged channels of a window should cover the band
+			while(_avgChannelCount % freqMultiplier != 0)
+				freqMultiplier /= 2;
+			
+			std::map<size_t, size_t>::iterator window = windows.find(freqMultiplier);
+			if(window == windows.end())
+			{
+				const size_t index = _writer->AddSpectralWindow(_bandName, AverageChannels(_originalChannels, _freqAvgFactor * freqMultiplier), _refFreq, _totalBandwidth);
+				window = windows.emplace(freqMultiplier, index).first;
+			}
+			
+			Buffer &buffer = getBuffer(antenna1, antenna2);
+			buffer._timeAvgFactor = _timeAvgFactor * timeMultiplier;
+			buffer._freqAvgFactor = _freqAvgFactor * freqMultiplier;
+			buffer._channelCount = _avgChannelCount / freqMultiplier;
+			buffer._window = window->second;
+			minTimeMultiplier = std::min(minTimeMultiplier, timeMultiplier);
+			maxTimeMultiplier = std::max(maxTimeMultiplier, timeMultiplier);
+		}
+	}
+	std::cout << "Baseline-dependent averaging: extra time averaging " << minTimeMultiplier << "-" << maxTimeMultiplier
+		<< "x, extra frequency averaging 1-" << windows.rbegin()->first << "x in " << windows.size() << " spectral windows.\n";
+}
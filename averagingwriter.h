@@ -5,6 +5,7 @@
 
 #include <iostream>
 #include <memory>
+#include <utility>
 
 class UVWCalculater
 {
@@ -18,15 +19,42 @@ class AveragingWriter final : public Writer
 	public:
 		AveragingWriter(std::unique_ptr<Writer>&& writer, size_t timeCount, size_t freqAvgFactor, UVWCalculater& uvwCalculater)
 		: _writer(std::move(writer)), _timeAvgFactor(timeCount), _freqAvgFactor(freqAvgFactor), _rowsAdded(0),
-		_originalChannelCount(0), _avgChannelCount(0), _antennaCount(0), _uvwCalculater(uvwCalculater)
+		_originalChannelCount(0), _avgChannelCount(0), _antennaCount(0), _uvwCalculater(uvwCalculater),
+		_isBaselineDependent(false), _maxDecorrelation(0.0), _fieldRadius(0.0), _integrationTime(0.0),
+		_maxTimeMultiplier(1), _maxFreqMultiplier(1), _refFreq(0.0), _totalBandwidth(0.0)
 		{
 		}
 		
+		/** Rows that are not yet written are lost; Flush() should be called after the last row. */
 		virtual ~AveragingWriter() final override
 		{
 			destroyBuffers();
 		}
 		
+		/**
+		 * Averages each baseline further than the time and frequency averaging factors, by as
+		 * much as its length allows. A source at @p fieldRadius from the phase centre changes phase
+		 * over an averaged sample by 2 pi L r omega_E dt / lambda in time and by 2 pi L r dnu / c in
+		 * frequency, for a baseline of length L, which equals the length of its UVW vector. Averaging
+		 * a phase change phi decorrelates by 1 - sinc(phi/2) ~ phi^2/24, which may be at most
+		 * @p maxDecorrelation, for time and frequency separately.
+		 *
+		 * The extra factors are powers of two up to the given maxima, so that all baselines are
+		 * aligned when the baselines with the largest factor are. Each frequency factor is written
+		 * as its own spectral window, and rows are added as they complete. Should be called before
+		 * the antennae and band are written.
+		 * @param integrationTime Duration of the timesteps given to the writer, in s.
+		 */
+		void SetBaselineDependentAveraging(double maxDecorrelation, double fieldRadius, double integrationTime, size_t maxTimeMultiplier, size_t maxFreqMultiplier)
+		{
+			_isBaselineDependent = true;
+			_maxDecorrelation = maxDecorrelation;
+			_fieldRadius = fieldRadius;
+			_integrationTime = integrationTime;
+			_maxTimeMultiplier = maxTimeMultiplier;
+			_maxFreqMultiplier = maxFreqMultiplier;
+		}
+		
 		virtual void WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow) final override
 		{
 			if(channels.size()%_freqAvgFactor != 0)
@@ -37,38 +65,53 @@ class AveragingWriter final : public Writer
 			_avgChannelCount = channels.size() / _freqAvgFactor;
 			_originalChannelCount = channels.size();
 			
-			std::vector<Writer::ChannelInfo> avgChannels(_avgChannelCount);
-			for(size_t ch=0; ch!=_avgChannelCount; ++ch)
+			std::vector<Writer::ChannelInfo> avgChannels = AverageChannels(channels, _freqAvgFactor);
+			
+			_writer->WriteBandInfo(name, avgChannels, refFreq, totalBandwidth, flagRow);
+			_bandName = name;
+			_originalChannels = channels;
+			_refFreq = refFreq;
+			_totalBandwidth = totalBandwidth;
+			
+			if(_antennaCount != 0)
+				initBuffers();
+		}
+		
+		/**
+		 * Returns the channel info that results from averaging every @p freqAvgFactor channels
+		 * together. Remaining channels at the end are left out.
+		 */
+		static std::vector<Writer::ChannelInfo> AverageChannels(const std::vector<Writer::ChannelInfo> &channels, size_t freqAvgFactor)
+		{
+			std::vector<Writer::ChannelInfo> avgChannels(channels.size() / freqAvgFactor);
+			for(size_t ch=0; ch!=avgChannels.size(); ++ch)
 			{
 				Writer::ChannelInfo channel;
 				channel.chanFreq = 0.0;
 				channel.chanWidth = 0.0;
 				channel.effectiveBW = 0.0;
 				channel.resolution = 0.0;
-				for(size_t i=0; i!=_freqAvgFactor; ++i)
+				for(size_t i=0; i!=freqAvgFactor; ++i)
 				{
-					const Writer::ChannelInfo& curChannel = channels[ch*_freqAvgFactor + i];
+					const Writer::ChannelInfo& curChannel = channels[ch*freqAvgFactor + i];
 					channel.chanFreq += curChannel.chanFreq;
 					channel.chanWidth += curChannel.chanWidth;
 					channel.effectiveBW += curChannel.effectiveBW;
 					channel.resolution += curChannel.resolution;
 				}
 				
-				channel.chanFreq /= (double) _freqAvgFactor;
+				channel.chanFreq /= (double) freqAvgFactor;
 				
 				avgChannels[ch] = channel;
 			}
-			
-			_writer->WriteBandInfo(name, avgChannels, refFreq, totalBandwidth, flagRow);
-			
-			if(_antennaCount != 0)
-				initBuffers();
+			return avgChannels;
 		}
 		
 		virtual void WriteAntennae(const std::vector<Writer::AntennaInfo> &antennae, double time) final override
 		{
 			_writer->WriteAntennae(antennae, time);
 			
+			_antennae = antennae;
 			_antennaCount = antennae.size();
 			if(_originalChannelCount != 0)
 				initBuffers();
@@ -101,6 +144,13 @@ class AveragingWriter final : public Writer
 		
 		virtual void AddRows(size_t rowCount) final override
 		{
+			// With baseline-dependent averaging, the rows that completed during the previous
+			// timestep are added
+			if(_isBaselineDependent)
+			{
+				writePendingRows();
+				return;
+			}
 			if(_rowsAdded == 0)
 				_writer->AddRows(rowCount);
 			_rowsAdded++;
@@ -115,9 +165,19 @@ class AveragingWriter final : public Writer
 			_writer->WriteHistoryItem(commandLine, application, params);
 		}
 		
+		/**
+		 * Rows that are still being averaged are not flushed, so this should be called
+		 * when the written timesteps are aligned.
+		 */
+		virtual void Flush() final override
+		{
+			writePendingRows();
+			_writer->Flush();
+		}
+		
 		virtual bool IsTimeAligned(size_t antenna1, size_t antenna2) final override {
 			const Buffer &buffer = getBuffer(antenna1, antenna2);
-			return buffer._rowTimestepCount==0;
+			return buffer._rowTimestepCount==0 || buffer._isPending;
 		}
 		
 		virtual bool AreAntennaPositionsLocal() const final override
@@ -152,6 +212,7 @@ class AveragingWriter final : public Writer
 			
 			void initZero(size_t avgChannelCount)
 			{
+				_isPending = false;
 				_rowTime = 0.0;
 				_rowTimestepCount = 0;
 				_interval = 0.0;
@@ -165,6 +226,11 @@ class AveragingWriter final : public Writer
 				}
 			}
 			
+			// The averaging of this baseline; the buffers have room for the band of the writer
+			size_t _timeAvgFactor, _freqAvgFactor, _channelCount, _window;
+			// Set when the averaged row is complete but not yet written
+			bool _isPending;
+			double _u, _v, _w;
 			double _rowTime;
 			size_t _rowTimestepCount;
 			double _interval;
@@ -177,17 +243,16 @@ class AveragingWriter final : public Writer
 		void writeCurrentTimestep(size_t antenna1, size_t antenna2)
 		{
 			Buffer& buffer = getBuffer(antenna1, antenna2);
-			double time = buffer._rowTime / buffer._rowTimestepCount;
-			double u, v, w;
-			_uvwCalculater.CalculateUVW(time, antenna1, antenna2, u, v, w);
+			buffer._rowTime /= buffer._rowTimestepCount;
+			_uvwCalculater.CalculateUVW(buffer._rowTime, antenna1, antenna2, buffer._u, buffer._v, buffer._w);
 			
-			for(size_t ch=0;ch!=_avgChannelCount*4;++ch)
+			for(size_t ch=0;ch!=buffer._channelCount*4;++ch)
 			{
 				if(buffer._rowCounts[ch]==0)
 				{
 					buffer._rowData[ch] = std::complex<float>(
-						buffer._flaggedAndUnflaggedData[ch].real() / (buffer._rowTimestepCount*_freqAvgFactor),
-						buffer._flaggedAndUnflaggedData[ch].imag() / (buffer._rowTimestepCount*_freqAvgFactor));
+						buffer._flaggedAndUnflaggedData[ch].real() / (buffer._rowTimestepCount*buffer._freqAvgFactor),
+						buffer._flaggedAndUnflaggedData[ch].imag() / (buffer._rowTimestepCount*buffer._freqAvgFactor));
 					buffer._rowFlags[ch] = true;
 				} else {
 					buffer._rowData[ch] = std::complex<float>(
@@ -197,11 +262,47 @@ class AveragingWriter final : public Writer
 				}
 			}
 			
-			_writer->WriteRow(time, time, antenna1, antenna2, u, v, w, buffer._interval, buffer._rowData, buffer._rowFlags, buffer._rowWeights);
+			if(_isBaselineDependent)
+			{
+				buffer._isPending = true;
+				_pendingBaselines.emplace_back(antenna1, antenna2);
+			}
+			else {
+				writeBuffer(buffer, antenna1, antenna2);
+			}
+		}
+		
+		void writeBuffer(Buffer& buffer, size_t antenna1, size_t antenna2)
+		{
+			if(buffer._window == 0)
+				_writer->WriteRow(buffer._rowTime, buffer._rowTime, antenna1, antenna2, buffer._u, buffer._v, buffer._w, buffer._interval, buffer._rowData, buffer._rowFlags, buffer._rowWeights);
+			else
+				_writer->WriteWindowRow(buffer._window, buffer._rowTime, buffer._rowTime, antenna1, antenna2, buffer._u, buffer._v, buffer._w, buffer._interval, buffer._rowData, buffer._rowFlags, buffer._rowWeights);
 			
 			buffer.initZero(_avgChannelCount);
 		}
 		
+		void writePendingRows()
+		{
+			if(_pendingBaselines.empty())
+				return;
+			_writer->AddRows(_pendingBaselines.size());
+			for(const std::pair<size_t, size_t>& baseline : _pendingBaselines)
+				writeBuffer(getBuffer(baseline.first, baseline.second), baseline.first, baseline.second);
+			_pendingBaselines.clear();
+		}
+		
+		/** Returns the largest power of two that is at most @p allowed and @p maxFactor, and at least one. */
+		static size_t powerOfTwoFactor(double allowed, size_t maxFactor)
+		{
+			size_t factor = 1;
+			while(factor*2 <= maxFactor && factor*2 <= allowed)
+				factor *= 2;
+			return factor;
+		}
+		
+		void initBaselineDependentFactors();
+		
 		Buffer &getBuffer(size_t antenna1, size_t antenna2)
 		{
 			return *_buffers[antenna1*_antennaCount + antenna2];
@@ -224,9 +325,15 @@ class AveragingWriter final : public Writer
 				for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
 				{
 					Buffer *buffer = new Buffer(_avgChannelCount);
+					buffer->_timeAvgFactor = _timeAvgFactor;
+					buffer->_freqAvgFactor = _freqAvgFactor;
+					buffer->_channelCount = _avgChannelCount;
+					buffer->_window = 0;
 					setBuffer(antenna1, antenna2, buffer);
 				}
 			}
+			if(_isBaselineDependent)
+				initBaselineDependentFactors();
 		}
 		
 		void destroyBuffers()
@@ -247,6 +354,15 @@ class AveragingWriter final : public Writer
 		size_t _originalChannelCount, _avgChannelCount, _antennaCount;
 		UVWCalculater& _uvwCalculater;
 		std::vector<Buffer*> _buffers;
+		
+		bool _isBaselineDependent;
+		double _maxDecorrelation, _fieldRadius, _integrationTime;
+		size_t _maxTimeMultiplier, _maxFreqMultiplier;
+		std::vector<Writer::AntennaInfo> _antennae;
+		std::string _bandName;
+		std::vector<Writer::ChannelInfo> _originalChannels;
+		double _refFreq, _totalBandwidth;
+		std::vector<std::pair<size_t, size_t>> _pendingBaselines;
 };
 
 #endif
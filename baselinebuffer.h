@@ -3,6 +3,8 @@
 
 #include <cstring>
 
+#include <stdint.h>
+
 class BaselineBuffer
 {
 	public:
@@ -12,6 +14,7 @@ class BaselineBuffer
 			for(size_t p=0; p!=4; ++p)
 			{
 				real[p] = 0; imag[p] = 0;
+				compactReal[p] = 0; compactImag[p] = 0;
 			}
 		}
 		
@@ -22,6 +25,8 @@ class BaselineBuffer
 			{
 				real[p] = source.real[p];
 				imag[p] = source.imag[p];
+				compactReal[p] = source.compactReal[p];
+				compactImag[p] = source.compactImag[p];
 			}
 		}
 		
@@ -32,11 +37,21 @@ class BaselineBuffer
 			{
 				real[p] = source.real[p];
 				imag[p] = source.imag[p];
+				compactReal[p] = source.compactReal[p];
+				compactImag[p] = source.compactImag[p];
 			}
 			return *this;
 		}
 		
+		bool IsCompact() const
+		{
+			return compactReal[0] != 0 || compactReal[1] != 0 || compactReal[2] != 0 || compactReal[3] != 0;
+		}
+		
 		float *real[4], *imag[4];
+		// Destination for bfloat16 values, see CompactImageSet. Only one of real/imag and
+		// compactReal/compactImag is set.
+		uint16_t *compactReal[4], *compactImag[4];
 		size_t nElementsPerRow;
 };
 
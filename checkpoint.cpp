@@ -0,0 +1,94 @@
+#include "checkpoint.h"
+
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+	volatile std::sig_atomic_t terminationRequested = 0;
+
+	void onTermination(int)
+	{
+		terminationRequested = 1;
+	}
+}
+
+bool Checkpoint::Read(const std::string& filename)
+{
+	std::ifstream file(filename);
+	if(!file.good())
+		return false;
+	std::string magic;
+	int version = 0;
+	file >> magic >> version;
+	if(magic != "cotter-checkpoint" || version != 1)
+		throw std::runtime_error("File " + filename + " is not a checkpoint file of this version of Cotter");
+
+	ChunkEnds.clear();
+	std::string key;
+	while(file >> key)
+	{
+		if(key == "scans")
+			file >> ScanCount;
+		else if(key == "subbands")
+			file >> SubbandStart >> SubbandEnd;
+		else if(key == "averaging")
+			file >> TimeAvgFactor >> FreqAvgFactor;
+		else if(key == "rows")
+			file >> RowCount;
+		else if(key == "chunks")
+		{
+			size_t count = 0;
+			file >> count;
+			ChunkEnds.resize(count);
+			for(size_t& chunkEnd : ChunkEnds)
+				file >> chunkEnd;
+		}
+		else if(key == "complete")
+			file >> IsComplete;
+		else
+			throw std::runtime_error("Unknown entry '" + key + "' in checkpoint file " + filename);
+	}
+	if(file.bad() || (file.fail() && !file.eof()))
+		throw std::runtime_error("Error reading checkpoint file " + filename);
+	return true;
+}
+
+void Checkpoint::Write(const std::string& filename) const
+{
+	const std::string tempFilename = filename + ".tmp";
+	{
+		std::ofstream file(tempFilename);
+		file << "cotter-checkpoint 1\n"
+			<< "scans " << ScanCount << '\n'
+			<< "subbands " << SubbandStart << ' ' << SubbandEnd << '\n'
+			<< "averaging " << TimeAvgFactor << ' ' << FreqAvgFactor << '\n'
+			<< "rows " << RowCount << '\n'
+			<< "chunks " << ChunkEnds.size();
+		for(size_t chunkEnd : ChunkEnds)
+			file << ' ' << chunkEnd;
+		file << '\n'
+			<< "complete " << (IsComplete ? 1 : 0) << '\n';
+		file.flush();
+		if(!file.good())
+			throw std::runtime_error("Error writing checkpoint file " + tempFilename);
+	}
+	if(std::rename(tempFilename.c_str(), filename.c_str()) != 0)
+		throw std::runtime_error("Could not rename " + tempFilename + " to " + filename);
+}
+
+void Checkpoint::Remove(const std::string& filename)
+{
+	std::remove(filename.c_str());
+}
+
+void Checkpoint::InstallTerminationHandler()
+{
+	std::signal(SIGTERM, onTermination);
+}
+
+bool Checkpoint::IsTerminationRequested()
+{
+	return terminationRequested != 0;
+}
@@ -0,0 +1,61 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+
+/**
+ * Records how far the processing of a band has progressed, so that an interrupted
+ * run can be resumed. It is written after every chunk whose rows have all been
+ * written to the output. The ends of all chunks are stored, such that the resumed
+ * run can skip the gpubox files in the same steps as they were read.
+ *
+ * The file is a small text file next to the output, written to a temporary
+ * file first and then renamed, so that it is always complete.
+ */
+class Checkpoint
+{
+	public:
+		Checkpoint() :
+			ScanCount(0), SubbandStart(0), SubbandEnd(0), TimeAvgFactor(1), FreqAvgFactor(1),
+			RowCount(0), IsComplete(false)
+		{ }
+
+		/** Name of the checkpoint file belonging to an output file. */
+		static std::string Filename(const std::string& outputFilename)
+		{
+			return outputFilename + ".checkpoint";
+		}
+
+		/**
+		 * Read a checkpoint file.
+		 * @returns false if the file does not exist.
+		 */
+		bool Read(const std::string& filename);
+
+		void Write(const std::string& filename) const;
+
+		static void Remove(const std::string& filename);
+
+		/** Number of scans that have been committed to the output. */
+		size_t CommittedScans() const { return ChunkEnds.empty() ? 0 : ChunkEnds.back(); }
+
+		/**
+		 * Makes SIGTERM request a stop instead of terminating the process, so that
+		 * the processing can stop cleanly after writing a checkpoint.
+		 */
+		static void InstallTerminationHandler();
+
+		static bool IsTerminationRequested();
+
+		// Settings of the run, which should match when resuming
+		size_t ScanCount, SubbandStart, SubbandEnd, TimeAvgFactor, FreqAvgFactor;
+		// Number of rows in the output that are complete
+		size_t RowCount;
+		// End scan of each chunk that was processed
+		std::vector<size_t> ChunkEnds;
+		// Set when the band has been completely processed
+		bool IsComplete;
+};
+
+#endif
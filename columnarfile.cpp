@@ -0,0 +1,241 @@
+#include "columnarfile.h"
+
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+	// Strings are quoted, so that they can contain spaces
+	void writeString(std::ostream& stream, const std::string& str)
+	{
+		stream << ' ' << std::quoted(str);
+	}
+
+	std::string readString(std::istream& stream)
+	{
+		std::string str;
+		stream >> std::quoted(str);
+		return str;
+	}
+}
+
+void ColumnarFile::Metadata::Write(const std::string& filename) const
+{
+	std::ofstream file(filename);
+	file << std::setprecision(std::numeric_limits<double>::max_digits10);
+	file << "cotter-columnar 1\n"
+		<< "rows " << rowCount << '\n'
+		<< "band";
+	writeString(file, bandName);
+	file << ' ' << refFreq << ' ' << totalBandwidth << ' ' << bandFlagRow << ' ' << channels.size() << '\n';
+	for(const Writer::ChannelInfo& channel : channels)
+		file << "channel " << channel.chanFreq << ' ' << channel.chanWidth << ' ' << channel.effectiveBW << ' ' << channel.resolution << '\n';
+	file << "array " << arrayX << ' ' << arrayY << ' ' << arrayZ << '\n'
+		<< "antennae " << antennaDate << ' ' << antennae.size() << '\n';
+	for(const Writer::AntennaInfo& antenna : antennae)
+	{
+		file << "antenna";
+		writeString(file, antenna.name);
+		writeString(file, antenna.station);
+		writeString(file, antenna.type);
+		writeString(file, antenna.mount);
+		file << ' ' << antenna.x << ' ' << antenna.y << ' ' << antenna.z << ' ' << antenna.diameter << ' ' << antenna.flag << '\n';
+	}
+	file << "polarization " << polarizationFlagRow << '\n'
+		<< "source " << source.sourceId << ' ' << source.time << ' ' << source.interval << ' ' << source.spectralWindowId << ' ' << source.numLines;
+	writeString(file, source.name);
+	file << ' ' << source.calibrationGroup;
+	writeString(file, source.code);
+	file << ' ' << source.directionRA << ' ' << source.directionDec << ' ' << source.properMotion[0] << ' ' << source.properMotion[1] << '\n'
+		<< "field";
+	writeString(file, field.name);
+	writeString(file, field.code);
+	file << ' ' << field.time << ' ' << field.numPoly << ' ' << field.delayDirRA << ' ' << field.delayDirDec << ' '
+		<< field.phaseDirRA << ' ' << field.phaseDirDec << ' ' << field.referenceDirRA << ' ' << field.referenceDirDec << ' '
+		<< field.sourceId << ' ' << field.flagRow << '\n'
+		<< "observation";
+	writeString(file, observation.telescopeName);
+	file << ' ' << observation.startTime << ' ' << observation.endTime;
+	writeString(file, observation.observer);
+	writeString(file, observation.scheduleType);
+	writeString(file, observation.project);
+	file << ' ' << observation.releaseDate << ' ' << observation.flagRow << '\n'
+		<< "history";
+	writeString(file, historyCommandLine);
+	writeString(file, historyApplication);
+	file << ' ' << historyParams.size();
+	for(const std::string& param : historyParams)
+		writeString(file, param);
+	file << '\n';
+	if(!file.good())
+		throw std::runtime_error("Error writing " + filename);
+}
+
+void ColumnarFile::Metadata::Read(const std::string& filename)
+{
+	std::ifstream file(filename);
+	if(!file.good())
+		throw std::runtime_error("Can not open " + filename);
+	std::string magic;
+	int version = 0;
+	file >> magic >> version;
+	if(magic != "cotter-columnar" || version != 1)
+		throw std::runtime_error(filename + " is not the header of a columnar set of this version of Cotter");
+
+	std::string key;
+	while(file >> key)
+	{
+		if(key == "rows")
+			file >> rowCount;
+		else if(key == "band")
+		{
+			size_t channelCount;
+			bandName = readString(file);
+			file >> refFreq >> totalBandwidth >> bandFlagRow >> channelCount;
+			channels.clear();
+			channels.reserve(channelCount);
+		}
+		else if(key == "channel")
+		{
+			Writer::ChannelInfo channel;
+			file >> channel.chanFreq >> channel.chanWidth >> channel.effectiveBW >> channel.resolution;
+			channels.push_back(channel);
+		}
+		else if(key == "array")
+			file >> arrayX >> arrayY >> arrayZ;
+		else if(key == "antennae")
+		{
+			size_t antennaCount;
+			file >> antennaDate >> antennaCount;
+			antennae.clear();
+			antennae.reserve(antennaCount);
+		}
+		else if(key == "antenna")
+		{
+			Writer::AntennaInfo antenna;
+			antenna.name = readString(file);
+			antenna.station = readString(file);
+			antenna.type = readString(file);
+			antenna.mount = readString(file);
+			file >> antenna.x >> antenna.y >> antenna.z >> antenna.diameter >> antenna.flag;
+			antennae.push_back(antenna);
+		}
+		else if(key == "polarization")
+			file >> polarizationFlagRow;
+		else if(key == "source")
+		{
+			file >> source.sourceId >> source.time >> source.interval >> source.spectralWindowId >> source.numLines;
+			source.name = readString(file);
+			file >> source.calibrationGroup;
+			source.code = readString(file);
+			file >> source.directionRA >> source.directionDec >> source.properMotion[0] >> source.properMotion[1];
+		}
+		else if(key == "field")
+		{
+			field.name = readString(file);
+			field.code = readString(file);
+			file >> field.time >> field.numPoly >> field.delayDirRA >> field.delayDirDec
+				>> field.phaseDirRA >> field.phaseDirDec >> field.referenceDirRA >> field.referenceDirDec
+				>> field.sourceId >> field.flagRow;
+		}
+		else if(key == "observation")
+		{
+			observation.telescopeName = readString(file);
+			file >> observation.startTime >> observation.endTime;
+			observation.observer = readString(file);
+			observation.scheduleType = readString(file);
+			observation.project = readString(file);
+			file >> observation.releaseDate >> observation.flagRow;
+		}
+		else if(key == "history")
+		{
+			size_t paramCount;
+			historyCommandLine = readString(file);
+			historyApplication = readString(file);
+			file >> paramCount;
+			historyParams.resize(paramCount);
+			for(std::string& param : historyParams)
+				param = readString(file);
+		}
+		else
+			throw std::runtime_error("Unknown entry '" + key + "' in " + filename);
+		if(file.fail())
+			throw std::runtime_error("Error reading entry '" + key + "' of " + filename);
+	}
+}
+
+ColumnarFile::ColumnarFile(const std::string& path) :
+	_path(path)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+	throw std::runtime_error("Columnar sets can only be read on little-endian machines");
+#endif
+	_metadata.Read(ColumnFilename(path, "header"));
+	const size_t values = ValuesPerRow();
+	map(_data, "data", values * sizeof(std::complex<float>));
+	map(_flags, "flags", FlagWordsPerRow(values) * sizeof(uint64_t));
+	map(_weights, "weights", values * sizeof(float));
+	map(_uvw, "uvw", 3 * sizeof(double));
+	map(_times, "time", 3 * sizeof(double));
+	map(_antennas, "antennas", 2 * sizeof(uint32_t));
+}
+
+ColumnarFile::~ColumnarFile()
+{
+	unmap(_data);
+	unmap(_flags);
+	unmap(_weights);
+	unmap(_uvw);
+	unmap(_times);
+	unmap(_antennas);
+}
+
+void ColumnarFile::map(MappedColumn& column, const char* name, size_t rowSize)
+{
+	const std::string filename = ColumnFilename(_path, name);
+	const size_t size = rowSize * _metadata.rowCount;
+	int fd = open(filename.c_str(), O_RDONLY);
+	if(fd < 0)
+		throw std::runtime_error("Can not open " + filename);
+	struct stat fileStatus;
+	if(fstat(fd, &fileStatus) != 0 || size_t(fileStatus.st_size) < size)
+	{
+		close(fd);
+		throw std::runtime_error(filename + " is shorter than the number of rows in the header");
+	}
+	if(size != 0)
+	{
+		void* address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		if(address == MAP_FAILED)
+		{
+			close(fd);
+			throw std::runtime_error("Can not map " + filename + " into memory");
+		}
+		column.address = address;
+		column.size = size;
+	}
+	// The mapping stays valid after closing the file
+	close(fd);
+}
+
+void ColumnarFile::unmap(MappedColumn& column)
+{
+	if(column.size != 0)
+		munmap(const_cast<void*>(column.address), column.size);
+	column.address = nullptr;
+	column.size = 0;
+}
+
+void ColumnarFile::Flags(size_t row, bool* output) const
+{
+	const uint64_t* words = PackedFlags(row);
+	const size_t values = ValuesPerRow();
+	for(size_t i=0; i!=values; ++i)
+		output[i] = (words[i/64] >> (i%64)) & 1;
+}
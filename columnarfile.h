@@ -0,0 +1,113 @@
+#ifndef COLUMNAR_FILE_H
+#define COLUMNAR_FILE_H
+
+#include "writer.h"
+
+#include <complex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * Read access to the native columnar visibility format of Cotter, as written by
+ * ColumnarWriter. A columnar set is a directory with one file per column, in which
+ * the values of each row follow those of the previous row without gaps:
+ * - data: complex floats, channelCount x 4 per row (polarization fastest)
+ * - flags: bit-packed flags of the data values, as 64-bit words, ceil(channelCount*4/64) per row
+ * - weights: floats, channelCount x 4 per row
+ * - uvw: three doubles per row
+ * - time: three doubles per row: time, time centroid and interval
+ * - antennas: two 32-bit unsigned integers per row
+ * All values are little endian. The file "header" holds the row count and the
+ * metadata of the set as text. Columns are memory mapped, so that the rows can be
+ * accessed without copying.
+ */
+class ColumnarFile
+{
+	public:
+		struct Metadata
+		{
+			Metadata() :
+				rowCount(0), refFreq(0.0), totalBandwidth(0.0), bandFlagRow(false),
+				arrayX(0.0), arrayY(0.0), arrayZ(0.0), antennaDate(0.0), polarizationFlagRow(false),
+				source(), field(), observation()
+			{ }
+
+			size_t rowCount;
+			std::string bandName;
+			std::vector<Writer::ChannelInfo> channels;
+			double refFreq, totalBandwidth;
+			bool bandFlagRow;
+			double arrayX, arrayY, arrayZ;
+			std::vector<Writer::AntennaInfo> antennae;
+			double antennaDate;
+			bool polarizationFlagRow;
+			Writer::SourceInfo source;
+			Writer::FieldInfo field;
+			Writer::ObservationInfo observation;
+			std::string historyCommandLine, historyApplication;
+			std::vector<std::string> historyParams;
+
+			void Write(const std::string& filename) const;
+			void Read(const std::string& filename);
+		};
+
+		explicit ColumnarFile(const std::string& path);
+		~ColumnarFile();
+
+		const Metadata& GetMetadata() const { return _metadata; }
+		size_t RowCount() const { return _metadata.rowCount; }
+		/** Number of data values, flags and weights in each row. */
+		size_t ValuesPerRow() const { return _metadata.channels.size() * 4; }
+
+		const std::complex<float>* Data(size_t row) const
+		{
+			return static_cast<const std::complex<float>*>(_data.address) + row * ValuesPerRow();
+		}
+		const float* Weights(size_t row) const
+		{
+			return static_cast<const float*>(_weights.address) + row * ValuesPerRow();
+		}
+		const double* UVW(size_t row) const
+		{
+			return static_cast<const double*>(_uvw.address) + row * 3;
+		}
+		const double* Times(size_t row) const
+		{
+			return static_cast<const double*>(_times.address) + row * 3;
+		}
+		const uint32_t* Antennas(size_t row) const
+		{
+			return static_cast<const uint32_t*>(_antennas.address) + row * 2;
+		}
+		const uint64_t* PackedFlags(size_t row) const
+		{
+			return static_cast<const uint64_t*>(_flags.address) + row * FlagWordsPerRow(ValuesPerRow());
+		}
+		/** Unpacks the flags of a row into ValuesPerRow() booleans. */
+		void Flags(size_t row, bool* output) const;
+
+		static size_t FlagWordsPerRow(size_t valuesPerRow) { return (valuesPerRow + 63) / 64; }
+		static std::string ColumnFilename(const std::string& path, const char* column) { return path + '/' + column; }
+
+	private:
+		struct MappedColumn
+		{
+			MappedColumn() : address(nullptr), size(0) { }
+			const void* address;
+			size_t size;
+		};
+
+		void map(MappedColumn& column, const char* name, size_t rowSize);
+		static void unmap(MappedColumn& column);
+
+		std::string _path;
+		Metadata _metadata;
+		MappedColumn _data, _flags, _weights, _uvw, _times, _antennas;
+
+		ColumnarFile(const ColumnarFile&) = delete;
+		ColumnarFile& operator=(const ColumnarFile&) = delete;
+};
+
+#endif
@@ -0,0 +1,131 @@
+#include "columnarwriter.h"
+#include "packedflagmask.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+	// Column buffers are written once they exceed this size, so that the files
+	// are written with a few large writes instead of one small write per row
+	const size_t columnBufferSize = 8*1024*1024;
+}
+
+ColumnarWriter::ColumnarWriter(const std::string& path) :
+	_path(path)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+	throw std::runtime_error("The columnar output format can only be written on little-endian machines");
+#endif
+	if(mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+		throw std::runtime_error("Could not create directory " + path + ": " + strerror(errno));
+	open(_data, "data");
+	open(_flags, "flags");
+	open(_weights, "weights");
+	open(_uvw, "uvw");
+	open(_times, "time");
+	open(_antennas, "antennas");
+}
+
+ColumnarWriter::~ColumnarWriter()
+{
+	// Errors are reported by the explicit Flush() after the last row; a destructor can not throw
+	try {
+		Flush();
+	} catch(std::exception& e) {
+		std::cerr << "Error while closing " << _path << ": " << e.what() << '\n';
+	}
+	close(_data);
+	close(_flags);
+	close(_weights);
+	close(_uvw);
+	close(_times);
+	close(_antennas);
+}
+
+void ColumnarWriter::open(Column& column, const char* name)
+{
+	column.filename = ColumnarFile::ColumnFilename(_path, name);
+	column.fd = ::open(column.filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(column.fd < 0)
+		throw std::runtime_error("Could not create " + column.filename + ": " + strerror(errno));
+	column.buffer.reserve(columnBufferSize);
+}
+
+void ColumnarWriter::close(Column& column)
+{
+	if(column.fd >= 0)
+		::close(column.fd);
+	column.fd = -1;
+}
+
+void ColumnarWriter::append(Column& column, const void* values, size_t size)
+{
+	const char* bytes = static_cast<const char*>(values);
+	column.buffer.insert(column.buffer.end(), bytes, bytes + size);
+	if(column.buffer.size() >= columnBufferSize)
+		writeBuffer(column);
+}
+
+void ColumnarWriter::writeBuffer(Column& column)
+{
+	const char* position = column.buffer.data();
+	size_t remaining = column.buffer.size();
+	while(remaining != 0)
+	{
+		ssize_t written = ::write(column.fd, position, remaining);
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			throw std::runtime_error("Error writing " + column.filename + ": " + strerror(errno));
+		}
+		position += written;
+		remaining -= written;
+	}
+	column.buffer.clear();
+}
+
+void ColumnarWriter::WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow)
+{
+	_metadata.bandName = name;
+	_metadata.channels = channels;
+	_metadata.refFreq = refFreq;
+	_metadata.totalBandwidth = totalBandwidth;
+	_metadata.bandFlagRow = flagRow;
+	_packedFlags.assign(ColumnarFile::FlagWordsPerRow(channels.size() * 4), 0);
+}
+
+void ColumnarWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	const size_t values = _metadata.channels.size() * 4;
+	append(_data, data, values * sizeof(std::complex<float>));
+	PackedFlagMask::Pack(flags, _packedFlags.data(), values);
+	append(_flags, _packedFlags.data(), _packedFlags.size() * sizeof(uint64_t));
+	append(_weights, weights, values * sizeof(float));
+	const double uvw[3] = { u, v, w };
+	append(_uvw, uvw, sizeof(uvw));
+	const double times[3] = { time, timeCentroid, interval };
+	append(_times, times, sizeof(times));
+	const uint32_t antennas[2] = { uint32_t(antenna1), uint32_t(antenna2) };
+	append(_antennas, antennas, sizeof(antennas));
+	++_metadata.rowCount;
+}
+
+void ColumnarWriter::Flush()
+{
+	writeBuffer(_data);
+	writeBuffer(_flags);
+	writeBuffer(_weights);
+	writeBuffer(_uvw);
+	writeBuffer(_times);
+	writeBuffer(_antennas);
+	// The header is written last, so that it never lists rows that are not
+	// in the column files
+	_metadata.Write(ColumnarFile::ColumnFilename(_path, "header"));
+}
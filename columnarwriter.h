@@ -0,0 +1,85 @@
+#ifndef COLUMNAR_WRITER_H
+#define COLUMNAR_WRITER_H
+
+#include "columnarfile.h"
+#include "writer.h"
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * Writes the native columnar format of Cotter, see @ref ColumnarFile. Rows are
+ * collected per column and written with large sequential writes, which costs
+ * much less CPU than writing a measurement set. The header with the metadata and
+ * row count is written when the writer is flushed or destructed. The cvis2ms tool
+ * converts a columnar set to a measurement set.
+ */
+class ColumnarWriter : public Writer
+{
+	public:
+		explicit ColumnarWriter(const std::string& path);
+		virtual ~ColumnarWriter() final override;
+
+		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override;
+		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override
+		{
+			_metadata.antennae = antennae;
+			_metadata.antennaDate = time;
+		}
+		virtual void WritePolarizationForLinearPols(bool flagRow) final override
+		{
+			_metadata.polarizationFlagRow = flagRow;
+		}
+		virtual void WriteSource(const SourceInfo& source) final override
+		{
+			_metadata.source = source;
+		}
+		virtual void WriteField(const FieldInfo& field) final override
+		{
+			_metadata.field = field;
+		}
+		virtual void WriteObservation(const ObservationInfo& observation) final override
+		{
+			_metadata.observation = observation;
+		}
+		virtual void WriteHistoryItem(const std::string& commandLine, const std::string& application, const std::vector<std::string>& params) final override
+		{
+			_metadata.historyCommandLine = commandLine;
+			_metadata.historyApplication = application;
+			_metadata.historyParams = params;
+		}
+		virtual void SetArrayLocation(double x, double y, double z) final override
+		{
+			_metadata.arrayX = x;
+			_metadata.arrayY = y;
+			_metadata.arrayZ = z;
+		}
+
+		virtual void AddRows(size_t count) final override { }
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		virtual void Flush() final override;
+
+	private:
+		/** A column file with a buffer that is written when it is full. */
+		struct Column
+		{
+			Column() : fd(-1) { }
+			int fd;
+			std::string filename;
+			std::vector<char> buffer;
+		};
+
+		void open(Column& column, const char* name);
+		void append(Column& column, const void* values, size_t size);
+		static void writeBuffer(Column& column);
+		static void close(Column& column);
+
+		std::string _path;
+		ColumnarFile::Metadata _metadata;
+		Column _data, _flags, _weights, _uvw, _times, _antennas;
+		std::vector<uint64_t> _packedFlags;
+};
+
+#endif
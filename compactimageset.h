@@ -0,0 +1,127 @@
+#ifndef COMPACT_IMAGE_SET_H
+#define COMPACT_IMAGE_SET_H
+
+#include <aoflagger.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * A set of images, like aoflagger::ImageSet, that stores its values as
+ * bfloat16: the upper 16 bits of a float. This halves the memory of the
+ * visibilities, at the cost of keeping only 8 bits of mantissa (a relative
+ * precision of about 0.4%). Unlike float16, bfloat16 has the full range of a
+ * float, so that large auto-correlations can not overflow.
+ *
+ * The conversion loops are written without branches, so that the compiler can
+ * vectorize them.
+ */
+class CompactImageSet
+{
+	public:
+		CompactImageSet() : _width(0), _height(0), _imageCount(0), _stride(0) { }
+		
+		CompactImageSet(size_t width, size_t height, size_t imageCount, size_t widthCapacity) :
+			_width(width), _height(height), _imageCount(imageCount), _stride(std::max(width, widthCapacity)),
+			_data(_stride * height * imageCount, 0)
+		{ }
+		
+		size_t Width() const { return _width; }
+		size_t Height() const { return _height; }
+		size_t ImageCount() const { return _imageCount; }
+		size_t HorizontalStride() const { return _stride; }
+		
+		uint16_t* ImageBuffer(size_t imageIndex) { return _data.data() + imageIndex * _stride * _height; }
+		const uint16_t* ImageBuffer(size_t imageIndex) const { return _data.data() + imageIndex * _stride * _height; }
+		
+		void ResizeWithoutReallocation(size_t newWidth)
+		{
+			if(newWidth > _stride)
+				throw std::runtime_error("CompactImageSet::ResizeWithoutReallocation() called with width larger than capacity");
+			_width = newWidth;
+		}
+		
+		/** Sets all values to zero. */
+		void SetZero() { std::fill(_data.begin(), _data.end(), 0); }
+		
+		/**
+		 * Expand all values into a float image set with the same width, height and
+		 * number of images.
+		 */
+		void ExpandTo(aoflagger::ImageSet& destination) const
+		{
+			for(size_t i=0; i!=_imageCount; ++i)
+			{
+				for(size_t y=0; y!=_height; ++y)
+					Expand(ImageBuffer(i) + y*_stride, destination.ImageBuffer(i) + y*destination.HorizontalStride(), _width);
+			}
+		}
+		
+		/** Replace all values by the rounded values of the given float image set. */
+		void CompressFrom(const aoflagger::ImageSet& source)
+		{
+			for(size_t i=0; i!=_imageCount; ++i)
+			{
+				for(size_t y=0; y!=_height; ++y)
+					Compress(source.ImageBuffer(i) + y*source.HorizontalStride(), ImageBuffer(i) + y*_stride, _width);
+			}
+		}
+		
+		/**
+		 * Expand a single column, i.e. all rows of a single timestep, of all images. The
+		 * destination will hold the column of image i at destination + i * Height().
+		 */
+		void ExpandColumn(size_t x, float* destination) const
+		{
+			for(size_t i=0; i!=_imageCount; ++i)
+			{
+				const uint16_t* source = ImageBuffer(i) + x;
+				for(size_t y=0; y!=_height; ++y)
+				{
+					*destination = Expand(*source);
+					++destination;
+					source += _stride;
+				}
+			}
+		}
+		
+		static float Expand(uint16_t value)
+		{
+			const uint32_t bits = uint32_t(value) << 16;
+			float result;
+			memcpy(&result, &bits, sizeof(result));
+			return result;
+		}
+		
+		static uint16_t Compress(float value)
+		{
+			uint32_t bits;
+			memcpy(&bits, &value, sizeof(bits));
+			// Round to nearest even, but keep NaNs NaN
+			const uint32_t rounded = (bits + 0x7FFF + ((bits >> 16) & 1)) >> 16;
+			const uint32_t nan = (bits >> 16) | 0x40;
+			return ((bits & 0x7FFFFFFF) > 0x7F800000) ? nan : rounded;
+		}
+		
+		static void Expand(const uint16_t* source, float* destination, size_t n)
+		{
+			for(size_t i=0; i!=n; ++i)
+				destination[i] = Expand(source[i]);
+		}
+		
+		static void Compress(const float* source, uint16_t* destination, size_t n)
+		{
+			for(size_t i=0; i!=n; ++i)
+				destination[i] = Compress(source[i]);
+		}
+		
+	private:
+		size_t _width, _height, _imageCount, _stride;
+		std::vector<uint16_t> _data;
+};
+
+#endif
@@ -2,6 +2,8 @@
 
 #include "applysolutionswriter.h"
 #include "baselinebuffer.h"
+#include "checkpoint.h"
+#include "columnarwriter.h"
 #include "flagreader.h"
 #include "flagwriter.h"
 #include "fitswriter.h"
@@ -12,7 +14,13 @@
 #include "subbandpassband.h"
 #include "progressbar.h"
 #include "threadedwriter.h"
+#ifdef HAVE_HDF5
+#include "uvh5writer.h"
+#endif
 #include "radeccoord.h"
+#include "shardedmswriter.h"
+#include "sharedmemorywriter.h"
+#include "teewriter.h"
 #include "version.h"
 
 #include <thread>
@@ -23,21 +31,43 @@
 #include <map>
 #include <cmath>
 #include <complex>
+#include <exception>
 
 #include <xmmintrin.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define USE_SSE
 
 using namespace aoflagger;
 
 Cotter::Cotter() :
+	_ownedMWAConfig(new MWAConfig()),
+	_mwaConfig(*_ownedMWAConfig),
 	_unflaggedAntennaCount(0),
+	_readPeakRSS(0),
+	_processPeakRSS(0),
+	_writePeakRSS(0),
 	_threadCount(1),
 	_maxBufferSize(0),
+	_processMemoryBudget(0),
+	_readaheadHDUs(0),
+	_shardCount(1),
+	_statisticsTimeFactor(1),
+	_statisticsFrequencyFactor(1),
+	_followTimeout(0.0),
+	_followWindowScans(0),
 	_subbandCount(24),
 	_quackInitSampleCount(4),
 	_subbandEdgeFlagWidthKHz(80.0),
 	_subbandEdgeFlagCount(2),
+	_subbandsPerPass(0),
+	_passIndex(0),
+	_passCount(1),
+	_passBandSbStart(0),
+	_passStartTime(0),
 	_defaultFilename(true),
 	_rfiDetection(true),
 	_collectStatistics(true),
@@ -47,6 +77,8 @@ Cotter::Cotter() :
 	_applySolutionsBeforeAveraging(false),
 	_disableGeometricCorrections(false),
 	_removeFlaggedAntennae(true),
+	_skipPrunedBaselines(false),
+	_compactVisibilities(false),
 	_removeAutoCorrelations(false),
 	_flagAutos(true),
 	_overridePhaseCentre(false),
@@ -57,22 +89,142 @@ Cotter::Cotter() :
 	_skipWriting(false),
     _doCorrectCableLength(true),
 	_offlineGPUBoxFormat(false),
+	_parallelBands(false),
+	_checkRawStartTime(true),
+	_numaAware(false),
+	_useHDUIndex(false),
+	_follow(false),
+	_resume(false),
 	_customRARad(0.0),
 	_customDecRad(0.0),
 	_initDurationToFlag(4.0),
 	_endDurationToFlag(0.0),
 	_useDysco(false),
+	_compactWeights(false),
 	_dyscoDataBitRate(8),
 	_dyscoWeightBitRate(12),
 	_dyscoDistribution("TruncatedGaussian"),
 	_dyscoNormalization("AF"),
 	_dyscoDistTruncation(2.5),
+	_sharedMemoryTimeout(600.0),
+	_uvh5DeflateLevel(0),
+	_bdaDecorrelation(0.0),
+	_bdaFieldRadius(0.0),
+	_bdaMaxTimeRes(0.0),
+	_bdaMaxFreqRes(0.0),
+	_bdaMaxTimeFactor(1),
+	_bdaMaxFreqFactor(1),
 	_outputData(empty_aligned<std::complex<float>>()),
-	_outputWeights(empty_aligned<float>())
+	_outputWeights(empty_aligned<float>()),
+	_workerGeneration(0),
+	_busyWorkerCount(0),
+	_stopWorkers(false)
 {
 }
 
-Cotter::~Cotter() = default;
+Cotter::Cotter(Cotter& parent, size_t threadCount, size_t maxBufferSize) :
+	_mwaConfig(parent._mwaConfig),
+	_unflaggedAntennaCount(0),
+	_readPeakRSS(0),
+	_processPeakRSS(0),
+	_writePeakRSS(0),
+	_fileSets(parent._fileSets),
+	_threadCount(threadCount),
+	_maxBufferSize(maxBufferSize),
+	_processMemoryBudget(parent.memoryBudget()),
+	_readaheadHDUs(parent._readaheadHDUs),
+	_shardCount(parent._shardCount),
+	_statisticsTimeFactor(parent._statisticsTimeFactor),
+	_statisticsFrequencyFactor(parent._statisticsFrequencyFactor),
+	_followTimeout(parent._followTimeout),
+	_followWindowScans(parent._followWindowScans),
+	_subbandCount(parent._subbandCount),
+	_quackInitSampleCount(parent._quackInitSampleCount),
+	_quackEndSampleCount(parent._quackEndSampleCount),
+	_subbandEdgeFlagWidthKHz(parent._subbandEdgeFlagWidthKHz),
+	_subbandEdgeFlagCount(parent._subbandEdgeFlagCount),
+	_subbandsPerPass(parent._subbandsPerPass),
+	_passIndex(0),
+	_passCount(1),
+	_passBandSbStart(0),
+	_passStartTime(0),
+	_defaultFilename(parent._defaultFilename),
+	_rfiDetection(parent._rfiDetection),
+	_collectStatistics(parent._collectStatistics),
+	_collectHistograms(parent._collectHistograms),
+	_usePointingCentre(parent._usePointingCentre),
+	_outputFormat(parent._outputFormat),
+	_outputFilename(parent._outputFilename),
+	_commandLine(parent._commandLine),
+	_extraOutputs(parent._extraOutputs),
+	_metaFilename(parent._metaFilename),
+	_antennaLocationsFilename(parent._antennaLocationsFilename),
+	_headerFilename(parent._headerFilename),
+	_instrConfigFilename(parent._instrConfigFilename),
+	_subbandPassbandFilename(parent._subbandPassbandFilename),
+	_flagFileTemplate(parent._flagFileTemplate),
+	_qualityStatisticsFilename(parent._qualityStatisticsFilename),
+	_applySolutionsBeforeAveraging(parent._applySolutionsBeforeAveraging),
+	_solutionFilename(parent._solutionFilename),
+	_strategyFilename(parent._strategyFilename),
+	_hduIndexDirectory(parent._hduIndexDirectory),
+	_userFlaggedAntennae(parent._userFlaggedAntennae),
+	_flaggedSubbands(parent._flaggedSubbands),
+	_subbandOrder(parent._subbandOrder),
+	_disableGeometricCorrections(parent._disableGeometricCorrections),
+	_removeFlaggedAntennae(parent._removeFlaggedAntennae),
+	_skipPrunedBaselines(parent._skipPrunedBaselines),
+	_compactVisibilities(parent._compactVisibilities),
+	_removeAutoCorrelations(parent._removeAutoCorrelations),
+	_flagAutos(parent._flagAutos),
+	_overridePhaseCentre(parent._overridePhaseCentre),
+	_doAlign(parent._doAlign),
+	_doFlagMissingSubbands(parent._doFlagMissingSubbands),
+	_applySBGains(parent._applySBGains),
+	_flagDCChannels(parent._flagDCChannels),
+	_skipWriting(parent._skipWriting),
+	_doCorrectCableLength(parent._doCorrectCableLength),
+	_offlineGPUBoxFormat(parent._offlineGPUBoxFormat),
+	_parallelBands(false),
+	// The parent has already corrected the start time, and the metadata is shared
+	_checkRawStartTime(false),
+	_numaAware(parent._numaAware),
+	_useHDUIndex(parent._useHDUIndex),
+	_follow(parent._follow),
+	_resume(parent._resume),
+	_customRARad(parent._customRARad),
+	_customDecRad(parent._customDecRad),
+	_initDurationToFlag(parent._initDurationToFlag),
+	_endDurationToFlag(parent._endDurationToFlag),
+	_useDysco(parent._useDysco),
+	_compactWeights(parent._compactWeights),
+	_dyscoDataBitRate(parent._dyscoDataBitRate),
+	_dyscoWeightBitRate(parent._dyscoWeightBitRate),
+	_dyscoDistribution(parent._dyscoDistribution),
+	_dyscoNormalization(parent._dyscoNormalization),
+	_dyscoDistTruncation(parent._dyscoDistTruncation),
+	_sharedMemoryTimeout(parent._sharedMemoryTimeout),
+	_uvh5DeflateLevel(parent._uvh5DeflateLevel),
+	_bdaDecorrelation(parent._bdaDecorrelation),
+	_bdaFieldRadius(parent._bdaFieldRadius),
+	_bdaMaxTimeRes(parent._bdaMaxTimeRes),
+	_bdaMaxFreqRes(parent._bdaMaxFreqRes),
+	_bdaMaxTimeFactor(parent._bdaMaxTimeFactor),
+	_bdaMaxFreqFactor(parent._bdaMaxFreqFactor),
+	_outputData(empty_aligned<std::complex<float>>()),
+	_outputWeights(empty_aligned<float>()),
+	_workerGeneration(0),
+	_busyWorkerCount(0),
+	_stopWorkers(false)
+{
+	for(size_t p=0; p!=4; ++p)
+		_subbandCorrectionFactors[p] = parent._subbandCorrectionFactors[p];
+}
+
+Cotter::~Cotter()
+{
+	stopWorkers();
+}
 
 void Cotter::Run(double timeRes_s, double freqRes_kHz)
 {
@@ -123,6 +275,20 @@ void Cotter::Run(double timeRes_s, double freqRes_kHz)
 		freqAvgFactor = 1;
 	freqRes_kHz = freqAvgFactor*(1000.0*_mwaConfig.Header().bandwidthMHz / _mwaConfig.Header().nChannels);
 	std::cout << "Output resolution: " << timeRes_s << " s / " << freqRes_kHz << " kHz (time avg: " << timeAvgFactor << "x, freq avg: " << freqAvgFactor << "x).\n";
+	for(ExtraOutput& output : _extraOutputs)
+	{
+		output.timeAvgFactor = std::max<size_t>(1, round(output.timeRes_s/_mwaConfig.Header().integrationTime));
+		output.freqAvgFactor = std::max<size_t>(1, round(output.freqRes_kHz/(1000.0*_mwaConfig.Header().bandwidthMHz / _mwaConfig.Header().nChannels)));
+		std::cout << "Extra output " << output.filename << " (time avg: " << output.timeAvgFactor << "x, freq avg: " << output.freqAvgFactor << "x).\n";
+	}
+	if(_bdaDecorrelation != 0.0)
+	{
+		// The multipliers are relative to the output resolution
+		_bdaMaxTimeFactor = std::max<size_t>(1, _bdaMaxTimeRes / timeRes_s);
+		_bdaMaxFreqFactor = std::max<size_t>(1, _bdaMaxFreqRes / freqRes_kHz);
+		std::cout << "Baseline-dependent averaging with " << _bdaDecorrelation*100.0 << "% decorrelation at " << _bdaFieldRadius*(180.0/M_PI)
+			<< " deg from the phase centre, up to " << _bdaMaxTimeFactor << "x in time and " << _bdaMaxFreqFactor << "x in frequency further.\n";
+	}
 	
 	_subbandEdgeFlagCount = round(_subbandEdgeFlagWidthKHz / (1000.0*_mwaConfig.Header().bandwidthMHz / _mwaConfig.Header().nChannels));
 	
@@ -142,11 +308,18 @@ void Cotter::Run(double timeRes_s, double freqRes_kHz)
 		throw std::runtime_error("Tried to flag more edge channels than available");
 	
 	processAllContiguousBands(timeAvgFactor, freqAvgFactor);
+	stopWorkers();
+	
+	// The run has completed, so the checkpoints are no longer needed
+	for(const std::string& filename : _checkpointFilenames)
+		Checkpoint::Remove(filename);
 	
 	std::cout
 		<< "Wall-clock time in reading: " << _readWatch.ToString()
 		<< " processing: " << _processWatch.ToString()
 		<< " writing: " << _writeWatch.ToString() << '\n';
+	reportPeakRSS();
+	reportNodeStatistics();
 }
 
 void Cotter::processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFactor)
@@ -199,89 +372,416 @@ void Cotter::processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFacto
 			bandFilename = bandFilename.substr(0, dotPos) + "\?\?\?-\?\?\?" + bandFilename.substr(dotPos);
 		}
 		
-		for(size_t bandIndex = 0; bandIndex!=contiguousSBRanges.size(); ++bandIndex)
+		// The bands read and write FITS files from several threads
+		const bool parallelBands = _parallelBands && fits_is_reentrant();
+		if(_parallelBands && !parallelBands)
+			std::cout << "cfitsio is not thread safe: processing the contiguous bands one at a time.\n";
+		if(parallelBands)
 		{
-			_curSbStart = contiguousSBRanges[bandIndex].first;
-			_curSbEnd = contiguousSBRanges[bandIndex].second;
-			
-			size_t nChannels = nChannelsInCurSBRange(), nChannelPerSb = _mwaConfig.Header().nChannels / _subbandCount;
-			_channelFrequenciesHz.resize(nChannels);
-			int
-				chStartNo = _mwaConfig.HeaderExt().subbandNumbers[_curSbStart],
-				chEndNo =_mwaConfig.HeaderExt().subbandNumbers[_curSbEnd-1];
-			std::vector<double>::iterator chFreqIter = _channelFrequenciesHz.begin();
-			for(int coarseChannel=chStartNo; coarseChannel!=chEndNo+1; ++coarseChannel)
+			processContiguousBandsInParallel(contiguousSBRanges, bandFilename, dotPos, timeAvgFactor, freqAvgFactor);
+		}
+		else {
+			const std::string filenameTemplate = bandFilename;
+			for(size_t bandIndex = 0; bandIndex!=contiguousSBRanges.size(); ++bandIndex)
 			{
-				for(size_t ch=0; ch!=nChannelPerSb; ++ch)
-				{
-					*chFreqIter = _mwaConfig.ChannelFrequencyHz(coarseChannel, ch);
-					++chFreqIter;
-				}
+				_curSbStart = contiguousSBRanges[bandIndex].first;
+				_curSbEnd = contiguousSBRanges[bandIndex].second;
+				
+				initializeBandChannelFrequencies();
+				bandFilename = this->bandFilename(filenameTemplate, dotPos);
+				
+				std::cout << " |=== BAND " << (bandIndex+1) << " / " << contiguousSBRanges.size() << " ===|\n";
+				std::cout << "Writing contiguous band " << (bandIndex+1) << " to " << bandFilename << ".\n";
+				processOneContiguousBand(bandFilename, timeAvgFactor, freqAvgFactor);
 			}
+		}
+	}
+}
+
+void Cotter::processContiguousBandsInParallel(const std::vector<std::pair<int, int> >& contiguousSBRanges, const std::string& filenameTemplate, size_t dotPos, size_t timeAvgFactor, size_t freqAvgFactor)
+{
+	// All bands would write their statistics to the same file
+	if(!_qualityStatisticsFilename.empty())
+		throw std::runtime_error("Saving the quality statistics to a separate file can not be combined with processing bands in parallel");
+	
+	const size_t
+		concurrentBandCount = std::min(contiguousSBRanges.size(), _threadCount),
+		threadsPerBand = std::max<size_t>(1, _threadCount / concurrentBandCount);
+	std::cout << "Processing " << contiguousSBRanges.size() << " contiguous bands, " << concurrentBandCount << " at a time, using "
+		<< threadsPerBand << " threads and 1/" << concurrentBandCount << " of the memory for each band.\n";
+	
+	// The bands share the metadata, so the start time can not be corrected by each band
+	// separately while processing. Instead, correct it now from the files of all bands.
+	correctStartTimeFromAllFiles();
+	if(_strategyFilename.empty())
+		_strategyFilename = _flagger.FindStrategyFile(TelescopeId::MWA_TELESCOPE);
+	
+	std::vector<std::unique_ptr<Cotter>> bands(contiguousSBRanges.size());
+	for(size_t bandIndex = 0; bandIndex!=contiguousSBRanges.size(); ++bandIndex)
+	{
+		bands[bandIndex].reset(new Cotter(*this, threadsPerBand, _maxBufferSize / concurrentBandCount));
+		Cotter& band = *bands[bandIndex];
+		band._curSbStart = contiguousSBRanges[bandIndex].first;
+		band._curSbEnd = contiguousSBRanges[bandIndex].second;
+		band.initializeBandChannelFrequencies();
+	}
+	
+	_readWatch.Pause();
+	
+	std::mutex mutex;
+	size_t nextBandIndex = 0;
+	std::exception_ptr firstError;
+	auto bandThreadFunc = [&]()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while(nextBandIndex != bands.size() && !firstError)
+		{
+			const size_t bandIndex = nextBandIndex;
+			++nextBandIndex;
+			lock.unlock();
 			
-			if(_outputFormat != FlagsOutputFormat)
-			{
-				bandFilename[dotPos] = (char) ('0' + (chStartNo/100));
-				bandFilename[dotPos+1] = (char) ('0' + ((chStartNo/10)%10));
-				bandFilename[dotPos+2] = (char) ('0' + (chStartNo%10));
-				bandFilename[dotPos+4] = (char) ('0' + (chEndNo/100));
-				bandFilename[dotPos+5] = (char) ('0' + ((chEndNo/10)%10));
-				bandFilename[dotPos+6] = (char) ('0' + (chEndNo%10));
+			std::exception_ptr error;
+			try {
+				Cotter& band = *bands[bandIndex];
+				const std::string filename = band.bandFilename(filenameTemplate, dotPos);
+				std::cout << "Writing contiguous band " << (bandIndex+1) << " / " << bands.size() << " to " << filename << ".\n";
+				band.processOneContiguousBand(filename, timeAvgFactor, freqAvgFactor);
+				std::cout << "Finished contiguous band " << (bandIndex+1) << " / " << bands.size() << ".\n";
+			} catch(...) {
+				error = std::current_exception();
 			}
-			std::cout << " |=== BAND " << (bandIndex+1) << " / " << contiguousSBRanges.size() << " ===|\n";
-			std::cout << "Writing contiguous band " << (bandIndex+1) << " to " << bandFilename << ".\n";
-			processOneContiguousBand(bandFilename, timeAvgFactor, freqAvgFactor);
+			
+			lock.lock();
+			if(error && !firstError)
+				firstError = error;
+		}
+	};
+	std::vector<std::thread> threadGroup;
+	for(size_t i=0; i!=concurrentBandCount; ++i)
+		threadGroup.emplace_back(bandThreadFunc);
+	for(std::thread& t : threadGroup)
+		t.join();
+	if(firstError)
+		std::rethrow_exception(firstError);
+	
+	for(size_t bandIndex = 0; bandIndex!=bands.size(); ++bandIndex)
+	{
+		const Cotter& band = *bands[bandIndex];
+		_checkpointFilenames.insert(_checkpointFilenames.end(), band._checkpointFilenames.begin(), band._checkpointFilenames.end());
+		std::cout
+			<< "Band " << (bandIndex+1) << " wall-clock time in reading: " << band._readWatch.ToString()
+			<< " processing: " << band._processWatch.ToString()
+			<< " writing: " << band._writeWatch.ToString() << '\n';
+		band.reportPeakRSS();
+		band.reportNodeStatistics();
+	}
+	_readWatch.Start();
+}
+
+void Cotter::initializeBandChannelFrequencies()
+{
+	size_t nChannels = nChannelsInCurSBRange(), nChannelPerSb = _mwaConfig.Header().nChannels / _subbandCount;
+	_channelFrequenciesHz.resize(nChannels);
+	int
+		chStartNo = _mwaConfig.HeaderExt().subbandNumbers[_curSbStart],
+		chEndNo =_mwaConfig.HeaderExt().subbandNumbers[_curSbEnd-1];
+	std::vector<double>::iterator chFreqIter = _channelFrequenciesHz.begin();
+	for(int coarseChannel=chStartNo; coarseChannel!=chEndNo+1; ++coarseChannel)
+	{
+		for(size_t ch=0; ch!=nChannelPerSb; ++ch)
+		{
+			*chFreqIter = _mwaConfig.ChannelFrequencyHz(coarseChannel, ch);
+			++chFreqIter;
 		}
 	}
 }
 
+std::string Cotter::bandFilename(const std::string& filenameTemplate, size_t dotPos) const
+{
+	std::string filename(filenameTemplate);
+	// Flag files have no channel range in their name
+	if(filename.compare(dotPos, 7, "\?\?\?-\?\?\?") == 0)
+	{
+		int
+			chStartNo = _mwaConfig.HeaderExt().subbandNumbers[_curSbStart],
+			chEndNo =_mwaConfig.HeaderExt().subbandNumbers[_curSbEnd-1];
+		filename[dotPos] = (char) ('0' + (chStartNo/100));
+		filename[dotPos+1] = (char) ('0' + ((chStartNo/10)%10));
+		filename[dotPos+2] = (char) ('0' + (chStartNo%10));
+		filename[dotPos+4] = (char) ('0' + (chEndNo/100));
+		filename[dotPos+5] = (char) ('0' + ((chEndNo/10)%10));
+		filename[dotPos+6] = (char) ('0' + (chEndNo%10));
+	}
+	return filename;
+}
+
+std::string Cotter::extraOutputFilename(const ExtraOutput& output) const
+{
+	// Like the main output, the outputs of a non-contiguous band get its channel range in their name
+	if(_curSbEnd - _curSbStart == _subbandCount || output.format == FlagsOutputFormat || output.format == SharedMemoryOutputFormat)
+		return output.filename;
+	const size_t dotPos = output.filename.find('.');
+	if(dotPos == std::string::npos)
+		throw std::runtime_error("Something is wrong with the filename of output " + output.filename);
+	return bandFilename(output.filename.substr(0, dotPos) + "\?\?\?-\?\?\?" + output.filename.substr(dotPos), dotPos);
+}
+
+std::unique_ptr<Writer> Cotter::createExtraWriter(const ExtraOutput& output, const std::string& filename, std::vector<MSWriter*>& msWriters, std::vector<SharedMemoryWriter*>& shmWriters)
+{
+	switch(output.format)
+	{
+		case FlagsOutputFormat:
+			if(output.freqAvgFactor != 1 || output.timeAvgFactor != 1)
+				throw std::runtime_error("Flag files can not be averaged; specify the full resolution for " + filename);
+			if(_removeFlaggedAntennae || _removeAutoCorrelations)
+				throw std::runtime_error("Can't prune flagged/auto-correlated antennas when writing flag file");
+			return std::unique_ptr<Writer>(new ThreadedWriter(std::unique_ptr<FlagWriter>(new FlagWriter(filename, _mwaConfig.HeaderExt().gpsTime, _mwaConfig.Header().nScans, _curSbStart, _curSbEnd, _subbandOrder))));
+		case FitsOutputFormat:
+			return std::unique_ptr<Writer>(new ThreadedWriter(std::unique_ptr<FitsWriter>(new FitsWriter(filename))));
+		case ColumnarOutputFormat:
+			return std::unique_ptr<Writer>(new ThreadedWriter(std::unique_ptr<ColumnarWriter>(new ColumnarWriter(filename))));
+		case SharedMemoryOutputFormat:
+			return createSharedMemoryWriter(filename, shmWriters);
+		case UVH5OutputFormat:
+			return createUVH5Writer(filename);
+		case MSOutputFormat:
+			break;
+	}
+	std::unique_ptr<MSWriter> msWriter(new MSWriter(filename));
+	if(_useDysco)
+		msWriter->EnableCompression(_dyscoDataBitRate, _dyscoWeightBitRate, _dyscoDistribution, _dyscoDistTruncation, _dyscoNormalization);
+	if(_compactWeights)
+		msWriter->SetUniformWeights();
+	msWriters.push_back(msWriter.get());
+	return std::unique_ptr<Writer>(new ThreadedWriter(std::move(msWriter)));
+}
+
+std::unique_ptr<Writer> Cotter::createUVH5Writer(const std::string& filename) const
+{
+#ifdef HAVE_HDF5
+	return std::unique_ptr<Writer>(new ThreadedWriter(std::unique_ptr<UVH5Writer>(new UVH5Writer(filename, _uvh5DeflateLevel))));
+#else
+	throw std::runtime_error("Can not write " + filename + ": Cotter was built without HDF5, which UVH5 output requires");
+#endif
+}
+
+std::unique_ptr<Writer> Cotter::createSharedMemoryWriter(const std::string& outputFilename, std::vector<SharedMemoryWriter*>& shmWriters) const
+{
+	// A ring is read by a single consumer, which can not follow several bands
+	if(_curSbEnd - _curSbStart != _subbandCount)
+		throw std::runtime_error("Streaming to shared memory is only possible for observations with a contiguous band");
+	const size_t ringSize = 256*1024*1024;
+	// The name follows the "shm:" prefix
+	std::unique_ptr<SharedMemoryWriter> shmWriter(new SharedMemoryWriter(outputFilename.substr(4), ringSize, _sharedMemoryTimeout));
+	shmWriters.push_back(shmWriter.get());
+	return std::unique_ptr<Writer>(new ThreadedWriter(std::move(shmWriter)));
+}
+
+std::unique_ptr<Writer> Cotter::makeWriterChain(std::unique_ptr<Writer> writer, size_t timeAvgFactor, size_t freqAvgFactor, bool baselineDependent)
+{
+	if(!_solutionFilename.empty() && !_applySolutionsBeforeAveraging)
+	{
+		writer.reset(new ApplySolutionsWriter(std::move(writer), _solutionFilename, ((_curSbStart * _mwaConfig.Header().nChannels) / _subbandCount) / freqAvgFactor, _mwaConfig.Header().nChannels / freqAvgFactor));
+	}
+	if(baselineDependent)
+	{
+		std::unique_ptr<AveragingWriter> averagingWriter(new AveragingWriter(std::move(writer), timeAvgFactor, freqAvgFactor, *this));
+		averagingWriter->SetBaselineDependentAveraging(_bdaDecorrelation, _bdaFieldRadius, _mwaConfig.Header().integrationTime, _bdaMaxTimeFactor, _bdaMaxFreqFactor);
+		writer.reset(new ThreadedWriter(std::move(averagingWriter)));
+	}
+	else if(freqAvgFactor != 1 || timeAvgFactor != 1)
+	{
+		writer.reset(new ThreadedWriter(std::unique_ptr<AveragingWriter>(new AveragingWriter(std::move(writer), timeAvgFactor, freqAvgFactor, *this))));
+	}
+	if(!_solutionFilename.empty() && _applySolutionsBeforeAveraging)
+	{
+		writer.reset(new ApplySolutionsWriter(std::move(writer), _solutionFilename, (_curSbStart * _mwaConfig.Header().nChannels) / _subbandCount, _mwaConfig.Header().nChannels));
+	}
+	return writer;
+}
+
 void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t timeAvgFactor, size_t freqAvgFactor)
 {
+	if(_subbandsPerPass != 0 && _passCount == 1 && _curSbEnd - _curSbStart > _subbandsPerPass)
+	{
+		processContiguousBandInPasses(outputFilename, timeAvgFactor, freqAvgFactor);
+		return;
+	}
+	
+	// The shards hold equally many coarse channels, so that their tables can be concatenated
+	size_t shardCount = 1;
+	if(_outputFormat == MSOutputFormat && _shardCount > 1)
+	{
+		if(_passCount > 1)
+			throw std::runtime_error("Writing the measurement set in shards can not be combined with processing in passes");
+		const size_t
+			subbands = _curSbEnd - _curSbStart,
+			outputChannels = nChannelsInCurSBRange() / freqAvgFactor;
+		shardCount = std::min(_shardCount, subbands);
+		while(subbands % shardCount != 0 || outputChannels % shardCount != 0)
+			--shardCount;
+		if(shardCount != _shardCount)
+			std::cout << "Writing " << shardCount << " shards instead of " << _shardCount << ", so that all shards have the same number of channels.\n";
+	}
+	
+	// Baselines with different resolutions are written in their own spectral windows,
+	// which only a single measurement set can hold
+	const bool baselineDependent = (_bdaDecorrelation != 0.0);
+	if(baselineDependent && (_outputFormat != MSOutputFormat || shardCount != 1 || _passCount != 1 || !_extraOutputs.empty()))
+		throw std::runtime_error("Baseline-dependent averaging is only possible when writing a single measurement set in a single pass without shards or extra outputs");
+	if(baselineDependent && (_useDysco || _resume))
+		throw std::runtime_error("Baseline-dependent averaging can not be combined with Dysco compression or resuming");
+	
+	// Measurement sets and flag files written in a single pass are checkpointed after each
+	// chunk. Other outputs can not be reopened to continue writing them.
+	const bool useCheckpoints = ((_outputFormat == MSOutputFormat || _outputFormat == FlagsOutputFormat) && _passCount == 1 && shardCount == 1 && _extraOutputs.empty() && !_skipWriting && !baselineDependent);
+	const std::string checkpointFilename = Checkpoint::Filename(outputFilename);
+	Checkpoint checkpoint;
+	bool isResuming = false;
+	if(_resume)
+	{
+		if(!useCheckpoints)
+			throw std::runtime_error("Resuming is only possible when writing a single measurement set or flag files in a single pass, without shards, extra outputs or baseline-dependent averaging");
+		isResuming = checkpoint.Read(checkpointFilename);
+		if(!isResuming)
+			std::cout << "No checkpoint found for " << outputFilename << ", starting from the beginning.\n";
+		else if(checkpoint.ScanCount != _mwaConfig.Header().nScans || checkpoint.SubbandStart != _curSbStart || checkpoint.SubbandEnd != _curSbEnd ||
+			checkpoint.TimeAvgFactor != timeAvgFactor || checkpoint.FreqAvgFactor != freqAvgFactor)
+			throw std::runtime_error("Checkpoint " + checkpointFilename + " was made with different settings; remove it to start from the beginning");
+		else if(checkpoint.IsComplete)
+		{
+			std::cout << outputFilename << " has already been completed.\n";
+			_checkpointFilenames.push_back(checkpointFilename);
+			return;
+		}
+		else
+			std::cout << "Resuming " << outputFilename << " after scan " << checkpoint.CommittedScans() << " of " << _mwaConfig.Header().nScans << ".\n";
+	}
+	// The statistics of the chunks that were written before can not be restored: aoflagger
+	// can write quality statistics, but not read them back to continue collecting them
+	const bool collectStatistics = _collectStatistics;
+	if(isResuming && _collectStatistics)
+	{
+		std::cout << "Warning: statistics are not collected for a resumed band. Run 'aoquality collect' on " << outputFilename << " afterwards to collect them.\n";
+		_collectStatistics = false;
+	}
+	if(useCheckpoints)
+	{
+		if(!isResuming)
+		{
+			checkpoint = Checkpoint();
+			checkpoint.ScanCount = _mwaConfig.Header().nScans;
+			checkpoint.SubbandStart = _curSbStart;
+			checkpoint.SubbandEnd = _curSbEnd;
+			checkpoint.TimeAvgFactor = timeAvgFactor;
+			checkpoint.FreqAvgFactor = freqAvgFactor;
+		}
+		Checkpoint::InstallTerminationHandler();
+	}
+	
+	// Without averaging, every row gets the weights of initializeWeights(). Averaged weights
+	// only change where flags were averaged, and the incremental storage manager only stores
+	// the rows in which they change. Passes and baseline-dependent averaging write rows in a
+	// way that this storage manager does not support.
+	const bool uniformWeights = _compactWeights && _passCount == 1 && !baselineDependent;
+	if(_compactWeights && _outputFormat == MSOutputFormat && !uniformWeights)
+		std::cout << "Weights can not be stored compactly when processing in passes or with baseline-dependent averaging: writing the full weight spectrum.\n";
+	
+	std::vector<std::string> shardFilenames;
+	// The measurement set writers in the writer chain, to finish their sets before they are closed
+	std::vector<MSWriter*> msWriters;
+	// The shared memory writers, to end their streams when all rows are written
+	std::vector<SharedMemoryWriter*> shmWriters;
 	switch(_outputFormat)
 	{
-		case FlagsOutputFormat:
+		case FlagsOutputFormat: {
 			std::cout << "Only flags will be outputted.\n";
 			if(freqAvgFactor != 1 || timeAvgFactor != 1)
 				throw std::runtime_error("You have specified time or frequency averaging and outputting only flags: this is incompatible");
 			if(_removeFlaggedAntennae || _removeAutoCorrelations)
 				throw std::runtime_error("Can't prune flagged/auto-correlated antennas when writing flag file");
-			_writer.reset(new FlagWriter(outputFilename, _mwaConfig.HeaderExt().gpsTime, _mwaConfig.Header().nScans, _curSbStart, _curSbEnd, _subbandOrder));
-			break;
+			std::unique_ptr<FlagWriter> flagWriter(new FlagWriter(outputFilename, _mwaConfig.HeaderExt().gpsTime, _mwaConfig.Header().nScans, _curSbStart, _curSbEnd, _subbandOrder));
+			if(isResuming)
+				flagWriter->SetResume(checkpoint.RowCount);
+			_writer = std::move(flagWriter);
+		} break;
 		case FitsOutputFormat:
 			_writer.reset(new ThreadedWriter(std::unique_ptr<FitsWriter>(new FitsWriter(outputFilename))));
 			break;
-		case MSOutputFormat: {
+		case ColumnarOutputFormat:
+			_writer.reset(new ThreadedWriter(std::unique_ptr<ColumnarWriter>(new ColumnarWriter(outputFilename))));
+			break;
+		case SharedMemoryOutputFormat:
+			_writer = createSharedMemoryWriter(outputFilename, shmWriters);
+			break;
+		case UVH5OutputFormat:
+			_writer = createUVH5Writer(outputFilename);
+			break;
+		case MSOutputFormat: if(shardCount > 1) {
+			// The shards have their own writer threads
+			std::unique_ptr<ShardedMSWriter> shardedWriter(new ShardedMSWriter(outputFilename, shardCount));
+			if(_useDysco)
+				shardedWriter->EnableCompression(_dyscoDataBitRate, _dyscoWeightBitRate, _dyscoDistribution, _dyscoDistTruncation, _dyscoNormalization);
+			if(uniformWeights)
+				shardedWriter->SetUniformWeights();
+			shardFilenames = shardedWriter->ShardFilenames();
+			msWriters = shardedWriter->ShardWriters();
+			std::cout << "Writing " << shardCount << " shards in parallel: " << shardFilenames.front() << " ... " << shardFilenames.back() << ".\n";
+			_writer = std::move(shardedWriter);
+		} else {
 			std::unique_ptr<MSWriter> msWriter(new MSWriter(outputFilename));
 			if(_useDysco)
 				msWriter->EnableCompression(_dyscoDataBitRate, _dyscoWeightBitRate, _dyscoDistribution, _dyscoDistTruncation, _dyscoNormalization);
+			if(uniformWeights)
+				msWriter->SetUniformWeights();
+			if(_passCount > 1)
+			{
+				// Each pass writes its channels into the rows of the same measurement set
+				std::string bandName;
+				std::vector<Writer::ChannelInfo> bandChannels;
+				double refFreq, totalBandwidth;
+				makeBandInfo(_passBandFrequenciesHz, bandName, bandChannels, refFreq, totalBandwidth);
+				const size_t channelStart = ((_curSbStart - _passBandSbStart) * _mwaConfig.Header().nChannels / _subbandCount) / freqAvgFactor;
+				msWriter->SetChannelRange(channelStart, _passIndex != 0, bandName, AveragingWriter::AverageChannels(bandChannels, freqAvgFactor), refFreq, totalBandwidth);
+			}
+			if(isResuming)
+				msWriter->SetResume(checkpoint.RowCount);
+			msWriters.push_back(msWriter.get());
 			_writer.reset(new ThreadedWriter(std::move(msWriter)));
 		} break;
 	}
-	if(!_solutionFilename.empty() && !_applySolutionsBeforeAveraging)
-	{
-		_writer.reset(new ApplySolutionsWriter(std::move(_writer), _solutionFilename, ((_curSbStart * _mwaConfig.Header().nChannels) / _subbandCount) / freqAvgFactor, _mwaConfig.Header().nChannels / freqAvgFactor));
-	}
-	if(freqAvgFactor != 1 || timeAvgFactor != 1)
+	_writer = makeWriterChain(std::move(_writer), timeAvgFactor, freqAvgFactor, baselineDependent);
+	TeeWriter* teeWriter = nullptr;
+	if(!_extraOutputs.empty())
 	{
-		_writer.reset(new ThreadedWriter(std::unique_ptr<AveragingWriter>(new AveragingWriter(std::move(_writer), timeAvgFactor, freqAvgFactor, *this))));
-	}
-	if(!_solutionFilename.empty() && _applySolutionsBeforeAveraging)
-	{
-		_writer.reset(new ApplySolutionsWriter(std::move(_writer), _solutionFilename, (_curSbStart * _mwaConfig.Header().nChannels) / _subbandCount, _mwaConfig.Header().nChannels));
+		std::unique_ptr<TeeWriter> tee(new TeeWriter());
+		// The tee gives every branch its own thread
+		if(_outputFormat == FlagsOutputFormat)
+			_writer.reset(new ThreadedWriter(std::move(_writer)));
+		tee->AddBranch(std::move(_writer));
+		for(const ExtraOutput& output : _extraOutputs)
+		{
+			const std::string filename = extraOutputFilename(output);
+			std::cout << "Also writing " << filename << ".\n";
+			tee->AddBranch(makeWriterChain(createExtraWriter(output, filename, msWriters, shmWriters), output.timeAvgFactor, output.freqAvgFactor, false));
+		}
+		teeWriter = tee.get();
+		_writer = std::move(tee);
 	}
 	writeAntennae();
-	writeSPW();
+	writeSPW(_channelFrequenciesHz);
 	writeSource();
 	writeField();
 	_writer->WritePolarizationForLinearPols(false);
 	writeObservation();
 
-	if(!_qualityStatisticsFilename.empty())
+	const bool isFirstPass = (_passIndex == 0), isLastPass = (_passIndex+1 == _passCount);
+	if(!_qualityStatisticsFilename.empty() && isFirstPass)
 	{
 		std::unique_ptr<Writer> qsWriter(new MSWriter(_qualityStatisticsFilename));
 		std::swap(qsWriter, _writer);
 		writeAntennae();
-		writeSPW();
+		writeSPW(_passCount > 1 ? _passBandFrequenciesHz : _channelFrequenciesHz);
 		writeSource();
 		writeField();
 		_writer->WritePolarizationForLinearPols(false);
@@ -293,7 +793,34 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 	const size_t
 		nChannels = nChannelsInCurSBRange(),
 		antennaCount = _mwaConfig.NAntennae();
-	size_t maxScansPerPart = _maxBufferSize / (nChannels*(antennaCount+1)*antennaCount*2);
+	if(_skipPrunedBaselines)
+	{
+		std::cout << "Skipping " << ((antennaCount+1)*antennaCount/2 - processedBaselineCount()) << " baselines that are not written";
+		if(_collectStatistics)
+			std::cout << "; these are not included in the statistics";
+		std::cout << ".\n";
+	}
+	if(_compactVisibilities)
+		std::cout << "Storing visibilities in memory as bfloat16.\n";
+	
+	const size_t nScans = _mwaConfig.Header().nScans;
+	const MemoryModel memoryModel = makeMemoryModel(nChannels, freqAvgFactor);
+	size_t maxScansPerPart = memoryModel.MaxScans(memoryBudget(), _threadCount);
+	// A short time window hurts the flagging accuracy more than fewer threads hurt the
+	// speed, so reduce the number of threads when their working memory does not fit.
+	// This is only possible before the workers have been started.
+	const size_t desiredScansPerPart = std::min<size_t>(nScans, _rfiDetection ? 20 : 1);
+	if(maxScansPerPart < desiredScansPerPart && _threadCount > 1 && _workerThreads.empty())
+	{
+		size_t threadCount = _threadCount;
+		while(threadCount > 1 && memoryModel.MaxScans(memoryBudget(), threadCount) < desiredScansPerPart)
+			--threadCount;
+		std::cout << "Reducing the number of threads from " << _threadCount << " to " << threadCount << " to fit the processing in memory.\n";
+		_threadCount = threadCount;
+		maxScansPerPart = memoryModel.MaxScans(memoryBudget(), _threadCount);
+	}
+	std::cout << "Estimated memory usage for chunks of " << std::max<size_t>(1, std::min(maxScansPerPart, nScans)) << " scans (budget: " << MemoryModel::ToString(memoryBudget()) << "):\n";
+	memoryModel.Report(std::cout, std::max<size_t>(1, std::min(maxScansPerPart, nScans)), _threadCount);
 	
 	if(maxScansPerPart<1)
 	{
@@ -303,11 +830,16 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 	{
 		std::cout << "WARNING! This computer does not have enough memory for accurate flagging; expect non-optimal flagging accuracy.\n"; 
 	}
-	size_t partCount = 1 + _mwaConfig.Header().nScans / maxScansPerPart;
+	if(_follow && _followWindowScans != 0 && _followWindowScans < maxScansPerPart)
+	{
+		std::cout << "Following the gpubox files in windows of " << _followWindowScans << " scans.\n";
+		maxScansPerPart = _followWindowScans;
+	}
+	const size_t partCount = 1 + nScans / maxScansPerPart;
 	if(partCount == 1)
-		std::cout << "All " << _mwaConfig.Header().nScans << " scans fit in memory; no partitioning necessary.\n";
+		std::cout << "All " << nScans << " scans fit in memory; no partitioning necessary.\n";
 	else
-		std::cout << "Observation does not fit fully in memory, will partition data in " << partCount << " chunks of at least " << (_mwaConfig.Header().nScans/partCount) << " scans.\n";
+		std::cout << "Observation does not fit fully in memory, will partition data in " << partCount << " chunks of at least " << (nScans/partCount) << " scans.\n";
 	
 	_scanTimes.resize(_mwaConfig.Header().nScans);
 	for(size_t t=0; t!=_mwaConfig.Header().nScans; ++t)
@@ -324,6 +856,17 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 	
 	if(_strategyFilename.empty())
 		_strategyFilename = _flagger.FindStrategyFile(TelescopeId::MWA_TELESCOPE);
+	
+	if(_numaAware && !_numaNodes)
+	{
+		_numaNodes.reset(new NUMANodes());
+		_nodeStatistics.assign(_numaNodes->NodeCount(), NodeStatistics{0, 0, 0.0});
+		std::cout << "Processing NUMA aware on " << _numaNodes->NodeCount() << " node(s):";
+		for(size_t node=0; node!=_numaNodes->NodeCount(); ++node)
+			std::cout << " node " << _numaNodes->NodeNumber(node) << " (" << _numaNodes->CPUs(node).size() << " CPUs)";
+		std::cout << '\n';
+	}
+	_baselinesToProcess.resize(_numaNodes ? _numaNodes->NodeCount() : 1);
 		
 	std::vector<std::vector<std::string> >::const_iterator
 		currentFileSetPtr = _fileSets.begin();
@@ -331,27 +874,84 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 	
 	_readWatch.Pause();
 	
-	for(size_t chunkIndex = 0; chunkIndex != partCount; ++chunkIndex)
+	// Band workers share the process with other bands, so they can not reset the peak
+	// resident set size; they sample the resident set size at the end of each stage instead.
+	const bool resetPeakRSS = (_processMemoryBudget == 0);
+	const size_t processBudget = resetPeakRSS ? memoryBudget() : _processMemoryBudget;
+	auto startStage = [&]() {
+		if(resetPeakRSS)
+			MemoryModel::ResetPeakResidentSetSize();
+	};
+	auto endStage = [&](size_t& stagePeakRSS) -> size_t {
+		size_t peak = MemoryModel::ResidentSetSize();
+		if(resetPeakRSS)
+			peak = std::max(peak, MemoryModel::PeakResidentSetSize());
+		stagePeakRSS = std::max(stagePeakRSS, peak);
+		return peak;
+	};
+	
+	// The chunks evenly divide the scans that follow planStart in planPartCount parts. When
+	// memory pressure is detected, the remaining scans are divided again in shorter chunks.
+	size_t
+		chunkIndex = 0,
+		planStart = 0,
+		planPartCount = partCount,
+		planIndex = 0,
+		bufferCapacity = (nScans+partCount-1)/partCount;
+	bool allocateBuffers = true;
+	_curChunkEnd = 0;
+	if(isResuming)
 	{
-		std::cout << "=== Processing chunk " << (chunkIndex+1) << " of " << partCount << " ===\n";
+		// Move the readers past the written scans in the same steps as the interrupted run,
+		// so that the files are aligned in the same way.
+		std::cout << "Skipping " << checkpoint.CommittedScans() << " scans that were written before...\n";
+		for(size_t chunkEnd : checkpoint.ChunkEnds)
+		{
+			_curChunkStart = _curChunkEnd;
+			_curChunkEnd = chunkEnd;
+			readChunk(currentFileSetPtr, chunkIndex == 0, true);
+			++chunkIndex;
+		}
+		planStart = _curChunkEnd;
+		planPartCount = 1 + (nScans - planStart) / maxScansPerPart;
+		bufferCapacity = (nScans - planStart + planPartCount - 1) / planPartCount;
+	}
+	while(_curChunkEnd != nScans)
+	{
+		std::cout << "=== Processing chunk " << (chunkIndex+1) << " of " << (chunkIndex + planPartCount - planIndex) << " ===\n";
 		_readWatch.Start();
+		startStage();
 		
-		_curChunkStart = _mwaConfig.Header().nScans*chunkIndex/partCount;
-		_curChunkEnd = _mwaConfig.Header().nScans*(chunkIndex+1)/partCount;
+		_curChunkStart = planStart + (nScans-planStart)*planIndex/planPartCount;
+		_curChunkEnd = planStart + (nScans-planStart)*(planIndex+1)/planPartCount;
 		
 		// Initialize buffers
-		if(chunkIndex == 0)
+		if(_numaNodes)
+		{
+			// Each node allocates (or clears) the buffers of its own baselines, so
+			// that they are first touched by, and thus placed on, that node
+			initializeImageSetBuffersOnNodes(allocateBuffers, nChannels, bufferCapacity);
+		}
+		else if(allocateBuffers)
 		{
 			// First time: allocate the buffers
-			const size_t requiredWidthCapacity = (_mwaConfig.Header().nScans+partCount-1)/partCount;
+			const size_t requiredWidthCapacity = bufferCapacity;
 			for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
 			{
 				for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
 				{
-					_imageSetBuffers.emplace(
-						std::pair<size_t,size_t>(antenna1, antenna2),
-						_flagger.MakeImageSet(_curChunkEnd-_curChunkStart, nChannels, 8, 0.0f, requiredWidthCapacity)
-					);
+					if(!isBaselineProcessed(antenna1, antenna2))
+						continue;
+					if(_compactVisibilities)
+						_compactBuffers.emplace(
+							std::pair<size_t,size_t>(antenna1, antenna2),
+							CompactImageSet(_curChunkEnd-_curChunkStart, nChannels, 8, requiredWidthCapacity)
+						);
+					else
+						_imageSetBuffers.emplace(
+							std::pair<size_t,size_t>(antenna1, antenna2),
+							_flagger.MakeImageSet(_curChunkEnd-_curChunkStart, nChannels, 8, 0.0f, requiredWidthCapacity)
+						);
 				}
 			}
 		} else {
@@ -363,63 +963,14 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 				buffer.second.ResizeWithoutReallocation(_curChunkEnd-_curChunkStart);
 				buffer.second.Set(0.0f);
 			}
-		}
-		
-		size_t bufferPos = 0;
-		bool continueWithNextFile;
-		do {
-			initializeReader();
-			
-			bool firstRead = (bufferPos == 0 && chunkIndex == 0);
-			
-			bool moreAvailableInCurrentFile = _reader->Read(bufferPos, _curChunkEnd-_curChunkStart);
-			
-			if(firstRead && _reader->HasStartTime())
+			for(auto& buffer : _compactBuffers)
 			{
-				std::time_t startTime = _reader->StartTime();
-				std::tm startTimeTm;
-				gmtime_r(&startTime, &startTimeTm);
-				if(startTimeTm.tm_year+1900 != _mwaConfig.Header().year ||
-					startTimeTm.tm_mon+1 != _mwaConfig.Header().month ||
-					startTimeTm.tm_mday != _mwaConfig.Header().day ||
-					startTimeTm.tm_hour != _mwaConfig.Header().refHour ||
-					startTimeTm.tm_min != _mwaConfig.Header().refMinute ||
-					startTimeTm.tm_sec != _mwaConfig.Header().refSecond)
-				{
-					std::cout << "WARNING: start time according to raw files is "
-						<< startTimeTm.tm_year+1900  << '-' << twoDigits(startTimeTm.tm_mon+1) << '-' << twoDigits(startTimeTm.tm_mday) << ' '
-						<< twoDigits(startTimeTm.tm_hour) << ':' << twoDigits(startTimeTm.tm_min) << ':' << twoDigits(startTimeTm.tm_sec)
-						<< ",\nbut meta files say "
-						<< _mwaConfig.Header().year << '-' << twoDigits(_mwaConfig.Header().month) << '-' << twoDigits(_mwaConfig.Header().day) << ' '
-						<< twoDigits(_mwaConfig.Header().refHour) << ':' << twoDigits(_mwaConfig.Header().refMinute) << ':'
-						<< twoDigits(_mwaConfig.Header().refSecond)
-						<< " !\nWill use start time from raw file, which should be most accurate.\n";
-					_mwaConfig.HeaderRW().year = startTimeTm.tm_year+1900;
-					_mwaConfig.HeaderRW().month = startTimeTm.tm_mon+1;
-					_mwaConfig.HeaderRW().day = startTimeTm.tm_mday;
-					_mwaConfig.HeaderRW().refHour = startTimeTm.tm_hour;
-					_mwaConfig.HeaderRW().refMinute = startTimeTm.tm_min;
-					_mwaConfig.HeaderRW().refSecond = startTimeTm.tm_sec;
-					_mwaConfig.HeaderRW().dateFirstScanMJD = _mwaConfig.Header().GetDateFirstScanFromFields();
-				}
-			}
-			
-			if(!moreAvailableInCurrentFile && bufferPos < (_curChunkEnd-_curChunkStart))
-			{
-				if(currentFileSetPtr != _fileSets.end())
-				{
-					// Go to the next set of GPU files and add them to the buffer
-					++currentFileSetPtr;
-					continueWithNextFile = (currentFileSetPtr!=_fileSets.end());
-					if(continueWithNextFile)
-						createReader(*currentFileSetPtr);
-				} else {
-					continueWithNextFile = false;
-				}
-			} else {
-				continueWithNextFile = false;
+				buffer.second.ResizeWithoutReallocation(_curChunkEnd-_curChunkStart);
+				buffer.second.SetZero();
 			}
-		} while(continueWithNextFile);
+		}
+		
+		const size_t bufferPos = readChunk(currentFileSetPtr, chunkIndex == 0, false);
 		
 		if(bufferPos < _curChunkEnd-_curChunkStart)
 		{
@@ -436,28 +987,41 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 			std::cout << "Flagging extra " << extraSamples << " samples at end.\n";
 		}
 		
-		_fullysetMask = FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), true));
-		_correlatorMask = FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), false));
-		flagBadCorrelatorSamples(_correlatorMask);
+		_fullysetMask = std::make_shared<const FlagMask>(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), true));
+		// The correlator flags are the same for all baselines, so they are determined once
+		FlagMask correlatorMask = _flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), false);
+		flagBadCorrelatorSamples(correlatorMask);
+		_correlatorMask = std::make_shared<const FlagMask>(std::move(correlatorMask));
+		_packedFullysetMask = std::make_shared<const PackedFlagMask>(*_fullysetMask);
+		_packedCorrelatorMask = std::make_shared<const PackedFlagMask>(*_correlatorMask);
 		
+		const size_t baselineCount = processedBaselineCount();
+		size_t baselineIndex = 0;
 		for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
 		{
 			for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
 			{
-				_baselinesToProcess.push(std::pair<size_t,size_t>(antenna1, antenna2));
+				if(isBaselineProcessed(antenna1, antenna2))
+				{
+					_baselinesToProcess[baselineNode(baselineIndex, baselineCount)].push(std::pair<size_t,size_t>(antenna1, antenna2));
+					++baselineIndex;
+				}
 				
 				// We will put a place holder in the flagbuffer map, so we don't have to write (and lock)
 				// during multi threaded processing.
 				_flagBuffers.emplace(
 					std::pair<size_t,size_t>(antenna1, antenna2),
-					FlagMask()
+					BaselineFlags()
 				);
 			}
 		}
-		_baselinesToProcessCount = _baselinesToProcess.size();
+		_baselinesToProcessCount = baselineCount;
+		allocateBuffers = false;
 		
+		size_t chunkPeakRSS = endStage(_readPeakRSS);
 		_readWatch.Pause();
 		_processWatch.Start();
+		startStage();
 		
 		if(!_flagFileTemplate.empty())
 		{
@@ -469,8 +1033,11 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 			{
 				for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
 				{
-					FlagMask& baseline = _flagBuffers.find(std::make_pair(antenna1, antenna2))->second;
-					baseline = FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount()));
+					if(isBaselineProcessed(antenna1, antenna2))
+					{
+						FlagMask& baseline = _flagBuffers.find(std::make_pair(antenna1, antenna2))->second.fileFlags;
+						baseline = FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount()));
+					}
 				}
 			}
 			// Fill the flag masks by reading the files
@@ -482,10 +1049,13 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 				{
 					for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
 					{
-						FlagMask& mask = _flagBuffers.find(std::make_pair(antenna1, antenna2))->second;
-						size_t stride = mask.HorizontalStride();
-						bool* bufferPos = mask.Buffer() + (t - _curChunkStart);
-						_flagReader->Read(t, baselineIndex, bufferPos, stride);
+						if(isBaselineProcessed(antenna1, antenna2))
+						{
+							FlagMask& mask = _flagBuffers.find(std::make_pair(antenna1, antenna2))->second.fileFlags;
+							size_t stride = mask.HorizontalStride();
+							bool* bufferPos = mask.Buffer() + (t - _curChunkStart);
+							_flagReader->Read(t, baselineIndex, bufferPos, stride);
+						}
 						++baselineIndex;
 					}
 				}
@@ -510,15 +1080,14 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 		}
 		_progressBar.reset(new ProgressBar(taskDescription));
 		
-		std::vector<std::thread> threadGroup;
-		for(size_t i=0; i!=_threadCount; ++i)
-			threadGroup.emplace_back(std::bind(&Cotter::baselineProcessThreadFunc, this));
-		for(std::thread& t : threadGroup)
-			t.join();
+		initializeStatisticsAxes();
+		runWorkers();
 		
 		_progressBar.reset();
+		chunkPeakRSS = std::max(chunkPeakRSS, endStage(_processPeakRSS));
 		_processWatch.Pause();
 		_writeWatch.Start();
+		startStage();
 		
 		if(_skipWriting)
 		{
@@ -529,10 +1098,13 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 			_outputFlags.reset(new bool[nChannels*4]);
 			_outputData = make_aligned<std::complex<float>>(nChannels*4, 16);
 			_outputWeights = make_aligned<float>(nChannels*4, 16);
+			if(_compactVisibilities)
+				_expandedColumn.resize(nChannels*8);
 			for(size_t t=_curChunkStart; t!=_curChunkEnd; ++t)
 			{
 				_progressBar->SetProgress(t-_curChunkStart, _curChunkEnd-_curChunkStart);
-				if(_outputFormat == FlagsOutputFormat)
+				// The data is only needed when other outputs are written besides the flags
+				if(_outputFormat == FlagsOutputFormat && _extraOutputs.empty())
 					processAndWriteTimestepFlagsOnly(t);
 				else
 					processAndWriteTimestep(t);
@@ -545,51 +1117,289 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 		
 		_flagBuffers.clear();
 		
-		_correlatorMask = FlagMask();
-		_fullysetMask = FlagMask();
+		_correlatorMask.reset();
+		_fullysetMask.reset();
+		_packedCorrelatorMask.reset();
+		_packedFullysetMask.reset();
+		
+		chunkPeakRSS = std::max(chunkPeakRSS, endStage(_writePeakRSS));
+		++chunkIndex;
+		++planIndex;
+		
+		// When the process used more than its budget, the model underestimated the usage.
+		// Shorten the remaining chunks by the excess, with some margin, and reallocate the
+		// buffers at the new length so that the memory is actually released.
+		const size_t chunkScans = _curChunkEnd - _curChunkStart;
+		if(chunkPeakRSS > processBudget && _curChunkEnd != nScans && chunkScans > 1)
+		{
+			const size_t
+				bytesPerScan = std::max<size_t>(1, memoryModel.Bytes(1, _threadCount) - memoryModel.Bytes(0, _threadCount)),
+				excessScans = (chunkPeakRSS - processBudget + bytesPerScan - 1) / bytesPerScan,
+				newScans = std::max<size_t>(1, (chunkScans - std::min(chunkScans, excessScans)) * 9 / 10);
+			if(newScans < chunkScans)
+			{
+				std::cout << "Memory pressure: chunk used " << MemoryModel::ToString(chunkPeakRSS) << " of " << MemoryModel::ToString(processBudget)
+					<< "; reducing chunks from " << chunkScans << " to " << newScans << " scans.\n";
+				planStart = _curChunkEnd;
+				planPartCount = (nScans - planStart + newScans - 1) / newScans;
+				planIndex = 0;
+				bufferCapacity = (nScans - planStart + planPartCount - 1) / planPartCount;
+				allocateBuffers = true;
+				_imageSetBuffers.clear();
+				_compactBuffers.clear();
+			}
+		}
+		
+		if(useCheckpoints)
+		{
+			// Averaged rows are only complete when the chunk ends on an averaging boundary
+			checkpoint.ChunkEnds.push_back(_curChunkEnd);
+			if(_curChunkEnd % timeAvgFactor == 0)
+			{
+				_writer->Flush();
+				checkpoint.RowCount = rowsPerTimescan() * (_curChunkEnd / timeAvgFactor);
+				checkpoint.Write(checkpointFilename);
+				if(Checkpoint::IsTerminationRequested() && _curChunkEnd != nScans)
+				{
+					std::ostringstream message;
+					message << "Terminated after scan " << _curChunkEnd << " of " << outputFilename << "; continue the run with -resume.";
+					throw std::runtime_error(message.str());
+				}
+			}
+		}
 		
 		_writeWatch.Pause();
-	} // end for chunkIndex!=partCount
+	}
 	
 	_imageSetBuffers.clear();
+	_compactBuffers.clear();
 	
 	_writeWatch.Start();
 	
+	// The averaging writers should have received all rows before asking them whether they are aligned
+	_writer->Flush();
+	if(teeWriter)
+		teeWriter->FinishAlignedBranches();
 	writeAlignmentScans();
 	
 	const bool writerSupportsStatistics = _writer->CanWriteStatistics();
 	
+	mergeWorkerStatistics();
+	
+	// All rows are stored before the outputs are finished and closed, so that write
+	// errors are reported here instead of in the destructors of the writers
+	_writer->Flush();
+	
+	// When processing in passes, the statistics of all passes are combined, and the
+	// measurement set is only finished after the last pass. It is finished while the
+	// writers still have it open, so that it is opened and closed only once.
+	if(isLastPass && !msWriters.empty())
+	{
+		// Parallel bands finish their sets one at a time
+		std::lock_guard<std::recursive_mutex> tableLock(MSWriter::TableMutex());
+		if(_collectStatistics && writerSupportsStatistics) {
+			std::cout << "Writing statistics to measurement set...\n";
+			// Every set gets the statistics, except the shards after the first: the combined table
+			// of a sharded set uses the subtables of the first shard. Casacore's table cache hands
+			// out the open sets, so they are not read again.
+			for(size_t i=0; i!=msWriters.size(); ++i)
+			{
+				if(i == 0 || i >= shardFilenames.size())
+					_statistics->WriteStatistics(msWriters[i]->Filename());
+			}
+		}
+		std::cout << "Writing MWA fields to measurement set...\n";
+		for(MSWriter* msWriter : msWriters)
+			writeMWAFieldsToMS(*msWriter, _mwaConfig.Header().nScans/partCount);
+	}
+	
+	for(SharedMemoryWriter* shmWriter : shmWriters)
+		shmWriter->Finish();
 	_writer.reset();
 	_reader.reset();
 	
 	// Necessary to make sure it is reinitialized in the following cont band:
 	_flagReader.reset();
 	
-	if(_collectStatistics && writerSupportsStatistics) {
-		std::cout << "Writing statistics to measurement set...\n";
-		_statistics->WriteStatistics(outputFilename);
+	if(isLastPass)
+	{
+		if(_collectStatistics && !_qualityStatisticsFilename.empty()) {
+			std::cout << "Writing statistics to " << _qualityStatisticsFilename << "...\n";
+			_statistics->WriteStatistics(_qualityStatisticsFilename);
+		}
+		
+		// Reset statistics so that a potentially next subband starts with empty statistics
+		_statistics.reset();
+		
+		if(_outputFormat == MSOutputFormat && !shardFilenames.empty())
+		{
+			std::cout << "Combining the shards into " << outputFilename << "...\n";
+			std::lock_guard<std::recursive_mutex> tableLock(MSWriter::TableMutex());
+			ShardedMSWriter::Combine(shardFilenames, outputFilename);
+		}
+		else if(_outputFormat == FitsOutputFormat)
+		{
+			std::cout << "Writing MWA fields to UVFits file...\n";
+			writeMWAFieldsToUVFits(outputFilename);
+		}
+		else if(_outputFormat == ColumnarOutputFormat)
+		{
+			std::cout << "Columnar set written; use cvis2ms and fixmwams to convert it to a measurement set with MWA fields.\n";
+		}
+		for(const ExtraOutput& output : _extraOutputs)
+		{
+			if(output.format == FitsOutputFormat)
+				writeMWAFieldsToUVFits(extraOutputFilename(output));
+		}
 	}
 	
-	if(_collectStatistics && !_qualityStatisticsFilename.empty()) {
-		std::cout << "Writing statistics to " << _qualityStatisticsFilename << "...\n";
-		_statistics->WriteStatistics(_qualityStatisticsFilename);
+	if(useCheckpoints)
+	{
+		checkpoint.IsComplete = true;
+		checkpoint.Write(checkpointFilename);
+		_checkpointFilenames.push_back(checkpointFilename);
 	}
+	_collectStatistics = collectStatistics;
+	
+	_writeWatch.Pause();
+}
+
+size_t Cotter::readChunk(std::vector<std::vector<std::string> >::const_iterator& currentFileSetPtr, bool isFirstChunk, bool skipData)
+{
+	const size_t chunkScans = _curChunkEnd - _curChunkStart;
+	size_t bufferPos = 0;
+	bool continueWithNextFile;
+	do {
+		bool firstRead = (bufferPos == 0 && isFirstChunk);
+		
+		bool moreAvailableInCurrentFile;
+		if(skipData)
+			moreAvailableInCurrentFile = _reader->Skip(bufferPos, chunkScans);
+		else {
+			initializeReader();
+			moreAvailableInCurrentFile = _reader->Read(bufferPos, chunkScans);
+		}
+		
+		if(firstRead && _reader->HasStartTime())
+		{
+			if(_checkRawStartTime)
+				correctStartTime(_reader->StartTime());
+			if(_passIndex == 0)
+				_passStartTime = _reader->StartTime();
+			else if(_reader->StartTime() != _passStartTime)
+				throw std::runtime_error("The gpubox files of this pass start at a different time than those of the first pass, so their timesteps would not line up. Process the band in a single pass.");
+		}
+		
+		if(!moreAvailableInCurrentFile && bufferPos < chunkScans)
+		{
+			if(currentFileSetPtr != _fileSets.end())
+			{
+				// Go to the next set of GPU files and add them to the buffer
+				++currentFileSetPtr;
+				continueWithNextFile = (currentFileSetPtr!=_fileSets.end());
+				if(continueWithNextFile)
+					createReader(*currentFileSetPtr);
+			} else {
+				continueWithNextFile = false;
+			}
+		} else {
+			continueWithNextFile = false;
+		}
+	} while(continueWithNextFile);
+	return bufferPos;
+}
+
+void Cotter::processContiguousBandInPasses(const std::string& outputFilename, size_t timeAvgFactor, size_t freqAvgFactor)
+{
+	if(_outputFormat != MSOutputFormat || !_extraOutputs.empty())
+		throw std::runtime_error("Processing a band in multiple passes is only possible when writing a single measurement set");
+	if(_useDysco)
+		throw std::runtime_error("Processing a band in multiple passes can not be combined with Dysco compression");
 	
-	// Reset statistics so that a potentially next subband starts with empty statistics
-	_statistics.reset();
+	const size_t
+		bandSbStart = _curSbStart,
+		bandSbEnd = _curSbEnd,
+		channelsPerSubband = _mwaConfig.Header().nChannels / _subbandCount;
+	_passCount = (bandSbEnd - bandSbStart + _subbandsPerPass - 1) / _subbandsPerPass;
+	// Every pass, including a smaller last pass, should consist of whole averaged channels
+	const size_t lastPassSubbands = (bandSbEnd - bandSbStart) - (_passCount-1) * _subbandsPerPass;
+	if((_subbandsPerPass * channelsPerSubband) % freqAvgFactor != 0 || (lastPassSubbands * channelsPerSubband) % freqAvgFactor != 0)
+		throw std::runtime_error("When processing a band in multiple passes, the frequency averaging factor should divide the number of channels in each pass");
+	
+	std::cout << "Processing band in " << _passCount << " passes of at most " << _subbandsPerPass << " subbands.\n";
+	
+	// The passes should all use the same start time, so check it once for the files of all subbands
+	const bool checkRawStartTime = _checkRawStartTime;
+	if(_checkRawStartTime)
+		correctStartTimeFromAllFiles();
+	_checkRawStartTime = false;
+	
+	_passBandSbStart = bandSbStart;
+	_passBandFrequenciesHz = _channelFrequenciesHz;
+	for(_passIndex = 0; _passIndex != _passCount; ++_passIndex)
+	{
+		_curSbStart = bandSbStart + _passIndex * _subbandsPerPass;
+		_curSbEnd = std::min(bandSbEnd, _curSbStart + _subbandsPerPass);
+		initializeBandChannelFrequencies();
+		
+		std::cout << " |=== PASS " << (_passIndex+1) << " / " << _passCount << ": subbands " << _curSbStart << "-" << (_curSbEnd-1) << " ===|\n";
+		processOneContiguousBand(outputFilename, timeAvgFactor, freqAvgFactor);
+	}
 	
-	if(_outputFormat == MSOutputFormat)
+	_curSbStart = bandSbStart;
+	_curSbEnd = bandSbEnd;
+	_channelFrequenciesHz = std::move(_passBandFrequenciesHz);
+	_passBandFrequenciesHz.clear();
+	_passIndex = 0;
+	_passCount = 1;
+	_checkRawStartTime = checkRawStartTime;
+}
+
+void Cotter::correctStartTime(std::time_t startTime)
+{
+	std::tm startTimeTm;
+	gmtime_r(&startTime, &startTimeTm);
+	if(startTimeTm.tm_year+1900 != _mwaConfig.Header().year ||
+		startTimeTm.tm_mon+1 != _mwaConfig.Header().month ||
+		startTimeTm.tm_mday != _mwaConfig.Header().day ||
+		startTimeTm.tm_hour != _mwaConfig.Header().refHour ||
+		startTimeTm.tm_min != _mwaConfig.Header().refMinute ||
+		startTimeTm.tm_sec != _mwaConfig.Header().refSecond)
 	{
-		std::cout << "Writing MWA fields to measurement set...\n";
-		writeMWAFieldsToMS(outputFilename, _mwaConfig.Header().nScans/partCount);
+		std::cout << "WARNING: start time according to raw files is "
+			<< startTimeTm.tm_year+1900  << '-' << twoDigits(startTimeTm.tm_mon+1) << '-' << twoDigits(startTimeTm.tm_mday) << ' '
+			<< twoDigits(startTimeTm.tm_hour) << ':' << twoDigits(startTimeTm.tm_min) << ':' << twoDigits(startTimeTm.tm_sec)
+			<< ",\nbut meta files say "
+			<< _mwaConfig.Header().year << '-' << twoDigits(_mwaConfig.Header().month) << '-' << twoDigits(_mwaConfig.Header().day) << ' '
+			<< twoDigits(_mwaConfig.Header().refHour) << ':' << twoDigits(_mwaConfig.Header().refMinute) << ':'
+			<< twoDigits(_mwaConfig.Header().refSecond)
+			<< " !\nWill use start time from raw file, which should be most accurate.\n";
+		_mwaConfig.HeaderRW().year = startTimeTm.tm_year+1900;
+		_mwaConfig.HeaderRW().month = startTimeTm.tm_mon+1;
+		_mwaConfig.HeaderRW().day = startTimeTm.tm_mday;
+		_mwaConfig.HeaderRW().refHour = startTimeTm.tm_hour;
+		_mwaConfig.HeaderRW().refMinute = startTimeTm.tm_min;
+		_mwaConfig.HeaderRW().refSecond = startTimeTm.tm_sec;
+		_mwaConfig.HeaderRW().dateFirstScanMJD = _mwaConfig.Header().GetDateFirstScanFromFields();
 	}
-	else if(_outputFormat == FitsOutputFormat)
+}
+
+void Cotter::correctStartTimeFromAllFiles()
+{
+	GPUFileReader reader(_mwaConfig.NAntennae(), _mwaConfig.Header().nChannels, 1, _offlineGPUBoxFormat);
+	reader.SetHDUOffsetsChangeCallback([](const std::vector<int>&) { });
+	reader.SetHDUIndex(_useHDUIndex, _hduIndexDirectory);
+	reader.SetFollow(_follow, _mwaConfig.Header().integrationTime * 0.5, _followTimeout);
+	const std::vector<std::string>& firstFileset = _fileSets.front();
+	for(size_t sb=0; sb!=_subbandCount; ++sb)
 	{
-		std::cout << "Writing MWA fields to UVFits file...\n";
-		writeMWAFieldsToUVFits(outputFilename);
+		size_t fileBelongingToSB = _subbandOrder[sb];
+		reader.AddFile(firstFileset[fileBelongingToSB].c_str());
 	}
-	
-	_writeWatch.Pause();
+	reader.Initialize(_mwaConfig.Header().integrationTime, _doAlign);
+	reader.Open();
+	if(reader.HasStartTime())
+		correctStartTime(reader.StartTime());
 }
 
 void Cotter::createReader(const std::vector<std::string>& curFileset)
@@ -597,6 +1407,10 @@ void Cotter::createReader(const std::vector<std::string>& curFileset)
 	_reader.reset();
 	_reader.reset(new GPUFileReader(_mwaConfig.NAntennae(), nChannelsInCurSBRange(), _threadCount, _offlineGPUBoxFormat));
 	_reader->SetHDUOffsetsChangeCallback(std::bind(&Cotter::onHDUOffsetsChange, this, std::placeholders::_1));
+	_reader->SetReadahead(_readaheadHDUs);
+	_reader->SetHDUIndex(_useHDUIndex, _hduIndexDirectory);
+	// Poll about twice per integration, which is the rate at which the correlator adds HDUs
+	_reader->SetFollow(_follow, _mwaConfig.Header().integrationTime * 0.5, _followTimeout);
 
 	// Add the gpubox files in the right order
 	for(size_t sb=_curSbStart; sb!=_curSbEnd; ++sb)
@@ -621,14 +1435,29 @@ void Cotter::initializeReader()
 	{
 		for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
 		{
-			ImageSet &imageSet = _imageSetBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+			// Skipped baselines keep an empty buffer, which the reader does not fill
+			if(!isBaselineProcessed(antenna1, antenna2))
+				continue;
 			BaselineBuffer buffer;
-			for(size_t p=0; p!=4; ++p)
+			if(_compactVisibilities)
 			{
-				buffer.real[p] = imageSet.ImageBuffer(p*2);
-				buffer.imag[p] = imageSet.ImageBuffer(p*2+1);
+				CompactImageSet &imageSet = _compactBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+				for(size_t p=0; p!=4; ++p)
+				{
+					buffer.compactReal[p] = imageSet.ImageBuffer(p*2);
+					buffer.compactImag[p] = imageSet.ImageBuffer(p*2+1);
+				}
+				buffer.nElementsPerRow = imageSet.HorizontalStride();
+			}
+			else {
+				ImageSet &imageSet = _imageSetBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+				for(size_t p=0; p!=4; ++p)
+				{
+					buffer.real[p] = imageSet.ImageBuffer(p*2);
+					buffer.imag[p] = imageSet.ImageBuffer(p*2+1);
+				}
+				buffer.nElementsPerRow = imageSet.HorizontalStride();
 			}
-			buffer.nElementsPerRow = imageSet.HorizontalStride();
 			_reader->SetDestBaselineBuffer(antenna1, antenna2, buffer);
 		}
 	}
@@ -664,11 +1493,28 @@ void Cotter::processAndWriteTimestep(size_t timeIndex)
 		{
 			if(outputBaseline(antenna1, antenna2))
 			{
-				const ImageSet& imageSet = _imageSetBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
-				const FlagMask& flagMask = _flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+				const PackedFlagMask& flagMask = _flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second.Mask();
 				
-				const size_t stride = imageSet.HorizontalStride();
-				const size_t flagStride = flagMask.HorizontalStride();
+				const float* images[8];
+				size_t stride, bufferIndex;
+				if(_compactVisibilities)
+				{
+					// Expand only the current timestep of this baseline
+					const CompactImageSet& imageSet = _compactBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+					imageSet.ExpandColumn(timeIndex - _curChunkStart, _expandedColumn.data());
+					for(size_t i=0; i!=8; ++i)
+						images[i] = _expandedColumn.data() + i*nChannels;
+					stride = 1;
+					bufferIndex = 0;
+				}
+				else {
+					const ImageSet& imageSet = _imageSetBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+					for(size_t i=0; i!=8; ++i)
+						images[i] = imageSet.ImageBuffer(i);
+					stride = imageSet.HorizontalStride();
+					bufferIndex = timeIndex - _curChunkStart;
+				}
+				flagMask.ExpandColumn(timeIndex - _curChunkStart, _outputFlags.get());
 				double
 					u = antU[antenna1] - antU[antenna2],
 					v = antV[antenna1] - antV[antenna2],
@@ -686,16 +1532,13 @@ void Cotter::processAndWriteTimestep(size_t timeIndex)
 					}
 				}
 				
-				size_t bufferIndex = timeIndex - _curChunkStart;
 	#ifndef USE_SSE
 				for(size_t p=0; p!=4; ++p)
 				{
 					const float
-						*realPtr = imageSet.ImageBuffer(p*2)+bufferIndex,
-						*imagPtr = imageSet.ImageBuffer(p*2+1)+bufferIndex;
-					const bool *flagPtr = flagMask.Buffer()+bufferIndex;
+						*realPtr = images[p*2]+bufferIndex,
+						*imagPtr = images[p*2+1]+bufferIndex;
 					std::complex<float> *outDataPtr = &_outputData[p];
-					bool *outputFlagPtr = &_outputFlags[p];
 					for(size_t ch=0; ch!=nChannels; ++ch)
 					{
 						// Apply geometric phase delay (for w)
@@ -709,27 +1552,22 @@ void Cotter::processAndWriteTimestep(size_t timeIndex)
 						} else {
 							*outDataPtr = std::complex<float>(*realPtr, *imagPtr);
 						}
-						*outputFlagPtr = *flagPtr;
 						realPtr += stride;
 						imagPtr += stride;
-						flagPtr += flagStride;
 						outDataPtr += 4;
-						outputFlagPtr += 4;
 					}
 				}
 	#else
 				const float
-					*realAPtr = imageSet.ImageBuffer(0)+bufferIndex,
-					*imagAPtr = imageSet.ImageBuffer(1)+bufferIndex,
-					*realBPtr = imageSet.ImageBuffer(2)+bufferIndex,
-					*imagBPtr = imageSet.ImageBuffer(3)+bufferIndex,
-					*realCPtr = imageSet.ImageBuffer(4)+bufferIndex,
-					*imagCPtr = imageSet.ImageBuffer(5)+bufferIndex,
-					*realDPtr = imageSet.ImageBuffer(6)+bufferIndex,
-					*imagDPtr = imageSet.ImageBuffer(7)+bufferIndex;
-				const bool *flagPtr = flagMask.Buffer()+bufferIndex;
+					*realAPtr = images[0]+bufferIndex,
+					*imagAPtr = images[1]+bufferIndex,
+					*realBPtr = images[2]+bufferIndex,
+					*imagBPtr = images[3]+bufferIndex,
+					*realCPtr = images[4]+bufferIndex,
+					*imagCPtr = images[5]+bufferIndex,
+					*realDPtr = images[6]+bufferIndex,
+					*imagDPtr = images[7]+bufferIndex;
 				std::complex<float> *outDataPtr = &_outputData[0];
-				bool *outputFlagPtr = &_outputFlags[0];
 				for(size_t ch=0; ch!=nChannels; ++ch)
 				{
 					// Apply geometric phase delay (for w)
@@ -753,15 +1591,10 @@ void Cotter::processAndWriteTimestep(size_t timeIndex)
 						*(outDataPtr+2) = std::complex<float>(*realCPtr, *imagCPtr);
 						*(outDataPtr+3) = std::complex<float>(*realDPtr, *imagDPtr);
 					}
-					*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-					*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-					*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-					*outputFlagPtr = *flagPtr; ++outputFlagPtr;
 					realAPtr += stride; imagAPtr += stride;
 					realBPtr += stride; imagBPtr += stride;
 					realCPtr += stride; imagCPtr += stride;
 					realDPtr += stride; imagDPtr += stride;
-					flagPtr += flagStride;
 					outDataPtr += 4;
 				}
 	#endif
@@ -775,7 +1608,6 @@ void Cotter::processAndWriteTimestep(size_t timeIndex)
 void Cotter::processAndWriteTimestepFlagsOnly(size_t timeIndex)
 {
 	const size_t antennaCount = _mwaConfig.NAntennae();
-	const size_t nChannels = nChannelsInCurSBRange();
 	const double dateMJD = _mwaConfig.Header().dateFirstScanMJD + timeIndex * _mwaConfig.Header().integrationTime/86400.0;
 	
 	_writer->AddRows(rowsPerTimescan());
@@ -787,22 +1619,9 @@ void Cotter::processAndWriteTimestepFlagsOnly(size_t timeIndex)
 		{
 			if(outputBaseline(antenna1, antenna2))
 			{
-				const FlagMask& flagMask = _flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+				const PackedFlagMask& flagMask = _flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second.Mask();
 				
-				const size_t flagStride = flagMask.HorizontalStride();
-				
-				size_t bufferIndex = timeIndex - _curChunkStart;
-				for(size_t p=0; p!=4; ++p)
-				{
-					const bool *flagPtr = flagMask.Buffer()+bufferIndex;
-					bool *outputFlagPtr = &_outputFlags[p];
-					for(size_t ch=0; ch!=nChannels; ++ch)
-					{
-						*outputFlagPtr = *flagPtr;
-						flagPtr += flagStride;
-						outputFlagPtr += 4;
-					}
-				}
+				flagMask.ExpandColumn(timeIndex - _curChunkStart, _outputFlags.get());
 				
 				_writer->WriteRow(dateMJD*86400.0, dateMJD*86400.0, antenna1, antenna2, 0.0, 0.0, 0.0, _mwaConfig.Header().integrationTime, _outputData.get(), _outputFlags.get(), _outputWeights.get());
 			}
@@ -831,33 +1650,155 @@ void Cotter::CalculateUVW(double date, size_t antenna1, size_t antenna2, double
 	w = w1 - w2;
 }
 
-void Cotter::baselineProcessThreadFunc()
+void Cotter::startWorkers()
+{
+	if(_workerThreads.empty())
+	{
+		_workerStatistics.resize(_threadCount);
+		for(size_t i=0; i!=_threadCount; ++i)
+		{
+			// Workers are divided evenly over the nodes
+			const size_t node = i * _baselinesToProcess.size() / _threadCount;
+			_workerThreads.emplace_back(&Cotter::workerThreadFunc, this, node, i);
+		}
+	}
+}
+
+void Cotter::runWorkers()
+{
+	startWorkers();
+	std::unique_lock<std::mutex> lock(_mutex);
+	++_workerGeneration;
+	_busyWorkerCount = _workerThreads.size();
+	_workerStartCondition.notify_all();
+	_workerDoneCondition.wait(lock, [&]() { return _busyWorkerCount == 0; });
+}
+
+void Cotter::stopWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stopWorkers = true;
+	}
+	_workerStartCondition.notify_all();
+	for(std::thread& t : _workerThreads)
+		t.join();
+	_workerThreads.clear();
+	_stopWorkers = false;
+}
+
+void Cotter::mergeWorkerStatistics()
+{
+	std::vector<QualityStatistics*> statistics;
+	for(std::unique_ptr<QualityStatistics>& workerStatistics : _workerStatistics)
+	{
+		if(workerStatistics)
+			statistics.push_back(workerStatistics.get());
+	}
+	if(statistics.empty())
+		return;
+	
+	// Pairwise reduction: each round adds the statistics at distance 'step' in parallel,
+	// so that merging takes log2(n) rounds instead of n serial merges.
+	for(size_t step=1; step < statistics.size(); step*=2)
+	{
+		std::vector<std::thread> threads;
+		for(size_t i=0; i+step < statistics.size(); i+=step*2)
+			threads.emplace_back([&statistics, i, step]() { (*statistics[i]) += *statistics[i+step]; });
+		for(std::thread& t : threads)
+			t.join();
+	}
+	
+	if(!_statistics)
+		_statistics.reset(new QualityStatistics(std::move(*statistics.front())));
+	else
+		(*_statistics) += *statistics.front();
+	for(std::unique_ptr<QualityStatistics>& workerStatistics : _workerStatistics)
+		workerStatistics.reset();
+}
+
+void Cotter::workerThreadFunc(size_t node, size_t workerIndex)
 {
 	try {
-		QualityStatistics threadStatistics =
-			_flagger.MakeQualityStatistics(&_scanTimes[_curChunkStart], _curChunkEnd-_curChunkStart, &_channelFrequenciesHz[0], _channelFrequenciesHz.size(), 4, _collectHistograms);
+		if(_numaNodes)
+			_numaNodes->PinCurrentThread(node);
+		// Loading a strategy compiles its script, so each worker does this only once
 		Strategy strategy;
 		if(_rfiDetection)
 			strategy = _flagger.LoadStrategyFile(_strategyFilename);
 		
+		size_t generation = 0;
 		std::unique_lock<std::mutex> lock(_mutex);
-		while(!_baselinesToProcess.empty())
+		while(true)
 		{
-			std::pair<size_t, size_t> baseline = _baselinesToProcess.front();
-			size_t currentTaskCount = _baselinesToProcess.size();
-			_progressBar->SetProgress(_baselinesToProcessCount - currentTaskCount, _baselinesToProcessCount);
-			_baselinesToProcess.pop();
+			_workerStartCondition.wait(lock, [&]() { return _stopWorkers || _workerGeneration != generation; });
+			if(_stopWorkers)
+				break;
+			generation = _workerGeneration;
+			lock.unlock();
+			
+			Stopwatch watch(true);
+			size_t baselineCount = 0, foreignBaselineCount = 0;
+			
+			// The statistics are made for the time axis of the chunk, and are then
+			// added to the statistics that this worker collects over all chunks
+			QualityStatistics chunkStatistics =
+				_flagger.MakeQualityStatistics(_statisticsScanTimes.data(), _statisticsScanTimes.size(), _statisticsFrequenciesHz.data(), _statisticsFrequenciesHz.size(), 4, _collectHistograms);
+			WorkerBuffers buffers;
+			if(_compactVisibilities)
+				buffers.expandedImageSet = _flagger.MakeImageSet(_curChunkEnd-_curChunkStart, nChannelsInCurSBRange(), 8);
+			if(_collectStatistics && (_statisticsTimeFactor != 1 || _statisticsFrequencyFactor != 1))
+			{
+				buffers.statisticsImageSet = _flagger.MakeImageSet(_statisticsScanTimes.size(), _statisticsFrequenciesHz.size(), 8);
+				buffers.statisticsFlags = _flagger.MakeFlagMask(_statisticsScanTimes.size(), _statisticsFrequenciesHz.size());
+				buffers.statisticsCorrelatorFlags = _flagger.MakeFlagMask(_statisticsScanTimes.size(), _statisticsFrequenciesHz.size());
+			}
+			
+			lock.lock();
+			while(true)
+			{
+				// Take baselines of the own node first, and help other nodes once those are done
+				size_t queueIndex = node, currentTaskCount = 0;
+				for(size_t i=0; i!=_baselinesToProcess.size(); ++i)
+				{
+					const size_t curQueue = (node + i) % _baselinesToProcess.size();
+					if(_baselinesToProcess[queueIndex].empty())
+						queueIndex = curQueue;
+					currentTaskCount += _baselinesToProcess[curQueue].size();
+				}
+				if(currentTaskCount == 0)
+					break;
+				std::pair<size_t, size_t> baseline = _baselinesToProcess[queueIndex].front();
+				_progressBar->SetProgress(_baselinesToProcessCount - currentTaskCount, _baselinesToProcessCount);
+				_baselinesToProcess[queueIndex].pop();
+				lock.unlock();
+				
+				processBaseline(baseline.first, baseline.second, strategy, chunkStatistics, buffers);
+				++baselineCount;
+				if(queueIndex != node)
+					++foreignBaselineCount;
+				lock.lock();
+			}
 			lock.unlock();
 			
-			processBaseline(baseline.first, baseline.second, strategy, threadStatistics);
+			std::unique_ptr<QualityStatistics>& workerStatistics = _workerStatistics[workerIndex];
+			if(!workerStatistics)
+				workerStatistics.reset(new QualityStatistics(std::move(chunkStatistics)));
+			else
+				(*workerStatistics) += chunkStatistics;
+			
 			lock.lock();
+			if(_numaNodes)
+			{
+				watch.Pause();
+				NodeStatistics& nodeStatistics = _nodeStatistics[node];
+				nodeStatistics.baselineCount += baselineCount;
+				nodeStatistics.foreignBaselineCount += foreignBaselineCount;
+				nodeStatistics.threadSeconds += watch.Seconds();
+			}
+			--_busyWorkerCount;
+			_workerDoneCondition.notify_all();
 		}
-		
-		// Mutex still needs to be locked
-		if(!_statistics)
-			_statistics.reset(new QualityStatistics(threadStatistics));
-		else
-			(*_statistics) += threadStatistics;
 	}
 	catch(std::exception& exception)
 	{
@@ -871,9 +1812,160 @@ void Cotter::baselineProcessThreadFunc()
 	}
 }
 
-void Cotter::processBaseline(size_t antenna1, size_t antenna2, aoflagger::Strategy& strategy, QualityStatistics& statistics)
+void Cotter::initializeImageSetBuffersOnNodes(bool allocate, size_t nChannels, size_t requiredWidthCapacity)
+{
+	const size_t
+		antennaCount = _mwaConfig.NAntennae(),
+		baselineCount = processedBaselineCount(),
+		scanCount = _curChunkEnd-_curChunkStart;
+	auto nodeFunc = [&](size_t node)
+	{
+		_numaNodes->PinCurrentThread(node);
+		size_t baselineIndex = 0;
+		for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
+		{
+			for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
+			{
+				if(!isBaselineProcessed(antenna1, antenna2))
+					continue;
+				if(baselineNode(baselineIndex, baselineCount) == node)
+				{
+					std::pair<size_t,size_t> key(antenna1, antenna2);
+					if(allocate && _compactVisibilities)
+					{
+						CompactImageSet imageSet(scanCount, nChannels, 8, requiredWidthCapacity);
+						std::lock_guard<std::mutex> lock(_mutex);
+						_compactBuffers.emplace(key, std::move(imageSet));
+					}
+					else if(allocate)
+					{
+						ImageSet imageSet = _flagger.MakeImageSet(scanCount, nChannels, 8, 0.0f, requiredWidthCapacity);
+						std::lock_guard<std::mutex> lock(_mutex);
+						_imageSetBuffers.emplace(key, std::move(imageSet));
+					}
+					else if(_compactVisibilities)
+					{
+						CompactImageSet& imageSet = _compactBuffers.find(key)->second;
+						imageSet.ResizeWithoutReallocation(scanCount);
+						imageSet.SetZero();
+					}
+					else {
+						// No elements are added to the map, so it can be searched concurrently
+						ImageSet& imageSet = _imageSetBuffers.find(key)->second;
+						imageSet.ResizeWithoutReallocation(scanCount);
+						imageSet.Set(0.0f);
+					}
+				}
+				++baselineIndex;
+			}
+		}
+	};
+	std::vector<std::thread> threadGroup;
+	for(size_t node=0; node!=_numaNodes->NodeCount(); ++node)
+		threadGroup.emplace_back(nodeFunc, node);
+	for(std::thread& t : threadGroup)
+		t.join();
+}
+
+MemoryModel Cotter::makeMemoryModel(size_t nChannels, size_t freqAvgFactor) const
+{
+	// Rough sizes of allocations that are made inside aoflagger. The strategy works on
+	// a few copies of the image set of a baseline, and the quality statistics keep a
+	// few counts and sums for each polarization and time step.
+	const size_t
+		strategyImageSetCopies = 3,
+		statisticsBytesPerStep = 4 * 128;
+	const size_t
+		antennaCount = _mwaConfig.NAntennae(),
+		allBaselineCount = (antennaCount+1)*antennaCount/2,
+		baselineCount = processedBaselineCount(),
+		valueSize = _compactVisibilities ? sizeof(uint16_t) : sizeof(float),
+		imageSetBytesPerScan = 8 * nChannels * sizeof(float),
+		gpuMatrixSizePerFile = nChannels * allBaselineCount * 4 / (_curSbEnd - _curSbStart),
+		statisticsFactor = _statisticsTimeFactor * _statisticsFrequencyFactor;
+	
+	MemoryModel model;
+	// Everything that is already resident, such as the metadata and the writer, is taken from
+	// the budget as well. Band workers share the process with other bands, whose usage is not
+	// part of their budget.
+	if(_processMemoryBudget == 0)
+		model.Add("Resident before processing", MemoryModel::ResidentSetSize(), 0);
+	model.Add("Visibility window", 0, baselineCount * 8 * nChannels * valueSize);
+	// Flags are kept bit-packed after processing; flags read from a file are unpacked until then
+	model.Add("Flag masks", 0, (baselineCount + 7) / 8 * nChannels + 2 * nChannels * sizeof(bool));
+	if(!_flagFileTemplate.empty())
+		model.Add("Flags from file", 0, baselineCount * nChannels * sizeof(bool));
+	model.AddPerThread("Reader matrix buffers", gpuMatrixSizePerFile * sizeof(std::complex<float>), 0);
+	if(_rfiDetection)
+		model.AddPerThread("Strategy working memory", 0, strategyImageSetCopies * imageSetBytesPerScan + 3 * nChannels * sizeof(bool));
+	if(_compactVisibilities)
+		model.AddPerThread("Expanded baseline", 0, imageSetBytesPerScan);
+	if(_collectStatistics)
+	{
+		// Each worker accumulates statistics over the whole band, and makes them per chunk
+		model.AddPerThread("Quality statistics",
+			(_mwaConfig.Header().nScans / _statisticsTimeFactor + nChannels / _statisticsFrequencyFactor) * statisticsBytesPerStep,
+			statisticsBytesPerStep / _statisticsTimeFactor);
+		if(statisticsFactor != 1)
+			model.AddPerThread("Reduced statistics buffers", 0, (imageSetBytesPerScan + 2 * nChannels * sizeof(bool)) / statisticsFactor);
+	}
+	if(!_skipWriting)
+	{
+		// Output row buffers and the row that is queued in each threaded writer
+		size_t writerBytes = nChannels * 4 * (sizeof(std::complex<float>) + sizeof(float) + sizeof(bool)) * 3;
+		if(_compactVisibilities)
+			writerBytes += nChannels * 8 * sizeof(float);
+		if(_processMemoryBudget != 0 && freqAvgFactor != 1)
+		{
+			// The averaging writer keeps a row of all baselines. For the top-level
+			// Cotter, it is already included in the resident size.
+			const size_t avgChannelCount = nChannels / freqAvgFactor;
+			writerBytes += allBaselineCount * avgChannelCount * 4 *
+				(sizeof(std::complex<float>) * 2 + sizeof(bool) + sizeof(float) + sizeof(size_t));
+		}
+		model.Add("Writer buffers", writerBytes, 0);
+	}
+	return model;
+}
+
+void Cotter::reportPeakRSS() const
 {
-	ImageSet& imageSet = _imageSetBuffers.find(std::pair<size_t,size_t>(antenna1, antenna2))->second;
+	if(_readPeakRSS != 0)
+	{
+		std::cout << "Peak resident memory in reading: " << MemoryModel::ToString(_readPeakRSS)
+			<< " processing: " << MemoryModel::ToString(_processPeakRSS)
+			<< " writing: " << MemoryModel::ToString(_writePeakRSS);
+		if(_processMemoryBudget != 0)
+			std::cout << " (of the whole process)";
+		std::cout << '\n';
+	}
+}
+
+void Cotter::reportNodeStatistics() const
+{
+	if(_numaNodes)
+	{
+		for(size_t node=0; node!=_numaNodes->NodeCount(); ++node)
+		{
+			const NodeStatistics& nodeStatistics = _nodeStatistics[node];
+			std::cout << "NUMA node " << _numaNodes->NodeNumber(node) << ": processed " << nodeStatistics.baselineCount << " baselines ("
+				<< nodeStatistics.foreignBaselineCount << " owned by other nodes) in " << round(nodeStatistics.threadSeconds*10.0)/10.0 << " s of thread time";
+			if(nodeStatistics.threadSeconds > 0.0)
+				std::cout << ", " << round(nodeStatistics.baselineCount / nodeStatistics.threadSeconds * 10.0)/10.0 << " baselines/s per thread";
+			std::cout << ".\n";
+		}
+	}
+}
+
+void Cotter::processBaseline(size_t antenna1, size_t antenna2, aoflagger::Strategy& strategy, QualityStatistics& statistics, WorkerBuffers& buffers)
+{
+	CompactImageSet* compactImageSet = nullptr;
+	if(_compactVisibilities)
+	{
+		compactImageSet = &_compactBuffers.find(std::pair<size_t,size_t>(antenna1, antenna2))->second;
+		compactImageSet->ExpandTo(buffers.expandedImageSet);
+	}
+	ImageSet& imageSet = _compactVisibilities ? buffers.expandedImageSet : _imageSetBuffers.find(std::pair<size_t,size_t>(antenna1, antenna2))->second;
 	const MWAInput
 		&input1X = _mwaConfig.AntennaXInput(antenna1),
 		&input1Y = _mwaConfig.AntennaYInput(antenna1),
@@ -927,47 +2019,152 @@ void Cotter::processBaseline(size_t antenna1, size_t antenna2, aoflagger::Strate
 	}
 	
 	FlagMask flagMask;
-	FlagMask *correlatorMask;
+	const FlagMask *correlatorMask, *resultMask = &flagMask;
+	std::shared_ptr<const PackedFlagMask> sharedFlags;
+	BaselineFlags& flags = _flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
 	// Perform RFI detection, if baseline is not flagged.
 	bool skipFlagging = input1X.isFlagged || input1Y.isFlagged || input2X.isFlagged || input2Y.isFlagged || _isAntennaFlaggedMap[antenna1] || _isAntennaFlaggedMap[antenna2];
 	if(skipFlagging)
 	{
 		if(_flagFileTemplate.empty())
-			flagMask = _fullysetMask;
+		{
+			resultMask = _fullysetMask.get();
+			sharedFlags = _packedFullysetMask;
+		}
 		else
-			flagMask = std::move(_flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second);
-		correlatorMask = &_fullysetMask;
+			flagMask = std::move(flags.fileFlags);
+		correlatorMask = _fullysetMask.get();
 	}
 	else 
 	{
-		correlatorMask = &_correlatorMask;
-		if(!_flagFileTemplate.empty())
+		correlatorMask = _correlatorMask.get();
+		if(!_flagFileTemplate.empty() && antenna1 != antenna2)
 		{
-			flagMask = std::move(_flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second);
-			if(antenna1 == antenna2)
-			{
-				flagMask = _flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), false);
-			}
+			flagMask = std::move(flags.fileFlags);
+			mergeCorrelatorFlags(flagMask);
 		}
-		else if(_rfiDetection && (antenna1 != antenna2))
+		else if(_flagFileTemplate.empty() && _rfiDetection && (antenna1 != antenna2))
+		{
 			flagMask = strategy.Run(imageSet, *correlatorMask);
-		else
-			flagMask = _flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), false);
-		flagBadCorrelatorSamples(flagMask);
+			mergeCorrelatorFlags(flagMask);
+		}
+		else {
+			resultMask = _correlatorMask.get();
+			sharedFlags = _packedCorrelatorMask;
+		}
 	}
 	
 	// Collect statistics
 	if(_collectStatistics)
-		statistics.CollectStatistics(imageSet, flagMask, *correlatorMask, antenna1, antenna2);
+		collectStatistics(statistics, imageSet, *resultMask, *correlatorMask, antenna1, antenna2, buffers);
 	
 	// If this is an auto-correlation, it wouldn't have been flagged yet
 	// to allow collecting its statistics. But we want to flag it...
 	if(antenna1 == antenna2 && _flagAutos)
+		sharedFlags = _packedFullysetMask;
+	
+	// Keep the flags bit-packed until they are written
+	flags.fileFlags = FlagMask();
+	if(sharedFlags)
+		flags.shared = std::move(sharedFlags);
+	else
+		flags.packed = PackedFlagMask(flagMask);
+	
+	// Store the corrected visibilities for writing
+	if(compactImageSet)
+		compactImageSet->CompressFrom(imageSet);
+}
+
+void Cotter::collectStatistics(QualityStatistics& statistics, const ImageSet& imageSet, const FlagMask& flagMask, const FlagMask& correlatorMask, size_t antenna1, size_t antenna2, WorkerBuffers& buffers) const
+{
+	if(_statisticsTimeFactor == 1 && _statisticsFrequencyFactor == 1)
 	{
-		flagMask = _fullysetMask;
+		statistics.CollectStatistics(imageSet, flagMask, correlatorMask, antenna1, antenna2);
+		return;
 	}
 	
-	_flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second = std::move(flagMask);
+	// Average blocks of samples, leaving out samples with correlator flags. A block is
+	// only flagged when all its samples are. When all its samples that are not
+	// correlator flagged are RFI, the block gets their average, so that it still
+	// counts towards the RFI statistics.
+	ImageSet& reduced = buffers.statisticsImageSet;
+	FlagMask
+		&reducedFlags = buffers.statisticsFlags,
+		&reducedCorrelatorFlags = buffers.statisticsCorrelatorFlags;
+	const size_t
+		width = imageSet.Width(),
+		height = imageSet.Height(),
+		stride = imageSet.HorizontalStride(),
+		flagStride = flagMask.HorizontalStride(),
+		correlatorStride = correlatorMask.HorizontalStride();
+	for(size_t reducedY=0; reducedY!=reduced.Height(); ++reducedY)
+	{
+		const size_t
+			yStart = reducedY * _statisticsFrequencyFactor,
+			yEnd = std::min(height, yStart + _statisticsFrequencyFactor);
+		for(size_t reducedX=0; reducedX!=reduced.Width(); ++reducedX)
+		{
+			const size_t
+				xStart = reducedX * _statisticsTimeFactor,
+				xEnd = std::min(width, xStart + _statisticsTimeFactor);
+			size_t unflaggedCount = 0, rfiCount = 0;
+			double unflaggedSum[8] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0}, rfiSum[8] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+			for(size_t y=yStart; y!=yEnd; ++y)
+			{
+				for(size_t x=xStart; x!=xEnd; ++x)
+				{
+					if(correlatorMask.Buffer()[y*correlatorStride + x])
+						continue;
+					double* sum;
+					if(flagMask.Buffer()[y*flagStride + x])
+					{
+						sum = rfiSum;
+						++rfiCount;
+					}
+					else {
+						sum = unflaggedSum;
+						++unflaggedCount;
+					}
+					for(size_t i=0; i!=8; ++i)
+						sum[i] += imageSet.ImageBuffer(i)[y*stride + x];
+				}
+			}
+			reducedCorrelatorFlags.Buffer()[reducedY*reducedCorrelatorFlags.HorizontalStride() + reducedX] = (unflaggedCount + rfiCount == 0);
+			reducedFlags.Buffer()[reducedY*reducedFlags.HorizontalStride() + reducedX] = (unflaggedCount == 0);
+			for(size_t i=0; i!=8; ++i)
+			{
+				float value = 0.0;
+				if(unflaggedCount != 0)
+					value = unflaggedSum[i] / unflaggedCount;
+				else if(rfiCount != 0)
+					value = rfiSum[i] / rfiCount;
+				reduced.ImageBuffer(i)[reducedY*reduced.HorizontalStride() + reducedX] = value;
+			}
+		}
+	}
+	statistics.CollectStatistics(reduced, reducedFlags, reducedCorrelatorFlags, antenna1, antenna2);
+}
+
+void Cotter::initializeStatisticsAxes()
+{
+	_statisticsScanTimes.clear();
+	for(size_t t=_curChunkStart; t<_curChunkEnd; t+=_statisticsTimeFactor)
+	{
+		const size_t end = std::min(_curChunkEnd, t + _statisticsTimeFactor);
+		double sum = 0.0;
+		for(size_t i=t; i!=end; ++i)
+			sum += _scanTimes[i];
+		_statisticsScanTimes.push_back(sum / (end - t));
+	}
+	_statisticsFrequenciesHz.clear();
+	for(size_t ch=0; ch<_channelFrequenciesHz.size(); ch+=_statisticsFrequencyFactor)
+	{
+		const size_t end = std::min(_channelFrequenciesHz.size(), ch + _statisticsFrequencyFactor);
+		double sum = 0.0;
+		for(size_t i=ch; i!=end; ++i)
+			sum += _channelFrequenciesHz[i];
+		_statisticsFrequenciesHz.push_back(sum / (end - ch));
+	}
 }
 
 void Cotter::correctConjugated(ImageSet& imageSet, size_t imgImageIndex) const
@@ -1066,26 +2263,37 @@ void Cotter::writeAntennae()
 	_writer->WriteAntennae(antennae, _mwaConfig.Header().dateFirstScanMJD*86400.0);
 }
 
-void Cotter::writeSPW()
+void Cotter::makeBandInfo(const std::vector<double>& channelFrequenciesHz, std::string& name, std::vector<Writer::ChannelInfo>& channels, double& refFreq, double& totalBandwidth) const
 {
-	const size_t nCurChannels = nChannelsInCurSBRange();
-	std::vector<MSWriter::ChannelInfo> channels(nCurChannels);
+	const size_t nCurChannels = channelFrequenciesHz.size();
+	channels.resize(nCurChannels);
 	std::ostringstream str;
-	double centreFrequencyMHz = 0.0000005 * (_channelFrequenciesHz[nCurChannels/2-1] + _channelFrequenciesHz[nCurChannels/2]);
+	double centreFrequencyMHz = 0.0000005 * (channelFrequenciesHz[nCurChannels/2-1] + channelFrequenciesHz[nCurChannels/2]);
 	str << "MWA_BAND_" << (round(centreFrequencyMHz*10.0)/10.0);
 	const double chWidth = _mwaConfig.Header().bandwidthMHz * 1000000.0 / _mwaConfig.Header().nChannels;
 	for(size_t ch=0;ch!=nCurChannels;++ch)
 	{
 		MSWriter::ChannelInfo &channel = channels[ch];
-		channel.chanFreq = _channelFrequenciesHz[ch];
+		channel.chanFreq = channelFrequenciesHz[ch];
 		channel.chanWidth = chWidth;
 		channel.effectiveBW = chWidth;
 		channel.resolution = chWidth;
 	}
-	_writer->WriteBandInfo(str.str(),
+	name = str.str();
+	refFreq = centreFrequencyMHz*1000000.0;
+	totalBandwidth = nCurChannels*chWidth;
+}
+
+void Cotter::writeSPW(const std::vector<double>& channelFrequenciesHz)
+{
+	std::string name;
+	std::vector<MSWriter::ChannelInfo> channels;
+	double refFreq, totalBandwidth;
+	makeBandInfo(channelFrequenciesHz, name, channels, refFreq, totalBandwidth);
+	_writer->WriteBandInfo(name,
 		channels,
-		centreFrequencyMHz*1000000.0,
-		nCurChannels*chWidth,
+		refFreq,
+		totalBandwidth,
 		false
 	);
 }
@@ -1328,6 +2536,34 @@ void Cotter::flagBadCorrelatorSamples(FlagMask &flagMask) const
 	}
 }
 
+void Cotter::mergeCorrelatorFlags(FlagMask &flagMask) const
+{
+	// The correlator mask holds exactly the flags that flagBadCorrelatorSamples() would
+	// set, so or-ing it in is equivalent, but takes a single pass over the mask.
+	const FlagMask& correlatorMask = *_correlatorMask;
+	const size_t
+		width = flagMask.Width(),
+		stride = flagMask.HorizontalStride(),
+		correlatorStride = correlatorMask.HorizontalStride();
+	for(size_t y=0; y!=flagMask.Height(); ++y)
+	{
+		bool* flagPtr = flagMask.Buffer() + y*stride;
+		const bool* correlatorPtr = correlatorMask.Buffer() + y*correlatorStride;
+		size_t x = 0;
+#ifdef __SSE2__
+		// Flags are stored as bytes of 0 or 1, so they can be or-ed bitwise
+		for(; x+16 <= width; x+=16)
+		{
+			__m128i flags = _mm_loadu_si128(reinterpret_cast<const __m128i*>(flagPtr + x));
+			__m128i correlatorFlags = _mm_loadu_si128(reinterpret_cast<const __m128i*>(correlatorPtr + x));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(flagPtr + x), _mm_or_si128(flags, correlatorFlags));
+		}
+#endif
+		for(; x!=width; ++x)
+			flagPtr[x] = flagPtr[x] || correlatorPtr[x];
+	}
+}
+
 void Cotter::initializeWeights(aligned_ptr<float>& outputWeights)
 {
 	// Weights are normalized so that default res of 10 kHz, 1s has weight of "1" per sample
@@ -1386,39 +2622,53 @@ void Cotter::initializeSbOrder()
 
 void Cotter::writeAlignmentScans()
 {
-	if(!_writer->IsTimeAligned(0, 0))
+	// With baseline-dependent averaging, baselines are averaged over different numbers
+	// of timesteps, so each baseline is padded until its own average is complete
+	const size_t nChannels = nChannelsInCurSBRange();
+	const size_t antennaCount = _mwaConfig.NAntennae();
+	const size_t nScans = _mwaConfig.Header().nScans;
+	size_t timeIndex = nScans;
+	bool isPadding = true;
+	while(isPadding)
 	{
-		const size_t nChannels = nChannelsInCurSBRange();
-		const size_t antennaCount = _mwaConfig.NAntennae();
-		std::cout << "Nr of timesteps did not match averaging size, last averaged sample will be downweighted" << std::flush;
-		size_t timeIndex = _mwaConfig.Header().nScans;
-		
-		_outputFlags.reset(new bool[nChannels*4]);
-		_outputData = make_aligned<std::complex<float>>(nChannels*4, 16);
-		_outputWeights = make_aligned<float>(nChannels*4, 16);
-		for(size_t ch=0; ch!=nChannels*4; ++ch)
-		{
-			_outputData[ch] = std::complex<float>(0.0, 0.0);
-			_outputFlags[ch] = true;
-			_outputWeights[ch] = 0.0;
-		}
-		while(!_writer->IsTimeAligned(0, 0))
+		isPadding = false;
+		const double dateMJD = _mwaConfig.Header().dateFirstScanMJD + timeIndex * _mwaConfig.Header().integrationTime/86400.0;
+		for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
 		{
-			_writer->AddRows(rowsPerTimescan());
-			const double dateMJD = _mwaConfig.Header().dateFirstScanMJD + timeIndex * _mwaConfig.Header().integrationTime/86400.0;
-			for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
+			for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
 			{
-				for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
+				if(outputBaseline(antenna1, antenna2) && !_writer->IsTimeAligned(antenna1, antenna2))
 				{
-					if(outputBaseline(antenna1, antenna2))
+					if(!isPadding)
 					{
-						_writer->WriteRow(dateMJD*86400.0, dateMJD*86400.0, antenna1, antenna2, 0.0, 0.0, 0.0, _mwaConfig.Header().integrationTime, _outputData.get(), _outputFlags.get(), _outputWeights.get());
+						if(timeIndex == nScans)
+						{
+							std::cout << "Nr of timesteps did not match averaging size, last averaged sample will be downweighted" << std::flush;
+							_outputFlags.reset(new bool[nChannels*4]);
+							_outputData = make_aligned<std::complex<float>>(nChannels*4, 16);
+							_outputWeights = make_aligned<float>(nChannels*4, 16);
+							for(size_t ch=0; ch!=nChannels*4; ++ch)
+							{
+								_outputData[ch] = std::complex<float>(0.0, 0.0);
+								_outputFlags[ch] = true;
+								_outputWeights[ch] = 0.0;
+							}
+						}
+						_writer->AddRows(rowsPerTimescan());
+						isPadding = true;
 					}
+					_writer->WriteRow(dateMJD*86400.0, dateMJD*86400.0, antenna1, antenna2, 0.0, 0.0, 0.0, _mwaConfig.Header().integrationTime, _outputData.get(), _outputFlags.get(), _outputWeights.get());
 				}
 			}
+		}
+		if(isPadding)
+		{
 			++timeIndex;
 			std::cout << '.' << std::flush;
 		}
+	}
+	if(timeIndex != nScans)
+	{
 		_outputData.reset();
 		_outputWeights.reset();
 		_outputFlags.reset();
@@ -1426,9 +2676,9 @@ void Cotter::writeAlignmentScans()
 	}
 }
 
-void Cotter::writeMWAFieldsToMS(const std::string& outputFilename, size_t flagWindowSize)
+void Cotter::writeMWAFieldsToMS(MSWriter& msWriter, size_t flagWindowSize)
 {
-	MWAMS mwaMs(outputFilename);
+	MWAMS mwaMs(msWriter.OpenMeasurementSet());
 	mwaMs.InitializeMWAFields();
 	
 	size_t nAnt = _mwaConfig.NAntennae();
@@ -3,26 +3,35 @@
 
 #include "aligned_ptr.h"
 #include "averagingwriter.h"
+#include "compactimageset.h"
 #include "gpufilereader.h"
+#include "memorymodel.h"
 #include "mwaconfig.h"
+#include "numanodes.h"
+#include "packedflagmask.h"
 #include "stopwatch.h"
 #include "progressbar.h"
 
 #include <aoflagger.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <queue>
 #include <set>
 #include <string>
+#include <thread>
 
 class GPUFileReader;
 class MSWriter;
+class SharedMemoryWriter;
 
 class Cotter : private UVWCalculater
 {
 	public:
-		enum OutputFormat { MSOutputFormat, FitsOutputFormat, FlagsOutputFormat };
+		enum OutputFormat { MSOutputFormat, FitsOutputFormat, FlagsOutputFormat, ColumnarOutputFormat, SharedMemoryOutputFormat, UVH5OutputFormat };
 		
 		Cotter();
 		~Cotter();
@@ -31,11 +40,33 @@ class Cotter : private UVWCalculater
 		
 		void SetOutputFilename(const std::string& outputFilename) { _outputFilename = outputFilename; _defaultFilename = false; }
 		void SetOutputFormat(enum OutputFormat format) { _outputFormat = format; }
+		/**
+		 * Write the processed visibilities also to another output, with its own format and
+		 * resolution, while reading and flagging only once. See @ref TeeWriter.
+		 */
+		void AddExtraOutput(const std::string& filename, enum OutputFormat format, double timeRes_s, double freqRes_kHz)
+		{
+			ExtraOutput output;
+			output.filename = filename;
+			output.format = format;
+			output.timeRes_s = timeRes_s;
+			output.freqRes_kHz = freqRes_kHz;
+			output.timeAvgFactor = 1;
+			output.freqAvgFactor = 1;
+			_extraOutputs.push_back(output);
+		}
 		void SetFileSets(const std::vector<std::vector<std::string> >& fileSets) { _fileSets = fileSets; }
 		void SetThreadCount(size_t threadCount) { _threadCount = threadCount; }
 		void SetRFIDetection(bool performRFIDetection) { _rfiDetection = performRFIDetection; }
 		void SetCollectStatistics(bool collectStatistics) { _collectStatistics = collectStatistics; }
 		void SetCollectHistograms(bool collectHistograms) { _collectHistograms = collectHistograms; }
+		/** Collect the statistics at a lower resolution, by averaging the given number of
+		 * timesteps and channels before collecting them. */
+		void SetStatisticsResolution(size_t timeFactor, size_t frequencyFactor)
+		{
+			_statisticsTimeFactor = std::max<size_t>(1, timeFactor);
+			_statisticsFrequencyFactor = std::max<size_t>(1, frequencyFactor);
+		}
 		void SetHistoryInfo(const std::string &commandLine) { _commandLine = commandLine; }
 		void SetMetaFilename(const char *metaFilename) { _metaFilename = metaFilename; }
 		void SetAntennaLocationsFilename(const char *filename) { _antennaLocationsFilename = filename; }
@@ -58,6 +89,12 @@ class Cotter : private UVWCalculater
         void SetDoCorrectCableLength(bool doCorrectCableLength) { _doCorrectCableLength = doCorrectCableLength; }
 		void SetSubbandCount(size_t subbandCount) { _subbandCount = subbandCount; }
 		void SetRemoveFlaggedAntennae(bool removeFlaggedAntennae) { _removeFlaggedAntennae = removeFlaggedAntennae; }
+		/** Do not read, store or process baselines that are not written to the output. Statistics are then
+		 * only collected for the written baselines. */
+		void SetSkipPrunedBaselines(bool skipPrunedBaselines) { _skipPrunedBaselines = skipPrunedBaselines; }
+		/** Keep the visibilities in memory as bfloat16, see @ref CompactImageSet. Each baseline
+		 * is expanded to floats while it is processed and while its rows are written. */
+		void SetCompactVisibilities(bool compactVisibilities) { _compactVisibilities = compactVisibilities; }
 		void SetRemoveAutoCorrelations(bool removeAutoCorrelations) { _removeAutoCorrelations = removeAutoCorrelations; }
 		void SetReadSubbandPassbandFile(const std::string& subbandPassbandFilename)
 		{
@@ -71,11 +108,34 @@ class Cotter : private UVWCalculater
 		void SetFlagFileTemplate(const std::string& flagFileTemplate) { _flagFileTemplate = flagFileTemplate; }
 		void SetSaveQualityStatistics(const std::string& file) { _qualityStatisticsFilename = file; }
 		void SetSkipWriting(bool skipWriting) { _skipWriting = skipWriting; }
+		/** Continue writing a measurement set from its checkpoint, see @ref Checkpoint. */
+		void SetResume(bool resume) { _resume = resume; }
 		void FlagAntenna(size_t antIndex) { _userFlaggedAntennae.push_back(antIndex); }
 		void FlagSubband(size_t sbIndex) { _flaggedSubbands.insert(sbIndex); }
 		void SetSubbandEdgeFlagWidth(double edgeFlagWidth) { _subbandEdgeFlagWidthKHz = edgeFlagWidth; }
 		void SetOfflineGPUBoxFormat(bool offlineFormat) { _offlineGPUBoxFormat = offlineFormat; }
 		void SetUseDysco(bool useDysco) { _useDysco = useDysco; }
+		/** Store uniform weights compactly when they are the same for every row, see @ref MSWriter::SetUniformWeights(). */
+		void SetCompactWeights(bool compactWeights) { _compactWeights = compactWeights; }
+		/** Seconds that shared memory output waits for a consumer to attach or to read a row. */
+		void SetSharedMemoryTimeout(double timeout) { _sharedMemoryTimeout = timeout; }
+		void SetUVH5DeflateLevel(int deflateLevel) { _uvh5DeflateLevel = deflateLevel; }
+		/**
+		 * Average short baselines further than the output resolution, see @ref AveragingWriter::SetBaselineDependentAveraging().
+		 * @param decorrelation Allowed decorrelation at the edge of the field; zero disables it.
+		 * @param fieldRadius Radius of the field in radians.
+		 * @param maxTimeRes_s Coarsest time resolution of a baseline.
+		 * @param maxFreqRes_kHz Coarsest frequency resolution of a baseline.
+		 */
+		void SetBaselineDependentAveraging(double decorrelation, double fieldRadius, double maxTimeRes_s, double maxFreqRes_kHz)
+		{
+			_bdaDecorrelation = decorrelation;
+			_bdaFieldRadius = fieldRadius;
+			_bdaMaxTimeRes = maxTimeRes_s;
+			_bdaMaxFreqRes = maxFreqRes_kHz;
+		}
+		/** Write measurement sets in parallel parts, see @ref ShardedMSWriter. */
+		void SetShardCount(size_t shardCount) { _shardCount = std::max<size_t>(1, shardCount); }
 		void SetAdvancedDyscoOptions(size_t dataBitRate, size_t weightBitRate, const std::string& distribution, double distTruncation, const std::string& normalization)
 		{
 			_dyscoDataBitRate = dataBitRate;
@@ -87,10 +147,44 @@ class Cotter : private UVWCalculater
 		void SetSolutionFile(const char* solutionFilename) { _solutionFilename = solutionFilename; }
 		void SetApplyBeforeAveraging(bool beforeAvg) { _applySolutionsBeforeAveraging = beforeAvg; }
 		void SetStrategyFile(const std::string& filename) { _strategyFilename = filename; }
+		void SetProcessBandsInParallel(bool parallelBands) { _parallelBands = parallelBands; }
+		void SetSubbandsPerPass(size_t subbandsPerPass) { _subbandsPerPass = subbandsPerPass; }
+		void SetNUMAAware(bool numaAware) { _numaAware = numaAware; }
+		void SetReadahead(size_t hdusAhead) { _readaheadHDUs = hdusAhead; }
+		/** Use cached HDU indices of the gpubox files, see @ref HDUIndex. An empty directory
+		 * stores the indices next to the gpubox files. */
+		void SetHDUIndex(bool useHDUIndex, const std::string& directory)
+		{
+			_useHDUIndex = useHDUIndex;
+			_hduIndexDirectory = directory;
+		}
+		/**
+		 * Process gpubox files while the correlator is still writing them, see
+		 * GPUFileReader::SetFollow(). The observation ends when the number of scans
+		 * in the metadata has been read, or when the files have not grown for
+		 * @p timeout seconds. Data are processed in windows of at most
+		 * @p windowScans scans, so that each window is written as soon as it has
+		 * arrived. A window of zero only limits the windows by the available memory.
+		 */
+		void SetFollow(double timeout, size_t windowScans)
+		{
+			_follow = true;
+			_followTimeout = timeout;
+			_followWindowScans = windowScans;
+		}
 		size_t SubbandCount() const { return _subbandCount; }
 		
 	private:
-		MWAConfig _mwaConfig;
+		/**
+		 * Constructs a worker that processes a single contiguous band. It copies the settings
+		 * of the given parent, and shares its metadata. The parent should have been initialized,
+		 * i.e., Run() should have been called on it.
+		 */
+		Cotter(Cotter& parent, size_t threadCount, size_t maxBufferSize);
+		
+		// The metadata is owned by the top-level Cotter, and shared with its band workers.
+		std::unique_ptr<MWAConfig> _ownedMWAConfig;
+		MWAConfig& _mwaConfig;
 		std::unique_ptr<Writer> _writer;
 		std::unique_ptr<GPUFileReader> _reader;
 		aoflagger::AOFlagger _flagger;
@@ -100,71 +194,169 @@ class Cotter : private UVWCalculater
 		size_t _unflaggedAntennaCount;
 		
 		Stopwatch _readWatch, _processWatch, _writeWatch;
+		// Highest resident set size measured during each stage of a chunk, in bytes
+		size_t _readPeakRSS, _processPeakRSS, _writePeakRSS;
 		
 		std::vector<std::vector<std::string> > _fileSets;
 		size_t _threadCount;
 		size_t _maxBufferSize;
+		// For band workers, the memory budget in bytes of the whole process that they share
+		size_t _processMemoryBudget;
+		size_t _readaheadHDUs;
+		size_t _shardCount;
+		size_t _statisticsTimeFactor, _statisticsFrequencyFactor;
+		double _followTimeout;
+		size_t _followWindowScans;
 		size_t _subbandCount;
 		size_t _quackInitSampleCount, _quackEndSampleCount;
 		double _subbandEdgeFlagWidthKHz;
 		size_t _subbandEdgeFlagCount;
 		size_t _missingEndScans;
 		size_t _curChunkStart, _curChunkEnd, _curSbStart, _curSbEnd;
+		// Settings and state for processing a band in multiple passes of subbands
+		size_t _subbandsPerPass, _passIndex, _passCount, _passBandSbStart;
+		std::time_t _passStartTime;
+		std::vector<double> _passBandFrequenciesHz;
 		bool _defaultFilename, _rfiDetection, _collectStatistics, _collectHistograms, _usePointingCentre;
 		enum OutputFormat _outputFormat;
 		std::string _outputFilename, _commandLine;
+		struct ExtraOutput
+		{
+			std::string filename;
+			enum OutputFormat format;
+			double timeRes_s, freqRes_kHz;
+			size_t timeAvgFactor, freqAvgFactor;
+		};
+		std::vector<ExtraOutput> _extraOutputs;
 		std::string _metaFilename, _antennaLocationsFilename, _headerFilename, _instrConfigFilename;
 		std::string _subbandPassbandFilename, _flagFileTemplate, _qualityStatisticsFilename;
 		bool _applySolutionsBeforeAveraging;
 		std::string _solutionFilename;
 		std::string _strategyFilename;
+		std::string _hduIndexDirectory;
 		std::vector<size_t> _userFlaggedAntennae;
 		std::set<size_t> _flaggedSubbands;
 		
 		std::map<std::pair<size_t, size_t>, aoflagger::ImageSet> _imageSetBuffers;
-		std::map<std::pair<size_t, size_t>, aoflagger::FlagMask> _flagBuffers;
+		// Replaces _imageSetBuffers when storing the visibilities compactly
+		std::map<std::pair<size_t, size_t>, CompactImageSet> _compactBuffers;
+		/**
+		 * Flags of a baseline. Until the baseline is processed, it holds the flags that were
+		 * read from a flag file. Afterwards, the flags are kept bit-packed until they are written.
+		 * Baselines whose flags are the same for the whole chunk, like flagged tiles, refer to a
+		 * shared read-only mask instead of owning a copy.
+		 */
+		struct BaselineFlags
+		{
+			aoflagger::FlagMask fileFlags;
+			PackedFlagMask packed;
+			std::shared_ptr<const PackedFlagMask> shared;
+			const PackedFlagMask& Mask() const { return shared ? *shared : packed; }
+		};
+		std::map<std::pair<size_t, size_t>, BaselineFlags> _flagBuffers;
 		std::vector<double> _channelFrequenciesHz;
 		std::vector<double> _scanTimes;
-		std::queue<std::pair<size_t,size_t> > _baselinesToProcess;
+		// Time and frequency axes of the statistics of the current chunk
+		std::vector<double> _statisticsScanTimes, _statisticsFrequenciesHz;
+		// One queue per NUMA node; a single queue when not running NUMA aware
+		std::vector<std::queue<std::pair<size_t,size_t> > > _baselinesToProcess;
 		std::unique_ptr<ProgressBar> _progressBar;
 		size_t _baselinesToProcessCount;
 		std::vector<size_t> _subbandOrder;
 		std::vector<int> _hduOffsetsPerGPUBox;
 		std::unique_ptr<class FlagReader> _flagReader;
+		// Checkpoints of the bands that have been completed, which are removed when the run finishes
+		std::vector<std::string> _checkpointFilenames;
 		
 		std::mutex _mutex;
 		std::unique_ptr<aoflagger::QualityStatistics> _statistics;
-		aoflagger::FlagMask _correlatorMask, _fullysetMask;
+		// Read-only masks of the current chunk, shared by the baselines that use them
+		std::shared_ptr<const aoflagger::FlagMask> _correlatorMask, _fullysetMask;
+		std::shared_ptr<const PackedFlagMask> _packedCorrelatorMask, _packedFullysetMask;
 		
-		bool _disableGeometricCorrections, _removeFlaggedAntennae, _removeAutoCorrelations, _flagAutos;
+		bool _disableGeometricCorrections, _removeFlaggedAntennae, _skipPrunedBaselines, _compactVisibilities, _removeAutoCorrelations, _flagAutos;
 		bool _overridePhaseCentre, _doAlign, _doFlagMissingSubbands, _applySBGains, _flagDCChannels, _skipWriting, _doCorrectCableLength;
-		bool _offlineGPUBoxFormat;
+		bool _offlineGPUBoxFormat, _parallelBands, _checkRawStartTime, _numaAware, _useHDUIndex, _follow, _resume;
 		long double _customRARad, _customDecRad;
 		double _initDurationToFlag, _endDurationToFlag;
 		
-		bool _useDysco;
+		bool _useDysco, _compactWeights;
 		size_t _dyscoDataBitRate;
 		size_t _dyscoWeightBitRate;
 		std::string _dyscoDistribution;
 		std::string _dyscoNormalization;
 		double _dyscoDistTruncation;
+		double _sharedMemoryTimeout;
+		int _uvh5DeflateLevel;
+		double _bdaDecorrelation, _bdaFieldRadius, _bdaMaxTimeRes, _bdaMaxFreqRes;
+		size_t _bdaMaxTimeFactor, _bdaMaxFreqFactor;
+		
+		struct NodeStatistics
+		{
+			size_t baselineCount, foreignBaselineCount;
+			double threadSeconds;
+		};
+		std::unique_ptr<NUMANodes> _numaNodes;
+		std::vector<NodeStatistics> _nodeStatistics;
 		
 		std::unique_ptr<bool[]> _outputFlags;
 		aligned_ptr<std::complex<float>> _outputData;
 		aligned_ptr<float> _outputWeights;
+		std::vector<float> _expandedColumn;
+		
+		// Baseline processing workers, which live until the end of the run. Each keeps
+		// its own statistics, which are merged into _statistics at the end of a band.
+		std::vector<std::thread> _workerThreads;
+		std::vector<std::unique_ptr<aoflagger::QualityStatistics>> _workerStatistics;
+		struct WorkerBuffers
+		{
+			// With compact storage, the current baseline is expanded in here
+			aoflagger::ImageSet expandedImageSet;
+			// The current baseline at the resolution of the statistics
+			aoflagger::ImageSet statisticsImageSet;
+			aoflagger::FlagMask statisticsFlags, statisticsCorrelatorFlags;
+		};
+		std::condition_variable _workerStartCondition, _workerDoneCondition;
+		size_t _workerGeneration, _busyWorkerCount;
+		bool _stopWorkers;
 		
 		void processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFactor);
 		void processOneContiguousBand(const std::string& outputFilename, size_t timeAvgFactor, size_t freqAvgFactor);
+		void processContiguousBandsInParallel(const std::vector<std::pair<int, int> >& contiguousSBRanges, const std::string& filenameTemplate, size_t dotPos, size_t timeAvgFactor, size_t freqAvgFactor);
+		void initializeImageSetBuffersOnNodes(bool allocate, size_t nChannels, size_t requiredWidthCapacity);
+		void reportNodeStatistics() const;
+		void reportPeakRSS() const;
+		/** Memory budget in bytes, as set by SetMaxBufferSize(). */
+		size_t memoryBudget() const { return _maxBufferSize * (sizeof(float)*2+1); }
+		MemoryModel makeMemoryModel(size_t nChannels, size_t freqAvgFactor) const;
+		void processContiguousBandInPasses(const std::string& outputFilename, size_t timeAvgFactor, size_t freqAvgFactor);
+		void initializeBandChannelFrequencies();
+		std::string bandFilename(const std::string& filenameTemplate, size_t dotPos) const;
+		std::string extraOutputFilename(const ExtraOutput& output) const;
+		std::unique_ptr<Writer> createExtraWriter(const ExtraOutput& output, const std::string& filename, std::vector<MSWriter*>& msWriters, std::vector<SharedMemoryWriter*>& shmWriters);
+		std::unique_ptr<Writer> makeWriterChain(std::unique_ptr<Writer> writer, size_t timeAvgFactor, size_t freqAvgFactor, bool baselineDependent);
+		std::unique_ptr<Writer> createUVH5Writer(const std::string& filename) const;
+		std::unique_ptr<Writer> createSharedMemoryWriter(const std::string& outputFilename, std::vector<SharedMemoryWriter*>& shmWriters) const;
+		void correctStartTime(std::time_t startTime);
+		void correctStartTimeFromAllFiles();
 		void createReader(const std::vector<std::string> &curFileset);
 		void initializeReader();
+		size_t readChunk(std::vector<std::vector<std::string> >::const_iterator& currentFileSetPtr, bool isFirstChunk, bool skipData);
 		void processAndWriteTimestep(size_t timeIndex);
 		void processAndWriteTimestepFlagsOnly(size_t timeIndex);
-		void baselineProcessThreadFunc();
-		void processBaseline(size_t antenna1, size_t antenna2, aoflagger::Strategy& strategy, aoflagger::QualityStatistics& statistics);
+		void startWorkers();
+		void runWorkers();
+		void stopWorkers();
+		void mergeWorkerStatistics();
+		void workerThreadFunc(size_t node, size_t workerIndex);
+		void processBaseline(size_t antenna1, size_t antenna2, aoflagger::Strategy& strategy, aoflagger::QualityStatistics& statistics, WorkerBuffers& buffers);
+		void collectStatistics(aoflagger::QualityStatistics& statistics, const aoflagger::ImageSet& imageSet, const aoflagger::FlagMask& flagMask, const aoflagger::FlagMask& correlatorMask, size_t antenna1, size_t antenna2, WorkerBuffers& buffers) const;
+		void initializeStatisticsAxes();
 		void correctConjugated(aoflagger::ImageSet& imageSet, size_t imageIndex) const;
 		void correctCableLength(aoflagger::ImageSet& imageSet, size_t polarization, double cableDelay) const;
 		void writeAntennae();
-		void writeSPW();
+		void makeBandInfo(const std::vector<double>& channelFrequenciesHz, std::string& name, std::vector<Writer::ChannelInfo>& channels, double& refFreq, double& totalBandwidth) const;
+		void writeSPW(const std::vector<double>& channelFrequenciesHz);
 		void writeSource();
 		void writeField();
 		void writeObservation();
@@ -172,10 +364,11 @@ class Cotter : private UVWCalculater
 		void readSubbandPassbandFile();
 		void initializeSubbandPassband();
 		void flagBadCorrelatorSamples(aoflagger::FlagMask &flagMask) const;
+		void mergeCorrelatorFlags(aoflagger::FlagMask &flagMask) const;
 		void initializeWeights(aligned_ptr<float>& outputWeights);
 		void initializeSbOrder();
 		void writeAlignmentScans();
-		void writeMWAFieldsToMS(const std::string& outputFilename, size_t flagWindowSize);
+		void writeMWAFieldsToMS(MSWriter& msWriter, size_t flagWindowSize);
 		void writeMWAFieldsToUVFits(const std::string& outputFilename);
 		void onHDUOffsetsChange(const std::vector<int>& newHDUOffsets);
 		size_t rowsPerTimescan() const
@@ -198,6 +391,18 @@ class Cotter : private UVWCalculater
 				output = output && (antenna1 != antenna2);
 			return output;
 		}
+		/** Whether the baseline is read into a buffer and processed. */
+		bool isBaselineProcessed(size_t antenna1, size_t antenna2) const
+		{
+			return !_skipPrunedBaselines || outputBaseline(antenna1, antenna2);
+		}
+		size_t processedBaselineCount() const
+		{
+			if(_skipPrunedBaselines)
+				return rowsPerTimescan();
+			else
+				return _mwaConfig.NAntennae()*(_mwaConfig.NAntennae()+1)/2;
+		}
 		bool isGPUBoxMissing(size_t gpuBoxIndex) const
 		{
 			for(std::vector<std::vector<std::string> >::const_iterator i=_fileSets.begin(); i!=_fileSets.end(); ++i)
@@ -208,6 +413,12 @@ class Cotter : private UVWCalculater
 			}
 			return false;
 		}
+		/** The NUMA node that owns the buffers of the given baseline, with baselines numbered in
+		 * the order antenna1, antenna2 >= antenna1. */
+		size_t baselineNode(size_t baselineIndex, size_t baselineCount) const
+		{
+			return _numaNodes ? baselineIndex * _numaNodes->NodeCount() / baselineCount : 0;
+		}
 		size_t nChannelsInCurSBRange() const
 		{
 			return _mwaConfig.Header().nChannels * (_curSbEnd - _curSbStart) / _subbandCount;
@@ -0,0 +1,50 @@
+#include "columnarfile.h"
+#include "mswriter.h"
+
+#include <iostream>
+#include <memory>
+
+int main(int argc, char* argv[])
+{
+	if(argc != 3)
+	{
+		std::cout <<
+			"cvis2ms converts a set in the columnar format of Cotter (written with '-o <name>.cvis') into a measurement set.\n"
+			"The MWA-specific keywords are not stored in the columnar format; these can be added afterwards with fixmwams.\n\n"
+			"Syntax: cvis2ms <input.cvis> <output.ms>\n";
+		return -1;
+	}
+	const char* inputFilename = argv[1];
+	const char* outputFilename = argv[2];
+
+	ColumnarFile input(inputFilename);
+	const ColumnarFile::Metadata& metadata = input.GetMetadata();
+
+	MSWriter writer(outputFilename);
+	writer.SetArrayLocation(metadata.arrayX, metadata.arrayY, metadata.arrayZ);
+	writer.WriteAntennae(metadata.antennae, metadata.antennaDate);
+	writer.WriteBandInfo(metadata.bandName, metadata.channels, metadata.refFreq, metadata.totalBandwidth, metadata.bandFlagRow);
+	writer.WriteSource(metadata.source);
+	writer.WriteField(metadata.field);
+	writer.WritePolarizationForLinearPols(metadata.polarizationFlagRow);
+	writer.WriteObservation(metadata.observation);
+	if(!metadata.historyApplication.empty())
+		writer.WriteHistoryItem(metadata.historyCommandLine, metadata.historyApplication, metadata.historyParams);
+
+	std::cout << "Converting " << input.RowCount() << " rows...\n";
+	const size_t valueCount = input.ValuesPerRow();
+	std::unique_ptr<bool[]> flags(new bool[valueCount]);
+	writer.AddRows(input.RowCount());
+	for(size_t row=0; row!=input.RowCount(); ++row)
+	{
+		const double* times = input.Times(row);
+		const double* uvw = input.UVW(row);
+		const uint32_t* antennas = input.Antennas(row);
+		input.Flags(row, flags.get());
+		writer.WriteRow(times[0], times[1], antennas[0], antennas[1], uvw[0], uvw[1], uvw[2], times[2],
+			input.Data(row), flags.get(), input.Weights(row));
+	}
+	std::cout << "Done. Run 'fixmwams " << outputFilename << " <metafitsfile>' to add the MWA fields.\n";
+
+	return 0;
+}
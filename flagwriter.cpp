@@ -21,7 +21,9 @@ FlagWriter::FlagWriter(const std::string &filename, int gpsTime, size_t timestep
 	_sbStart(sbStart),
 	_sbEnd(sbEnd),
 	_gpsTime(gpsTime),
-	_files(sbEnd - sbStart),
+	_isOpen(false),
+	_isResuming(false),
+	_files(sbEnd - sbStart, nullptr),
 	_subbandToGPUBoxFileIndex(subbandToGPUBoxFileIndex)
 {
 	if(_sbEnd - _sbStart == 0)
@@ -36,17 +38,7 @@ FlagWriter::FlagWriter(const std::string &filename, int gpsTime, size_t timestep
 		size_t gpuBoxIndex = _subbandToGPUBoxFileIndex[i] + 1;
 		name[numberPos] = (char) ('0' + (gpuBoxIndex/10));
 		name[numberPos+1] = (char) ('0' + (gpuBoxIndex%10));
-		
-		// If the file already exists, remove it
-		FILE *fp = std::fopen(name.c_str(), "r");
-		if (fp != NULL) {
-			std::fclose(fp);
-			std::remove(name.c_str());
-		}
-  
-		int status = 0;
-		if(fits_create_file(&_files[i-_sbStart], name.c_str(), &status))
-			throwError(status, "Cannot open flag file " + name + " for writing.");
+		_filenames.push_back(name);
 	}
 }
 
@@ -55,7 +47,62 @@ FlagWriter::~FlagWriter()
 	for(std::vector<fitsfile*>::iterator i=_files.begin(); i!=_files.end(); ++i)
 	{
 		int status = 0;
-		fits_close_file(*i, &status);
+		if(*i != nullptr)
+			fits_close_file(*i, &status);
+	}
+}
+
+void FlagWriter::SetResume(size_t rowCount)
+{
+	if(_isOpen)
+		throw std::runtime_error("SetResume() called after rows were added to flagwriter");
+	_isResuming = true;
+	_rowsAdded = rowCount;
+	_rowsWritten = rowCount;
+}
+
+void FlagWriter::openFiles()
+{
+	_isOpen = true;
+	for(size_t i=0; i!=_filenames.size(); ++i)
+	{
+		const std::string& name = _filenames[i];
+		int status = 0;
+		if(_isResuming)
+		{
+			// The header was written by the interrupted run; rows are written in its table
+			int hduType = 0;
+			if(fits_open_file(&_files[i], name.c_str(), READWRITE, &status))
+				throwError(status, "Cannot open flag file " + name + " to resume writing it.");
+			fits_movabs_hdu(_files[i], 2, &hduType, &status);
+			checkStatus(status);
+		}
+		else {
+			// If the file already exists, remove it
+			FILE *fp = std::fopen(name.c_str(), "r");
+			if (fp != NULL) {
+				std::fclose(fp);
+				std::remove(name.c_str());
+			}
+			
+			if(fits_create_file(&_files[i], name.c_str(), &status))
+				throwError(status, "Cannot open flag file " + name + " for writing.");
+		}
+	}
+	if(!_isResuming)
+		writeHeader();
+}
+
+void FlagWriter::Flush()
+{
+	for(fitsfile* file : _files)
+	{
+		int status = 0;
+		if(file != nullptr)
+		{
+			fits_flush_file(file, &status);
+			checkStatus(status);
+		}
 	}
 }
 
@@ -114,7 +161,7 @@ void FlagWriter::setStride()
 
 void FlagWriter::SetOffsetsPerGPUBox(const std::vector<int>& offsets)
 {
-	if(_rowsAdded != 0)
+	if(_isOpen)
 		throw std::runtime_error("SetOffsetsPerGPUBox() called after rows were added to flagwriter");
 	_hduOffsets = offsets;
 }
@@ -16,6 +16,12 @@ class FlagWriter : public Writer, private FitsUser
 		
 		~FlagWriter();
 		
+		/**
+		 * Open the existing flag files and continue writing them after row @p rowCount,
+		 * instead of creating new files. Used to resume an interrupted run.
+		 */
+		void SetResume(size_t rowCount);
+		
 		void WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow) override final
 		{
 			_channelCount = channels.size();
@@ -48,8 +54,8 @@ class FlagWriter : public Writer, private FitsUser
 		
 		void AddRows(size_t rowCount)
 		{
-			if(_rowsAdded == 0)
-				writeHeader();
+			if(!_isOpen)
+				openFiles();
 			_rowsAdded += rowCount;
 		}
 		
@@ -67,8 +73,12 @@ class FlagWriter : public Writer, private FitsUser
 			return true;
 		}
 		
+		/** Write the rows to disk, so that they are complete when a checkpoint is written. */
+		void Flush() override final;
+		
 		virtual void SetOffsetsPerGPUBox(const std::vector<int>& offsets);
 	private:
+		void openFiles();
 		void writeHeader();
 		void writeRow(size_t antenna1, size_t antenna2, const bool* flags);
 		void setStride();
@@ -92,6 +102,8 @@ class FlagWriter : public Writer, private FitsUser
 		//size_t _rowStride;
 		size_t _rowsAdded, _rowsWritten, _sbStart, _sbEnd;
 		int _gpsTime;
+		bool _isOpen, _isResuming;
+		std::vector<std::string> _filenames;
 		std::vector<fitsfile*> _files;
 		
 		const static uint16_t VERSION_MINOR, VERSION_MAJOR;
@@ -66,11 +66,30 @@ class ForwardingWriter : public Writer
 			_writer->WriteRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights);
 		}
 		
+		virtual size_t AddSpectralWindow(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth) override
+		{
+			return _writer->AddSpectralWindow(name, channels, refFreq, totalBandwidth);
+		}
+		
+		virtual void WriteWindowRow(size_t window, double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) override
+		{
+			// Rows of the band go through WriteRow(), so that derived writers that only override WriteRow() see them
+			if(window == 0)
+				WriteRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights);
+			else
+				_writer->WriteWindowRow(window, time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights);
+		}
+		
 		virtual void WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params) override
 		{
 			_writer->WriteHistoryItem(commandLine, application, params);
 		}
 		
+		virtual void Flush() override
+		{
+			_writer->Flush();
+		}
+		
 		virtual bool IsTimeAligned(size_t antenna1, size_t antenna2) override {
 			return _writer->IsTimeAligned(antenna1, antenna2);
 		}
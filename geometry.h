@@ -243,7 +243,27 @@ public:
 		Y = (EARTH_RAD_WGS84/chi + height_meters)*c_lat*s_lon;
 		Z = (EARTH_RAD_WGS84*(1.0-E_SQUARED)/chi + height_meters)*s_lat;
 	}
-	
+
+	/**
+		* Convert XYZ coords to Geodetic lat/lon/height, the inverse of Geodetic2XYZ().
+		* Uses Bowring's method, which is accurate to well below a mm near the surface.
+		*/
+	static void XYZ2Geodetic(double X, double Y, double Z, double &lat_rad, double &lon_rad, double &height_meters) {
+		const double
+			b = EARTH_RAD_WGS84*sqrt(1.0 - E_SQUARED),
+			ePrimeSquared = E_SQUARED / (1.0 - E_SQUARED),
+			p = sqrt(X*X + Y*Y),
+			theta = atan2(Z*EARTH_RAD_WGS84, p*b),
+			s_theta = sin(theta), c_theta = cos(theta);
+
+		lon_rad = atan2(Y, X);
+		lat_rad = atan2(Z + ePrimeSquared*b*s_theta*s_theta*s_theta,
+			p - E_SQUARED*EARTH_RAD_WGS84*c_theta*c_theta*c_theta);
+		const double s_lat = sin(lat_rad);
+		const double n = EARTH_RAD_WGS84 / sqrt(1.0 - E_SQUARED*s_lat*s_lat);
+		height_meters = p / cos(lat_rad) - n;
+	}
+
 	
 };
 
@@ -0,0 +1,122 @@
+#include <fitsio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+	void checkStatus(int status, const std::string& filename)
+	{
+		if(status != 0)
+		{
+			char statusText[FLEN_STATUS];
+			fits_get_errstatus(status, statusText);
+			throw std::runtime_error("cfitsio error for " + filename + ": " + statusText);
+		}
+	}
+
+	struct AppendedFile
+	{
+		std::string inputName, outputName;
+		fitsfile *input, *output;
+		int hduCount;
+	};
+
+	/**
+	 * Copies the primary HDU of every input to its output file, and then appends the next
+	 * HDU of every file every interval seconds, as the correlator does while it observes.
+	 * Every HDU is flushed to disk before the next one is written. When hduLimit is not
+	 * zero, at most that many HDUs are appended, as if the observation ended early.
+	 */
+	void append(const std::vector<std::string>& inputs, const std::string& outputDir, double interval, int hduLimit)
+	{
+		std::vector<AppendedFile> files(inputs.size());
+		int maxHDUCount = 0;
+		for(size_t i=0; i!=inputs.size(); ++i)
+		{
+			AppendedFile& file = files[i];
+			file.inputName = inputs[i];
+			const size_t slash = file.inputName.rfind('/');
+			file.outputName = outputDir + "/" + (slash == std::string::npos ? file.inputName : file.inputName.substr(slash + 1));
+			int status = 0;
+			fits_open_file(&file.input, file.inputName.c_str(), READONLY, &status);
+			checkStatus(status, file.inputName);
+			fits_get_num_hdus(file.input, &file.hduCount, &status);
+			checkStatus(status, file.inputName);
+			// The leading '!' makes cfitsio replace an existing file
+			fits_create_file(&file.output, ("!" + file.outputName).c_str(), &status);
+			checkStatus(status, file.outputName);
+			fits_copy_hdu(file.input, file.output, 0, &status);
+			fits_flush_file(file.output, &status);
+			checkStatus(status, file.outputName);
+			maxHDUCount = std::max(maxHDUCount, file.hduCount);
+		}
+		const int lastHDU = hduLimit == 0 ? maxHDUCount : std::min(maxHDUCount, hduLimit + 1);
+		// Flushed, so that a test script that waits for this line can start following the files
+		std::cout << "Appending " << (lastHDU-1) << " HDUs to " << files.size() << " files in " << outputDir << ", one per " << interval << " s." << std::endl;
+
+		auto nextTime = std::chrono::steady_clock::now();
+		for(int hdu=2; hdu<=lastHDU; ++hdu)
+		{
+			nextTime += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval));
+			std::this_thread::sleep_until(nextTime);
+			for(AppendedFile& file : files)
+			{
+				if(hdu > file.hduCount)
+					continue;
+				int status = 0, hduType = 0;
+				fits_movabs_hdu(file.input, hdu, &hduType, &status);
+				checkStatus(status, file.inputName);
+				fits_copy_hdu(file.input, file.output, 0, &status);
+				fits_flush_file(file.output, &status);
+				checkStatus(status, file.outputName);
+			}
+			std::cout << '.' << std::flush;
+		}
+		std::cout << '\n';
+		for(AppendedFile& file : files)
+		{
+			int status = 0;
+			fits_close_file(file.output, &status);
+			fits_close_file(file.input, &status);
+			checkStatus(status, file.outputName);
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int argi = 1, hduLimit = 0;
+	if(argc > 2 && std::string(argv[1]) == "-stop")
+	{
+		hduLimit = atoi(argv[2]);
+		argi = 3;
+	}
+	if(argc - argi < 3)
+	{
+		std::cout <<
+			"gpuboxappender replays gpubox files as the correlator writes them, to test the follow mode\n"
+			"of Cotter. It copies the primary header of every file into the output directory, and then\n"
+			"appends the next HDU (integration) of every file once per interval.\n\n"
+			"Syntax: gpuboxappender [-stop <n>] <interval in s> <output directory> <gpubox files...>\n"
+			"   e.g. 'gpuboxappender 0.5 live/ obs/*gpubox*.fits' and, at the same time,\n"
+			"        'cotter -follow 30 -m obs/obs.metafits -o obs.ms live/*gpubox*.fits'.\n"
+			"With -stop, only the first n HDUs of every file are appended, as if the observation ended early.\n";
+		return -1;
+	}
+	try {
+		const double interval = atof(argv[argi]);
+		const std::string outputDir = argv[argi+1];
+		std::vector<std::string> inputs(argv + argi + 2, argv + argc);
+		append(inputs, outputDir, interval, hduLimit);
+	} catch(std::exception& e) {
+		std::cerr << e.what() << '\n';
+		return 1;
+	}
+	return 0;
+}
@@ -1,74 +1,122 @@
 #include "gpufilereader.h"
+#include "compactimageset.h"
 #include "progressbar.h"
 
+#include <algorithm>
+#include <chrono>
 #include <complex>
+#include <exception>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <thread>
 
+#include <cerrno>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 void GPUFileReader::openFiles()
 {
 	int status = 0;
 	bool hasWarnedAboutDifferentTimes = false;
 	_hasStartTime = false;
 	std::vector<long> startTimePerFile(_filenames.size());
+	// The index of a file that is still being written would be outdated immediately
+	if(_useHDUIndex && !_follow)
+		_hduIndices = HDUIndex::GetAll(_filenames, _hduIndexDirectory, _threadCount);
+	const size_t firstHDU = _offlineFormat ? 1 : 2;
 	for(size_t i=0; i!=_filenames.size(); ++i)
 	{
 		const std::string &curFilename = _filenames[i];
-		fitsfile *fptr = 0;
 		if(curFilename.empty())
 		{
 			std::cout << "(Skipping unavailable file)\n";
 			_fitsFiles.push_back(0);
+			_rawFiles.push_back(-1);
 			_fitsHDUCounts.push_back(0);
+			_fileSizes.push_back(0);
+			continue;
+		}
+		
+		int hduCount;
+		long thisFileTime;
+		if(!_hduIndices.empty() && _hduIndices[i].IsRawFloat(firstHDU))
+		{
+			// All headers are in the index, so the file can be read without cfitsio
+			int fd = open(curFilename.c_str(), O_RDONLY);
+			if(fd < 0)
+				throw std::runtime_error(std::string("Cannot open file ") + curFilename);
+			_fitsFiles.push_back(0);
+			_rawFiles.push_back(fd);
+			_fileSizes.push_back(0);
+			hduCount = _hduIndices[i].HDUCount();
+			thisFileTime = _hduIndices[i].Time();
 		}
-		else if(!fits_open_file(&fptr, curFilename.c_str(), READONLY, &status))
+		else if(_follow)
 		{
+			fitsfile *fptr = openFollowedFile(curFilename);
 			_fitsFiles.push_back(fptr);
+			_rawFiles.push_back(-1);
 			
-			int hduCount;
-			fits_get_num_hdus(fptr, &hduCount, &status);
+			struct stat fileStatus;
+			if(stat(curFilename.c_str(), &fileStatus) != 0)
+				throw std::runtime_error(std::string("Cannot open file ") + curFilename);
+			_fileSizes.push_back(fileStatus.st_size);
+			hduCount = countCompleteHDUs(fptr, fileStatus.st_size);
+			
+			fits_movabs_hdu(fptr, 1, 0, &status);
+			fits_read_key(fptr, TLONG, "TIME", &thisFileTime, 0, &status);
 			checkStatus(status);
+		}
+		else {
+			fitsfile *fptr = 0;
+			if(fits_open_file(&fptr, curFilename.c_str(), READONLY, &status))
+				throwError(status, std::string("Cannot open file ") + curFilename);
+			_fitsFiles.push_back(fptr);
+			_rawFiles.push_back(-1);
+			_fileSizes.push_back(0);
 			
-			_fitsHDUCounts.push_back(hduCount);
-			std::cout << "There are " << hduCount << " HDUs in file " << _filenames[i];
-			if(_offlineFormat)
-				std::cout << " (offline format: all are used!)";
-			std::cout << '\n';
+			fits_get_num_hdus(fptr, &hduCount, &status);
+			checkStatus(status);
 			
-			long thisFileTime;
 			fits_read_key(fptr, TLONG, "TIME", &thisFileTime, 0, &status);
 			checkStatus(status);
-			
-			if(!_hasStartTime) 
+		}
+		
+		_fitsHDUCounts.push_back(hduCount);
+		std::cout << "There are " << hduCount << " HDUs in file " << _filenames[i];
+		if(_follow)
+			std::cout << " (following)";
+		if(_offlineFormat)
+			std::cout << " (offline format: all are used!)";
+		std::cout << '\n';
+		
+		if(!_hasStartTime) 
+		{
+			_startTime = thisFileTime;
+			_hasStartTime = true;
+		}
+		startTimePerFile[i] = thisFileTime;
+		if(_startTime != thisFileTime)
+		{
+			if(!hasWarnedAboutDifferentTimes || thisFileTime > _startTime)
 			{
-				_startTime = thisFileTime;
-				_hasStartTime = true;
+				std::cout << "WARNING: file number " << (i+1) << " of current time range has different start time!\n"
+					"Current file start time: " << thisFileTime << " previous file had: " << _startTime << ".\n";
 			}
-			startTimePerFile[i] = thisFileTime;
-			if(_startTime != thisFileTime)
+			if(thisFileTime > _startTime)
 			{
-				if(!hasWarnedAboutDifferentTimes || thisFileTime > _startTime)
-				{
-					std::cout << "WARNING: file number " << (i+1) << " of current time range has different start time!\n"
-						"Current file start time: " << thisFileTime << " previous file had: " << _startTime << ".\n";
-				}
-				if(thisFileTime > _startTime)
-				{
-					_startTime = thisFileTime;
-					if(_doAlign)
-						std::cout << "Using start time of " << _startTime << " and aligning other files accordingly.\n";
-					else
-						std::cout << "Using start time of " << _startTime << " and NOT aligning files accordingly as requested:\n"
-							"output will likely be mis-aligned!\n";
-				}
-				hasWarnedAboutDifferentTimes = true;
+				_startTime = thisFileTime;
+				if(_doAlign)
+					std::cout << "Using start time of " << _startTime << " and aligning other files accordingly.\n";
+				else
+					std::cout << "Using start time of " << _startTime << " and NOT aligning files accordingly as requested:\n"
+						"output will likely be mis-aligned!\n";
 			}
-		}
-		else {
-			throwError(status, std::string("Cannot open file ") + _filenames[i]);
-			exit(1);
+			hasWarnedAboutDifferentTimes = true;
 		}
 	}
 	_isOpen = true;
@@ -105,13 +153,346 @@ void GPUFileReader::closeFiles()
 		}
 	}
 	_fitsFiles.clear();
+	for(int fd : _rawFiles)
+	{
+		if(fd != -1)
+			close(fd);
+	}
+	_rawFiles.clear();
+	_hduIndices.clear();
+	_fileSizes.clear();
+	_readahead.reset();
 	_isOpen = false;
 }
 
+void GPUFileReader::Open()
+{
+	if(!_isOpen)
+	{
+		openFiles();
+		
+		_currentHDU = _offlineFormat ? 1 : 2; // header to start reading
+		findStopHDU();
+		
+		if(_readaheadHDUs != 0)
+		{
+			_readahead.reset(new Readahead(_readaheadHDUs, std::min(_threadCount, _filenames.size())));
+			for(const std::string& filename : _filenames)
+				_readahead->AddFile(filename);
+		}
+		
+		// Check whether the files are tile compressed, and start reading ahead the first HDUs
+		bool isCompressed = false;
+		for(size_t iFile = 0; iFile != _filenames.size(); ++iFile)
+		{
+			if(_rawFiles[iFile] != -1)
+			{
+				if(_readahead && _currentHDU <= _fitsHDUCounts[iFile])
+					advanceReadahead(iFile, _currentHDU);
+			}
+			else if(_fitsFiles[iFile] != 0 && _currentHDU <= _fitsHDUCounts[iFile])
+			{
+				int status = 0, hduType = 0;
+				fits_movabs_hdu(_fitsFiles[iFile], _currentHDU, &hduType, &status);
+				checkStatus(status);
+				if(fits_is_compressed_image(_fitsFiles[iFile], &status))
+					isCompressed = true;
+				checkStatus(status);
+				if(_readahead)
+					advanceReadahead(iFile, _currentHDU);
+			}
+		}
+		// Different files use different cfitsio handles, so they can be decompressed
+		// concurrently, provided that cfitsio was built thread safe.
+		_readFilesInParallel = isCompressed && fits_is_reentrant() && _threadCount > 1;
+		if(isCompressed)
+		{
+			if(_readFilesInParallel)
+				std::cout << "GPU files are tile compressed: decompressing files in parallel.\n";
+			else
+				std::cout << "GPU files are tile compressed, but cfitsio is not thread safe: decompressing serially.\n";
+		}
+	}
+}
+
+void GPUFileReader::readFile(size_t iFile, size_t bufferPos, size_t bufferLength, size_t& endingBufferPos, bool& moreAvailable, ProgressBar& progressBar, std::mutex& mutex)
+{
+	const size_t nPol = 4;
+	const size_t nBaselines = (_nAntenna + 1) * _nAntenna / 2;
+	if(!_filenames[iFile].empty())
+	{
+		size_t fileHDU, fileBufferPos;
+		fileStartPosition(iFile, bufferPos, fileHDU, fileBufferPos);
+		size_t fileStopHDU = _fitsHDUCounts[iFile];
+		size_t hdusAvailable = fileStopHDU - fileHDU + 1;
+
+		while (fileHDU <= fileStopHDU && fileBufferPos < bufferLength)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				progressBar.SetProgress(fileHDU + iFile*fileStopHDU, fileStopHDU*_filenames.size());
+			}
+
+			const bool isRaw = _rawFiles[iFile] != -1;
+			fitsfile *fptr = _fitsFiles[iFile];
+			int status = 0;
+			size_t channelsInFile, baselTimesPolInFile;
+			if(isRaw)
+			{
+				const HDUIndex::HDU& hdu = _hduIndices[iFile].GetHDU(fileHDU);
+				if(_readahead)
+					advanceReadahead(iFile, fileHDU);
+				channelsInFile = hdu.height;
+				baselTimesPolInFile = hdu.width;
+			}
+			else {
+				int hduType = 0;
+				fits_movabs_hdu(fptr, fileHDU, &hduType, &status);
+				checkStatus(status);
+				if(_readahead)
+					advanceReadahead(iFile, fileHDU);
+				if (hduType == BINARY_TBL) {
+					throw std::runtime_error("GPU file seems not to contain image headers; format not understood.");
+				}
+				long naxes[2];
+				fits_get_img_size(fptr, 2, naxes, &status);
+				checkStatus(status);
+
+				channelsInFile = naxes[1];
+				baselTimesPolInFile = naxes[0];
+			}
+
+			if(_nChannelsInTotal != (channelsInFile*_filenames.size())) {
+				std::stringstream s;
+				s << "Number of GPU files (" << _filenames.size() << ") in time range x row count of image chunk in file (" << channelsInFile << ") != "
+				<< "total channels count (" << _nChannelsInTotal << "): are the FITS files the dimension you expected them to be?";
+				throw std::runtime_error(s.str());
+			}
+			// Test the first axis; note that we assert the number of floats, not complex, hence the factor of two.
+			if(baselTimesPolInFile != nBaselines * nPol * 2) {
+				std::stringstream s;
+				s << "Unexpected number of visibilities in axis of GPU file. Expected=" << (nBaselines*nPol*2) << ", actual=" << baselTimesPolInFile;
+				throw std::runtime_error(s.str());
+			}
+
+			std::complex<float> *matrixPtr = 0;
+			_availableGPUMatrixBuffers.read(matrixPtr);
+			if(isRaw)
+				readRawImage(iFile, fileHDU, (float *) matrixPtr, channelsInFile * baselTimesPolInFile);
+			else {
+				long fpixel = 1;
+				float nullval = 0;
+				int anynull = 0x0;
+				fits_read_img(fptr, TFLOAT, fpixel, channelsInFile * baselTimesPolInFile, &nullval, (float *) matrixPtr, &anynull, &status);
+				checkStatus(status);
+			}
+
+			ShuffleTask shuffleTask;
+			shuffleTask.iFile = iFile;
+			shuffleTask.channelsInFile = channelsInFile;
+			shuffleTask.fileBufferPos = fileBufferPos;
+			shuffleTask.gpuMatrix = matrixPtr;
+			_shuffleTasks.write(shuffleTask);
+			++fileHDU;
+			++fileBufferPos;
+		}
+		
+		std::lock_guard<std::mutex> lock(mutex);
+		if(endingBufferPos > bufferPos + hdusAvailable) endingBufferPos = bufferPos + hdusAvailable;
+		if(fileHDU <= fileStopHDU)
+			moreAvailable = true;
+	}
+}
+
+void GPUFileReader::advanceReadahead(size_t iFile, size_t hduNumber)
+{
+	if(_rawFiles[iFile] != -1)
+	{
+		const HDUIndex::HDU& hdu = _hduIndices[iFile].GetHDU(hduNumber);
+		_readahead->Advance(iFile, hdu.headerStart, hdu.dataEnd);
+	}
+	else {
+		// cfitsio has already moved to the HDU
+		LONGLONG headStart, dataStart, dataEnd;
+		int status = 0;
+		fits_get_hduaddrll(_fitsFiles[iFile], &headStart, &dataStart, &dataEnd, &status);
+		checkStatus(status);
+		_readahead->Advance(iFile, headStart, dataEnd);
+	}
+}
+
+void GPUFileReader::fileStartPosition(size_t iFile, size_t bufferPos, size_t& fileHDU, size_t& fileBufferPos) const
+{
+	fileBufferPos = bufferPos;
+	fileHDU = _currentHDU;
+	if(_doAlign)
+	{
+		// These statements will align a file with the times given in the individual gpubox fits files.
+		if(_hduOffsetsPerFile[iFile] <= (int) bufferPos)
+			fileBufferPos = bufferPos - _hduOffsetsPerFile[iFile];
+		else {
+			fileHDU += _hduOffsetsPerFile[iFile] - bufferPos;
+			fileBufferPos = bufferPos;
+		}
+	}
+}
+
+fitsfile *GPUFileReader::openFollowedFile(const std::string& filename)
+{
+	// The correlator might not have created the file or written its primary header yet
+	const std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+	bool hasReported = false;
+	while(true)
+	{
+		int status = 0;
+		fitsfile *fptr = 0;
+		if(!fits_open_file(&fptr, filename.c_str(), READONLY, &status))
+		{
+			long time;
+			fits_read_key(fptr, TLONG, "TIME", &time, 0, &status);
+			if(status == 0)
+				return fptr;
+			status = 0;
+			fits_close_file(fptr, &status);
+		}
+		const double waited = std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+		if(waited > _followTimeout)
+			throw std::runtime_error("File " + filename + " did not become available within the follow timeout");
+		if(!hasReported)
+		{
+			std::cout << "Waiting for file " << filename << " to appear...\n";
+			hasReported = true;
+		}
+		std::this_thread::sleep_for(std::chrono::duration<double>(_followPollInterval));
+	}
+}
+
+size_t GPUFileReader::countCompleteHDUs(fitsfile *fptr, long long fileSize)
+{
+	// Walk the headers until one is missing or incomplete, and only count HDUs
+	// of which the data have been written completely.
+	size_t count = 0;
+	int status = 0;
+	for(size_t hdu = 1; ; ++hdu)
+	{
+		int hduType = 0;
+		if(fits_movabs_hdu(fptr, hdu, &hduType, &status))
+			break;
+		LONGLONG headStart, dataStart, dataEnd;
+		if(fits_get_hduaddrll(fptr, &headStart, &dataStart, &dataEnd, &status) || dataEnd > fileSize)
+			break;
+		count = hdu;
+	}
+	return count;
+}
+
+bool GPUFileReader::updateFollowedFiles(const std::vector<size_t>& requiredHDUCounts)
+{
+	bool hasGrown = false;
+	for(size_t iFile = 0; iFile != _filenames.size(); ++iFile)
+	{
+		if(_fitsFiles[iFile] == 0 || _fitsHDUCounts[iFile] >= requiredHDUCounts[iFile])
+			continue;
+		struct stat fileStatus;
+		if(stat(_filenames[iFile].c_str(), &fileStatus) != 0 || fileStatus.st_size <= _fileSizes[iFile])
+			continue;
+		hasGrown = true;
+		_fileSizes[iFile] = fileStatus.st_size;
+		// cfitsio caches the file size when opening, so reopen the file to see the new HDUs
+		int status = 0;
+		fits_close_file(_fitsFiles[iFile], &status);
+		_fitsFiles[iFile] = 0;
+		if(fits_open_file(&_fitsFiles[iFile], _filenames[iFile].c_str(), READONLY, &status))
+			throwError(status, std::string("Cannot reopen file ") + _filenames[iFile]);
+		_fitsHDUCounts[iFile] = std::max(_fitsHDUCounts[iFile], countCompleteHDUs(_fitsFiles[iFile], fileStatus.st_size));
+	}
+	return hasGrown;
+}
+
+void GPUFileReader::waitForHDUs(size_t bufferPos, size_t bufferLength)
+{
+	std::vector<size_t> requiredHDUCounts(_filenames.size(), 0);
+	for(size_t iFile = 0; iFile != _filenames.size(); ++iFile)
+	{
+		size_t fileHDU, fileBufferPos;
+		fileStartPosition(iFile, bufferPos, fileHDU, fileBufferPos);
+		if(!_filenames[iFile].empty() && fileBufferPos < bufferLength)
+			requiredHDUCounts[iFile] = fileHDU + (bufferLength - fileBufferPos) - 1;
+	}
+	
+	std::chrono::steady_clock::time_point lastGrowth = std::chrono::steady_clock::now();
+	bool hasReported = false;
+	while(!_followEnded)
+	{
+		bool isComplete = true;
+		for(size_t iFile = 0; iFile != _filenames.size(); ++iFile)
+		{
+			if(_fitsHDUCounts[iFile] < requiredHDUCounts[iFile])
+				isComplete = false;
+		}
+		if(isComplete)
+			break;
+		
+		const double stalled = std::chrono::duration<double>(std::chrono::steady_clock::now() - lastGrowth).count();
+		if(stalled > _followTimeout)
+		{
+			std::cout << "Files have not grown for " << _followTimeout << " s: assuming the observation has ended.\n";
+			_followEnded = true;
+		}
+		else {
+			if(!hasReported)
+			{
+				std::cout << "Waiting for the correlator to write more data...\n";
+				hasReported = true;
+			}
+			std::this_thread::sleep_for(std::chrono::duration<double>(_followPollInterval));
+			if(updateFollowedFiles(requiredHDUCounts))
+				lastGrowth = std::chrono::steady_clock::now();
+		}
+	}
+	findStopHDU();
+}
+
+void GPUFileReader::readRawImage(size_t iFile, size_t hduNumber, float *destination, size_t count)
+{
+	char *dataPtr = reinterpret_cast<char*>(destination);
+	size_t remaining = count * sizeof(float);
+	off_t offset = _hduIndices[iFile].GetHDU(hduNumber).dataStart;
+	while(remaining != 0)
+	{
+		ssize_t n = pread(_rawFiles[iFile], dataPtr, remaining, offset);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			throw std::runtime_error("Error reading from file " + _filenames[iFile]);
+		dataPtr += n;
+		offset += n;
+		remaining -= n;
+	}
+	// FITS data are big endian
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint32_t *values = reinterpret_cast<uint32_t*>(destination);
+	for(size_t i=0; i!=count; ++i)
+		values[i] = __builtin_bswap32(values[i]);
+#endif
+}
+
 bool GPUFileReader::Read(size_t &bufferPos, size_t bufferLength) {
+	// Once the files have been read to the end, don't open them again
+	if(_isFinished)
+		return false;
+	
+	Open();
+	if(_follow)
+		waitForHDUs(bufferPos, bufferLength);
+	
 	// If we are already past the end of the files, stop immediately
 	if(_currentHDU > _stopHDU)
+	{
+		closeFiles();
+		_isFinished = true;
 		return false;
+	}
 	
 	const size_t nPol = 4;
 	const size_t nBaselines = (_nAntenna + 1) * _nAntenna / 2;
@@ -128,98 +509,54 @@ bool GPUFileReader::Read(size_t &bufferPos, size_t bufferLength) {
 		threadGroup.emplace_back(&GPUFileReader::shuffleThreadFunc, this);
 	}
 
-	if(!_isOpen)
-	{
-		openFiles();
-		
-		_currentHDU = _offlineFormat ? 1 : 2; // header to start reading
-		findStopHDU();
-	}
-	
 	initMapping();
 
 	ProgressBar progressBar("Reading GPU files");
 	
 	size_t endingBufferPos = bufferLength;
 	bool moreAvailable = false;
-	for (size_t iFile = 0; iFile != _filenames.size(); ++iFile) {
-		if(!_filenames[iFile].empty())
+	if(_readFilesInParallel)
+	{
+		std::mutex mutex;
+		size_t nextFile = 0;
+		std::exception_ptr firstError;
+		auto readThreadFunc = [&]()
 		{
-			size_t
-				fileBufferPos = bufferPos,
-				fileHDU = _currentHDU;
-			
-			if(_doAlign)
+			std::unique_lock<std::mutex> lock(mutex);
+			while(nextFile != _filenames.size() && !firstError)
 			{
-				// These statements will align a file with the times given in the individual gpubox fits files.
-				if(_hduOffsetsPerFile[iFile] <= (int) bufferPos)
-					fileBufferPos = bufferPos - _hduOffsetsPerFile[iFile];
-				else {
-					fileHDU += _hduOffsetsPerFile[iFile] - bufferPos;
-					fileBufferPos = bufferPos;
+				const size_t iFile = nextFile;
+				++nextFile;
+				lock.unlock();
+				try {
+					readFile(iFile, bufferPos, bufferLength, endingBufferPos, moreAvailable, progressBar, mutex);
+				} catch(...) {
+					lock.lock();
+					if(!firstError)
+						firstError = std::current_exception();
+					lock.unlock();
 				}
+				lock.lock();
 			}
-			size_t fileStopHDU = _fitsHDUCounts[iFile];
-			size_t hdusAvailable = fileStopHDU - fileHDU + 1;
-			if(endingBufferPos > bufferPos + hdusAvailable) endingBufferPos = bufferPos + hdusAvailable;
-			
-			while (fileHDU <= fileStopHDU && fileBufferPos < bufferLength)
-			{
-				progressBar.SetProgress(fileHDU + iFile*fileStopHDU, fileStopHDU*_filenames.size());
-
-				fitsfile *fptr = _fitsFiles[iFile];
-
-				int status = 0, hduType = 0;
-				fits_movabs_hdu(fptr, fileHDU, &hduType, &status);
-				checkStatus(status);
-				if (hduType == BINARY_TBL) {
-					throw std::runtime_error("GPU file seems not to contain image headers; format not understood.");
-				}
-				else {
-
-					long fpixel = 1;
-					float nullval = 0;
-					int anynull = 0x0;
-					long naxes[2];
-
-					fits_get_img_size(fptr, 2, naxes, &status);
-					checkStatus(status);
-
-					size_t channelsInFile = naxes[1];
-					size_t baselTimesPolInFile = naxes[0];
-
-					if(_nChannelsInTotal != (channelsInFile*_filenames.size())) {
-						std::stringstream s;
-						s << "Number of GPU files (" << _filenames.size() << ") in time range x row count of image chunk in file (" << channelsInFile << ") != "
-						<< "total channels count (" << _nChannelsInTotal << "): are the FITS files the dimension you expected them to be?";
-						throw std::runtime_error(s.str());
-					}
-					// Test the first axis; note that we assert the number of floats, not complex, hence the factor of two.
-					if(baselTimesPolInFile != nBaselines * nPol * 2) {
-						std::stringstream s;
-						s << "Unexpected number of visibilities in axis of GPU file. Expected=" << (nBaselines*nPol*2) << ", actual=" << baselTimesPolInFile;
-						throw std::runtime_error(s.str());
-					}
-
-					std::complex<float> *matrixPtr = 0;
-					_availableGPUMatrixBuffers.read(matrixPtr);
-					fits_read_img(fptr, TFLOAT, fpixel, channelsInFile * baselTimesPolInFile, &nullval, (float *) matrixPtr, &anynull, &status);
-					checkStatus(status);
-					
-					ShuffleTask shuffleTask;
-					shuffleTask.iFile = iFile;
-					shuffleTask.channelsInFile = channelsInFile;
-					shuffleTask.fileBufferPos = fileBufferPos;
-					shuffleTask.gpuMatrix = matrixPtr;
-					_shuffleTasks.write(shuffleTask);
-				}
-				++fileHDU;
-				++fileBufferPos;
-			}
-			if(fileHDU <= fileStopHDU)
-				moreAvailable = true;
+		};
+		std::vector<std::thread> readThreads;
+		for(size_t i=0; i!=std::min(_threadCount, _filenames.size()); ++i)
+			readThreads.emplace_back(readThreadFunc);
+		for(std::thread& t : readThreads)
+			t.join();
+		if(firstError)
+		{
+			_shuffleTasks.write_end();
+			for(std::thread& t : threadGroup)
+				t.join();
+			std::rethrow_exception(firstError);
 		}
 	}
+	else {
+		std::mutex mutex;
+		for (size_t iFile = 0; iFile != _filenames.size(); ++iFile)
+			readFile(iFile, bufferPos, bufferLength, endingBufferPos, moreAvailable, progressBar, mutex);
+	}
 	
 	_shuffleTasks.write_end();
 	for(std::thread& t : threadGroup)
@@ -228,8 +565,62 @@ bool GPUFileReader::Read(size_t &bufferPos, size_t bufferLength) {
 	_currentHDU += endingBufferPos - bufferPos;
 	bufferPos = endingBufferPos;
 	
+	// When following, the next HDUs might just not have been written yet
+	if(_follow && !_followEnded && bufferPos == bufferLength)
+		moreAvailable = true;
+	
+	if(!moreAvailable)
+	{
+		closeFiles();
+		_isFinished = true;
+	}
+	return moreAvailable;
+}
+
+bool GPUFileReader::Skip(size_t &bufferPos, size_t bufferLength) {
+	if(_isFinished)
+		return false;
+	
+	Open();
+	if(_follow)
+		waitForHDUs(bufferPos, bufferLength);
+	
+	if(_currentHDU > _stopHDU)
+	{
+		closeFiles();
+		_isFinished = true;
+		return false;
+	}
+	
+	// Advance each file as readFile() would, without reading the HDUs
+	size_t endingBufferPos = bufferLength;
+	bool moreAvailable = false;
+	for(size_t iFile = 0; iFile != _filenames.size(); ++iFile)
+	{
+		if(_filenames[iFile].empty())
+			continue;
+		size_t fileHDU, fileBufferPos;
+		fileStartPosition(iFile, bufferPos, fileHDU, fileBufferPos);
+		const size_t fileStopHDU = _fitsHDUCounts[iFile];
+		const size_t hdusAvailable = fileStopHDU - fileHDU + 1;
+		if(fileHDU <= fileStopHDU && fileBufferPos < bufferLength)
+			fileHDU += std::min(fileStopHDU - fileHDU + 1, bufferLength - fileBufferPos);
+		if(endingBufferPos > bufferPos + hdusAvailable) endingBufferPos = bufferPos + hdusAvailable;
+		if(fileHDU <= fileStopHDU)
+			moreAvailable = true;
+	}
+	
+	_currentHDU += endingBufferPos - bufferPos;
+	bufferPos = endingBufferPos;
+	
+	if(_follow && !_followEnded && bufferPos == bufferLength)
+		moreAvailable = true;
+	
 	if(!moreAvailable)
+	{
 		closeFiles();
+		_isFinished = true;
+	}
 	return moreAvailable;
 }
 
@@ -262,6 +653,22 @@ void GPUFileReader::shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fi
 			// Because possibly antenna2 <= antenna1 in the GPU file, and Casa MS expects it the other way
 			// around, we change the order and take the complex conjugates later.
 			BaselineBuffer &buffer = getMappedBuffer(antenna2, antenna1);
+			if(buffer.IsCompact())
+			{
+				shufflePartialBuffer(buffer.compactReal, buffer.compactImag, channelStart, channelEnd, fileBufferPos, &gpuMatrix[correlationIndex * nPol], nBaselines * nPol,
+					[](float value) { return CompactImageSet::Compress(value); });
+				++correlationIndex;
+				continue;
+			}
+			// Baselines without a destination buffer are not used
+			if(buffer.real[0] == 0 || buffer.real[1] == 0 || buffer.real[2] == 0 || buffer.real[3] == 0)
+			{
+				if(buffer.real[0] != 0 || buffer.real[1] != 0 || buffer.real[2] != 0 || buffer.real[3] != 0)
+					shufflePartialBuffer(buffer.real, buffer.imag, channelStart, channelEnd, fileBufferPos, &gpuMatrix[correlationIndex * nPol], nBaselines * nPol,
+						[](float value) { return value; });
+				++correlationIndex;
+				continue;
+			}
 			size_t destChanIndex = fileBufferPos + channelStart * _bufferSize;
 			for(size_t ch=channelStart; ch!=channelEnd; ++ch)
 			{
@@ -290,6 +697,28 @@ void GPUFileReader::shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fi
 	}
 }
 
+template<typename T, typename Convert>
+void GPUFileReader::shufflePartialBuffer(T* const real[4], T* const imag[4], size_t channelStart, size_t channelEnd, size_t fileBufferPos, const std::complex<float> *gpuData, size_t channelStride, Convert convert)
+{
+	// Polarizations in the order in which the correlator writes them
+	const size_t polarizations[4] = {0, 2, 1, 3};
+	size_t destChanIndex = fileBufferPos + channelStart * _bufferSize;
+	for(size_t ch=channelStart; ch!=channelEnd; ++ch)
+	{
+		for(size_t i=0; i!=4; ++i)
+		{
+			const size_t p = polarizations[i];
+			if(real[p] != 0)
+			{
+				*(real[p] + destChanIndex) = convert(gpuData[i].real());
+				*(imag[p] + destChanIndex) = convert(gpuData[i].imag());
+			}
+		}
+		gpuData += channelStride;
+		destChanIndex += _bufferSize;
+	}
+}
+
 // Check the number of HDUs in each file. Only extract the amount of time
 // that there is actually data for in all files.
 void GPUFileReader::findStopHDU()
@@ -314,7 +743,9 @@ void GPUFileReader::findStopHDU()
 			std::cout << "WARNING: Files had not the same number of HDUs.\n";
 		if(_stopHDU == std::numeric_limits<size_t>::max() || _stopHDU == 0)
 		{
-			std::cout << "ERROR: Stopping HDU equals zero, something is wrong with the input data.\n";
+			// While following, the files might not have any data HDUs yet
+			if(!_follow || _followEnded)
+				std::cout << "ERROR: Stopping HDU equals zero, something is wrong with the input data.\n";
 			_stopHDU = 0;
 		}
 		else {
@@ -356,11 +787,15 @@ void GPUFileReader::initMapping()
 						_isConjugated[conjIndex] = isConjugated;
 						getMappedBuffer(a1, a2).real[p1 * 2 + p2] = getBuffer(actA1, actA2).real[actP1 * 2 + actP2];
 						getMappedBuffer(a1, a2).imag[p1 * 2 + p2] = getBuffer(actA1, actA2).imag[actP1 * 2 + actP2];
+						getMappedBuffer(a1, a2).compactReal[p1 * 2 + p2] = getBuffer(actA1, actA2).compactReal[actP1 * 2 + actP2];
+						getMappedBuffer(a1, a2).compactImag[p1 * 2 + p2] = getBuffer(actA1, actA2).compactImag[actP1 * 2 + actP2];
 					} else {
 						size_t conjIndex = (actA2 * 2 + actP2) * _nAntenna * 2 + (actA1 * 2 + actP1);
 						_isConjugated[conjIndex] = isConjugated;
 						getMappedBuffer(a1, a2).real[p1 * 2 + p2] = getBuffer(actA2, actA1).real[actP2 * 2 + actP1];
 						getMappedBuffer(a1, a2).imag[p1 * 2 + p2] = getBuffer(actA2, actA1).imag[actP2 * 2 + actP1];
+						getMappedBuffer(a1, a2).compactReal[p1 * 2 + p2] = getBuffer(actA2, actA1).compactReal[actP2 * 2 + actP1];
+						getMappedBuffer(a1, a2).compactImag[p1 * 2 + p2] = getBuffer(actA2, actA1).compactImag[actP2 * 2 + actP1];
 					}
 				}
 			}
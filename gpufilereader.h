@@ -1,8 +1,12 @@
 #include "baselinebuffer.h"
 #include "fitsuser.h"
+#include "hduindex.h"
 #include "lane.h"
+#include "readahead.h"
 
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <ctime>
@@ -40,6 +44,7 @@ class GPUFileReader : private FitsUser
 			_shuffleTasks(threadCount),
 			_availableGPUMatrixBuffers(threadCount),
 			_isOpen(false),
+			_isFinished(false),
 			_nAntenna(nAntenna),
 			_nChannelsInTotal(nChannelsInTotal),
 			_bufferSize(0),
@@ -50,12 +55,45 @@ class GPUFileReader : private FitsUser
 			_threadCount(threadCount),
 			_integrationTime(0.0),
 			_doAlign(true),
-			_offlineFormat(offlineFormat)
+			_offlineFormat(offlineFormat),
+			_readFilesInParallel(false),
+			_readaheadHDUs(0),
+			_useHDUIndex(false),
+			_follow(false),
+			_followPollInterval(1.0),
+			_followTimeout(0.0),
+			_followEnded(false)
 		{ }
 		~GPUFileReader() { closeFiles(); }
 		
 		void AddFile(const char *filename) { _filenames.push_back(std::string(filename)); }
 		
+		/** Keep the given number of HDUs following the current one in flight for each file,
+		 * see @ref Readahead. Zero (the default) disables reading ahead. */
+		void SetReadahead(size_t hdusAhead) { _readaheadHDUs = hdusAhead; }
+		
+		/** Use the (cached) @ref HDUIndex of each file to open it. Files consisting of
+		 * uncompressed float images are then read directly, without cfitsio. */
+		void SetHDUIndex(bool useHDUIndex, const std::string& indexDirectory)
+		{
+			_useHDUIndex = useHDUIndex;
+			_hduIndexDirectory = indexDirectory;
+		}
+		
+		/**
+		 * Follow files that are still being written by the correlator. Each call to @ref Read()
+		 * waits until the requested HDUs have been completely written, polling the file sizes
+		 * every pollInterval seconds. When none of the files grows for @p timeout seconds,
+		 * the observation is assumed to have ended and Read() returns what is available.
+		 * In follow mode, the HDU index is not used.
+		 */
+		void SetFollow(bool follow, double pollInterval, double timeout)
+		{
+			_follow = follow;
+			_followPollInterval = pollInterval;
+			_followTimeout = timeout;
+		}
+		
 		void Initialize(double integrationTime, bool doAlign) {
 			_buffers.resize(_nAntenna * _nAntenna);
 			_mappedBuffers.resize(_nAntenna * _nAntenna);
@@ -86,7 +124,13 @@ class GPUFileReader : private FitsUser
 			_corrInputToOutput[input] = outputAnt*2 + outputPol;
 		}
 		
+		/** Opens the files and reads their start times, if this has not been done yet. Calling
+		 * this is optional, as @ref Read() will open the files when necessary. */
+		void Open();
 		bool Read(size_t &bufferPos, size_t bufferLength);
+		/** Like @ref Read(), but moves past the scans without reading them, which is
+		 * used to continue an interrupted run. No destination buffers are needed. */
+		bool Skip(size_t &bufferPos, size_t bufferLength);
 		bool IsConjugated(size_t ant1, size_t ant2, size_t pol1, size_t pol2) const
 		{
 			return _isConjugated[(ant1 * 2 + pol1) * _nAntenna * 2 + (ant2 * 2 + pol2)];
@@ -119,6 +163,12 @@ class GPUFileReader : private FitsUser
 		void initializePFBMapping();
 		void shuffleThreadFunc();
 		void shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const std::complex<float> *gpuMatrix);
+		/**
+		 * Copies the polarizations of one baseline that have a destination buffer, converting each
+		 * value with @p convert. Used for partially stored baselines and for compact buffers.
+		 */
+		template<typename T, typename Convert>
+		void shufflePartialBuffer(T* const real[4], T* const imag[4], size_t channelStart, size_t channelEnd, size_t fileBufferPos, const std::complex<float> *gpuData, size_t channelStride, Convert convert);
 		BaselineBuffer &getBuffer(size_t antenna1, size_t antenna2)
 		{
 			return _buffers[_nAntenna*antenna1 + antenna2];
@@ -128,11 +178,14 @@ class GPUFileReader : private FitsUser
 			return _mappedBuffers[_nAntenna*antenna1 + antenna2];
 		}
 		
-		bool _isOpen;
+		bool _isOpen, _isFinished;
 		size_t _nAntenna, _nChannelsInTotal, _bufferSize, _currentHDU, _stopHDU;
 		std::vector<std::string> _filenames;
 		std::vector<size_t> _fitsHDUCounts;
 		std::vector<fitsfile *> _fitsFiles;
+		// File descriptors of files that are read directly using their HDU index, or -1
+		std::vector<int> _rawFiles;
+		std::vector<HDUIndex> _hduIndices;
 		
 		std::vector<BaselineBuffer> _buffers;
 		std::vector<BaselineBuffer> _mappedBuffers;
@@ -143,6 +196,23 @@ class GPUFileReader : private FitsUser
 		size_t _threadCount;
 		std::vector<int> _hduOffsetsPerFile;
 		double _integrationTime;
-		bool _doAlign, _offlineFormat;
+		bool _doAlign, _offlineFormat, _readFilesInParallel;
+		size_t _readaheadHDUs;
+		std::unique_ptr<Readahead> _readahead;
+		bool _useHDUIndex;
+		std::string _hduIndexDirectory;
+		bool _follow;
+		double _followPollInterval, _followTimeout;
+		bool _followEnded;
+		std::vector<long long> _fileSizes;
 		std::function<void(const std::vector<int>&)> _onHDUOffsetsChange;
+		
+		void advanceReadahead(size_t iFile, size_t hduNumber);
+		void fileStartPosition(size_t iFile, size_t bufferPos, size_t& fileHDU, size_t& fileBufferPos) const;
+		fitsfile *openFollowedFile(const std::string& filename);
+		size_t countCompleteHDUs(fitsfile *fptr, long long fileSize);
+		bool updateFollowedFiles(const std::vector<size_t>& requiredHDUCounts);
+		void waitForHDUs(size_t bufferPos, size_t bufferLength);
+		void readRawImage(size_t iFile, size_t hduNumber, float *destination, size_t count);
+		void readFile(size_t iFile, size_t bufferPos, size_t bufferLength, size_t& endingBufferPos, bool& moreAvailable, class ProgressBar& progressBar, std::mutex& mutex);
 };
@@ -0,0 +1,254 @@
+#include "hduindex.h"
+
+#include <fitsio.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+	const char indexMagic[8] = "CTHDUIX";
+	const uint32_t indexVersion = 1;
+}
+
+HDUIndex HDUIndex::Get(const std::string& fitsFilename, const std::string& cacheDirectory)
+{
+	HDUIndex index;
+	if(!getFileStatus(fitsFilename, index._fileSize, index._modificationTime))
+		throw std::runtime_error("Cannot open file " + fitsFilename);
+	
+	const std::string filename = indexFilename(fitsFilename, cacheDirectory);
+	if(!index.load(filename))
+	{
+		index.build(fitsFilename);
+		index.save(filename);
+	}
+	return index;
+}
+
+std::vector<HDUIndex> HDUIndex::GetAll(const std::vector<std::string>& fitsFilenames, const std::string& cacheDirectory, size_t threadCount)
+{
+	std::vector<HDUIndex> indices(fitsFilenames.size());
+	// Different files can only be opened concurrently if cfitsio is thread safe
+	if(!fits_is_reentrant())
+		threadCount = 1;
+	std::mutex mutex;
+	size_t nextFile = 0;
+	std::exception_ptr firstError;
+	auto threadFunc = [&]()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while(nextFile != fitsFilenames.size() && !firstError)
+		{
+			const size_t fileIndex = nextFile;
+			++nextFile;
+			lock.unlock();
+			try {
+				if(!fitsFilenames[fileIndex].empty())
+					indices[fileIndex] = Get(fitsFilenames[fileIndex], cacheDirectory);
+				lock.lock();
+			} catch(...) {
+				lock.lock();
+				if(!firstError)
+					firstError = std::current_exception();
+			}
+		}
+	};
+	std::vector<std::thread> threads;
+	for(size_t i=0; i!=std::max<size_t>(1, std::min(threadCount, fitsFilenames.size())); ++i)
+		threads.emplace_back(threadFunc);
+	for(std::thread& t : threads)
+		t.join();
+	if(firstError)
+		std::rethrow_exception(firstError);
+	return indices;
+}
+
+bool HDUIndex::IsRawFloat(size_t firstHDUNumber) const
+{
+	if(firstHDUNumber > _hdus.size())
+		return false;
+	for(size_t hduNumber=firstHDUNumber; hduNumber<=_hdus.size(); ++hduNumber)
+	{
+		const HDU& hdu = GetHDU(hduNumber);
+		if(!hdu.isImage || hdu.isCompressed || hdu.isScaled || hdu.bitpix != FLOAT_IMG)
+			return false;
+		if(hdu.dataEnd - hdu.dataStart < (long long) (hdu.width * hdu.height * sizeof(float)))
+			return false;
+	}
+	return true;
+}
+
+void HDUIndex::build(const std::string& fitsFilename)
+{
+	int status = 0;
+	fitsfile *fptr = 0;
+	if(fits_open_file(&fptr, fitsFilename.c_str(), READONLY, &status))
+		throwError(status, std::string("Cannot open file ") + fitsFilename);
+	
+	int hduCount;
+	fits_get_num_hdus(fptr, &hduCount, &status);
+	checkStatus(status);
+	
+	fits_read_key(fptr, TLONG, "TIME", &_time, 0, &status);
+	checkStatus(status);
+	
+	_hdus.resize(hduCount);
+	for(int hduNumber=1; hduNumber<=hduCount; ++hduNumber)
+	{
+		HDU& hdu = _hdus[hduNumber-1];
+		int hduType = 0;
+		fits_movabs_hdu(fptr, hduNumber, &hduType, &status);
+		checkStatus(status);
+		LONGLONG headerStart, dataStart, dataEnd;
+		fits_get_hduaddrll(fptr, &headerStart, &dataStart, &dataEnd, &status);
+		checkStatus(status);
+		hdu.headerStart = headerStart;
+		hdu.dataStart = dataStart;
+		hdu.dataEnd = dataEnd;
+		hdu.isImage = (hduType == IMAGE_HDU);
+		hdu.bitpix = 0;
+		hdu.width = 0;
+		hdu.height = 0;
+		hdu.isCompressed = false;
+		hdu.isScaled = false;
+		if(hdu.isImage)
+		{
+			int naxis = 0;
+			long naxes[2] = {0, 0};
+			fits_get_img_param(fptr, 2, &hdu.bitpix, &naxis, naxes, &status);
+			checkStatus(status);
+			hdu.width = naxes[0];
+			hdu.height = naxes[1];
+			hdu.isCompressed = fits_is_compressed_image(fptr, &status);
+			checkStatus(status);
+			double bscale = 1.0, bzero = 0.0;
+			fits_read_key(fptr, TDOUBLE, "BSCALE", &bscale, 0, &status);
+			if(status == KEY_NO_EXIST) status = 0;
+			fits_read_key(fptr, TDOUBLE, "BZERO", &bzero, 0, &status);
+			if(status == KEY_NO_EXIST) status = 0;
+			checkStatus(status);
+			hdu.isScaled = (bscale != 1.0 || bzero != 0.0);
+		}
+	}
+	
+	fits_close_file(fptr, &status);
+	checkStatus(status);
+}
+
+bool HDUIndex::load(const std::string& indexFilename)
+{
+	std::ifstream file(indexFilename, std::ios::in | std::ios::binary);
+	if(!file.good())
+		return false;
+	char magic[8];
+	uint32_t version;
+	int64_t fileSize, modificationTime, time;
+	uint64_t hduCount;
+	file.read(magic, sizeof(magic));
+	file.read(reinterpret_cast<char*>(&version), sizeof(version));
+	file.read(reinterpret_cast<char*>(&fileSize), sizeof(fileSize));
+	file.read(reinterpret_cast<char*>(&modificationTime), sizeof(modificationTime));
+	file.read(reinterpret_cast<char*>(&time), sizeof(time));
+	file.read(reinterpret_cast<char*>(&hduCount), sizeof(hduCount));
+	if(!file.good() || memcmp(magic, indexMagic, sizeof(magic)) != 0 || version != indexVersion)
+		return false;
+	// An index of a file that has since been changed is silently rebuilt
+	if(fileSize != _fileSize || modificationTime != _modificationTime)
+		return false;
+	_time = time;
+	_hdus.resize(hduCount);
+	for(HDU& hdu : _hdus)
+	{
+		int64_t values[6];
+		uint8_t flags[3];
+		file.read(reinterpret_cast<char*>(values), sizeof(values));
+		file.read(reinterpret_cast<char*>(flags), sizeof(flags));
+		hdu.headerStart = values[0];
+		hdu.dataStart = values[1];
+		hdu.dataEnd = values[2];
+		hdu.bitpix = values[3];
+		hdu.width = values[4];
+		hdu.height = values[5];
+		hdu.isImage = flags[0];
+		hdu.isCompressed = flags[1];
+		hdu.isScaled = flags[2];
+	}
+	if(!file.good())
+	{
+		_hdus.clear();
+		return false;
+	}
+	return true;
+}
+
+void HDUIndex::save(const std::string& indexFilename) const
+{
+	// Write to a temporary file first, so that concurrent runs never see a partial index
+	const std::string tempFilename = indexFilename + ".tmp" + std::to_string(getpid());
+	{
+		std::ofstream file(tempFilename, std::ios::out | std::ios::binary);
+		if(!file.good())
+		{
+			std::cout << "Could not write HDU index " << indexFilename << "; the index will not be cached.\n";
+			return;
+		}
+		const uint32_t version = indexVersion;
+		const int64_t
+			fileSize = _fileSize,
+			modificationTime = _modificationTime,
+			time = _time;
+		const uint64_t hduCount = _hdus.size();
+		file.write(indexMagic, sizeof(indexMagic));
+		file.write(reinterpret_cast<const char*>(&version), sizeof(version));
+		file.write(reinterpret_cast<const char*>(&fileSize), sizeof(fileSize));
+		file.write(reinterpret_cast<const char*>(&modificationTime), sizeof(modificationTime));
+		file.write(reinterpret_cast<const char*>(&time), sizeof(time));
+		file.write(reinterpret_cast<const char*>(&hduCount), sizeof(hduCount));
+		for(const HDU& hdu : _hdus)
+		{
+			const int64_t values[6] = { hdu.headerStart, hdu.dataStart, hdu.dataEnd, hdu.bitpix, hdu.width, hdu.height };
+			const uint8_t flags[3] = { hdu.isImage, hdu.isCompressed, hdu.isScaled };
+			file.write(reinterpret_cast<const char*>(values), sizeof(values));
+			file.write(reinterpret_cast<const char*>(flags), sizeof(flags));
+		}
+		if(!file.good())
+		{
+			file.close();
+			std::remove(tempFilename.c_str());
+			std::cout << "Could not write HDU index " << indexFilename << "; the index will not be cached.\n";
+			return;
+		}
+	}
+	if(std::rename(tempFilename.c_str(), indexFilename.c_str()) != 0)
+		std::remove(tempFilename.c_str());
+}
+
+std::string HDUIndex::indexFilename(const std::string& fitsFilename, const std::string& cacheDirectory)
+{
+	if(cacheDirectory.empty())
+		return fitsFilename + ".hduindex";
+	const size_t slashPos = fitsFilename.rfind('/');
+	const std::string basename = (slashPos == std::string::npos) ? fitsFilename : fitsFilename.substr(slashPos+1);
+	return cacheDirectory + '/' + basename + ".hduindex";
+}
+
+bool HDUIndex::getFileStatus(const std::string& filename, long long& size, long long& modificationTime)
+{
+	struct stat fileStatus;
+	if(stat(filename.c_str(), &fileStatus) != 0)
+		return false;
+	size = fileStatus.st_size;
+	modificationTime = fileStatus.st_mtime;
+	return true;
+}
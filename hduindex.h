@@ -0,0 +1,70 @@
+#ifndef HDU_INDEX_H
+#define HDU_INDEX_H
+
+#include "fitsuser.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * Index of the HDUs of a gpubox file: the byte offsets and dimensions of every HDU
+ * and the TIME keyword of the primary header. Building the index requires walking
+ * all headers of the file, which is slow on network filesystems. Therefore, the
+ * index is cached in a small file, either next to the gpubox file or in a cache
+ * directory, and is reused by later runs as long as the size and modification
+ * time of the gpubox file are unchanged.
+ */
+class HDUIndex : private FitsUser
+{
+	public:
+		struct HDU
+		{
+			long long headerStart, dataStart, dataEnd;
+			int bitpix;
+			long width, height;
+			bool isImage, isCompressed, isScaled;
+		};
+		
+		HDUIndex() : _time(0), _fileSize(0), _modificationTime(0) { }
+		
+		/**
+		 * Loads the index of the given file from the cache, or builds and caches it when it is
+		 * not available or out of date.
+		 * @param cacheDirectory Directory in which the index is stored. When empty, it is stored
+		 * next to the file.
+		 */
+		static HDUIndex Get(const std::string& fitsFilename, const std::string& cacheDirectory);
+		
+		/**
+		 * Gets the index of all given files, building the missing ones in parallel. Empty
+		 * filenames result in an empty index.
+		 */
+		static std::vector<HDUIndex> GetAll(const std::vector<std::string>& fitsFilenames, const std::string& cacheDirectory, size_t threadCount);
+		
+		size_t HDUCount() const { return _hdus.size(); }
+		
+		/** Get an HDU by its (one-based) cfitsio HDU number. */
+		const HDU& GetHDU(size_t hduNumber) const { return _hdus[hduNumber-1]; }
+		
+		/** Value of the TIME keyword in the primary header. */
+		long Time() const { return _time; }
+		
+		/**
+		 * Whether the HDUs from the given HDU number onwards are all uncompressed, unscaled
+		 * 32-bit float images, which can be read directly from the file without cfitsio.
+		 */
+		bool IsRawFloat(size_t firstHDUNumber) const;
+		
+	private:
+		void build(const std::string& fitsFilename);
+		bool load(const std::string& indexFilename);
+		void save(const std::string& indexFilename) const;
+		static std::string indexFilename(const std::string& fitsFilename, const std::string& cacheDirectory);
+		static bool getFileStatus(const std::string& filename, long long& size, long long& modificationTime);
+		
+		std::vector<HDU> _hdus;
+		long _time;
+		long long _fileSize, _modificationTime;
+};
+
+#endif
@@ -58,6 +58,33 @@ bool isMWAFlagFile(const std::string &filename)
 	return false;
 }
 
+bool isColumnarFile(const std::string &filename)
+{
+	if(filename.size() > 5)
+	{
+		return boost::to_upper_copy(filename.substr(filename.size()-5)) == ".CVIS";
+	}
+	return false;
+}
+
+bool isUVH5File(const std::string &filename)
+{
+	if(filename.size() > 5)
+	{
+		return boost::to_upper_copy(filename.substr(filename.size()-5)) == ".UVH5";
+	}
+	return false;
+}
+
+#ifndef HAVE_HDF5
+const char* const noUVH5Message = "UVH5 output is not available: Cotter was built without HDF5";
+#endif
+
+bool isSharedMemoryName(const std::string &filename)
+{
+	return filename.compare(0, 4, "shm:") == 0;
+}
+
 void usage()
 {
 	std::cout << "usage: cotter [options] <gpufiles> \n"
@@ -65,18 +92,68 @@ void usage()
 	"  -o <filename>      Save output to given filename. Default is 'preprocessed.ms'.\n"
 	"                     If the files' extension is .uvfits, it will be outputted in uvfits format\n"
 	"                     and extension .mwaf is the flag-only format for input into the RTS.\n"
+	"                     Extension .cvis writes Cotter's columnar format, which is faster to write\n"
+	"                     and can be converted to a measurement set with cvis2ms.\n"
+	"                     Extension .uvh5 writes the HDF5-based UVH5 format of pyuvdata, when Cotter\n"
+	"                     was built with HDF5.\n"
+	"                     A name like shm:/cotter streams the rows to POSIX shared memory with that name,\n"
+	"                     from which another process on this node can read them (see shmconsumer).\n"
+	"  -extra-output <filename> <s> <kHz>\n"
+	"                     Also write the output to the given file, with its format chosen by the extension\n"
+	"                     as with -o, averaged to the given time and frequency resolution (0 for no averaging).\n"
+	"                     Can be given several times, e.g. to write flag files and an averaged Measurement Set\n"
+	"                     in a single run. Every output is written by its own thread.\n"
 	"  -m <filename>      Read meta data from given fits filename..\n"
 	"  -a <filename>      Read antenna locations from given text file (overrides the metadata).\n"
 	"  -h <filename>      Read header data from given text file (overrides the metadata.)\n"
 	"  -i <filename>      Read meta data from given fits filename (overrides the metadata).\n"
-	"  -mem <percentage>  Use at most the given percentage of memory.\n"
+	"  -mem <percentage>  Use at most the given percentage of memory. The chunk length and, if necessary,\n"
+	"                     the number of threads are chosen to fit in it, and chunks are shortened when\n"
+	"                     more memory is used than expected.\n"
 	"  -absmem <gb>       Use at most the given amount of memory, specified in gigabytes.\n"
 	"  -j <ncpus>         Number of CPUs to use. Default is to use all.\n"
+	"  -parallelbands     When the bandwidth is non-contiguous, process the contiguous bands at the same\n"
+	"                     time, dividing the CPUs and memory over them. Progress output of the bands will\n"
+	"                     be interleaved. Can not be combined with -saveqs.\n"
+	"  -readahead <n>     Keep the n HDUs following the current one in flight for each gpubox file, so that\n"
+	"                     reading does not wait on the storage latency of every HDU. Default: 0 (off).\n"
+	"  -hduindex          Cache an index of the HDUs of each gpubox file next to the file, and use it to\n"
+	"                     open the files without parsing all headers. Uncompressed files are then read\n"
+	"                     directly at the indexed offsets.\n"
+	"  -hduindexdir <dir> Like -hduindex, but store the indices in the given directory.\n"
+	"  -follow <timeout>  Process the gpubox files while they are still being written by the correlator.\n"
+	"                     New HDUs are read as they appear. The observation is assumed to end when all\n"
+	"                     scans in the metadata are read, or when the files have not grown for the given\n"
+	"                     number of seconds. tests/followtest.sh tests this with gpuboxappender, which\n"
+	"                     is built next to cotter and replays complete files as the correlator writes them.\n"
+	"  -followwindow <n>  In follow mode, process and write the data in windows of at most n scans.\n"
+	"                     Smaller windows give lower latency, but less accurate flagging. Default: limited\n"
+	"                     by memory only.\n"
+	"  -numa              Divide the baselines over the NUMA nodes, place their buffers on their node and\n"
+	"                     pin the processing threads to the nodes. Reports the throughput per node.\n"
+	"  -sbpass <n>        Process a band in passes of at most n coarse channels (gpubox files), which are\n"
+	"                     written into the same measurement set. Each pass only holds its own channels in\n"
+	"                     memory, allowing longer time chunks at the cost of reading and writing in several\n"
+	"                     passes. Only for measurement set output without Dysco compression.\n"
 	"  -timeres <s>       Average nr of sec of timesteps together before writing to measurement set.\n"
 	"  -freqres <kHz>     Average kHz bandwidth of channels together before writing to measurement set.\n"
 	"                     When averaging: flagging, collecting statistics and cable length fixes are done\n"
 	"                     at highest resolution. UVW positions are recalculated for new timesteps.\n"
+	"  -bda <decorrelation> <radius deg> <max s> <max kHz>\n"
+	"                     Average short baselines further than -timeres and -freqres, by powers of two up to\n"
+	"                     the given maximum resolutions, as long as a source at the given radius from the\n"
+	"                     phase centre decorrelates by less than the given fraction (e.g. 0.01). Baselines\n"
+	"                     with coarser channels are written in their own spectral windows. Only for a single\n"
+	"                     measurement set without Dysco compression, shards, passes or extra outputs.\n"
 	"  -norfi             Disable RFI detection.\n"
+	"  -compactvis        Store the visibilities in memory as bfloat16 (16-bit floats with 8 bits of mantissa),\n"
+	"                     which fits about 1.8 times as many scans in the same memory. Processing and writing\n"
+	"                     is still done in 32-bit floats, but the output has a precision of about 0.4%.\n"
+	"  -skippruned        Do not read, store or process the baselines that are removed from the output\n"
+	"                     (see -noantennapruning and -noautos), and use the saved memory for longer chunks.\n"
+	"                     Statistics are then only collected for the written baselines.\n"
+	"  -statsavg <t> <f>  Collect the quality statistics at a lower resolution, by averaging t timesteps and\n"
+	"                     f channels. This speeds up collecting, and reduces the size of the statistics tables.\n"
 	"  -nostats           Disable collecting statistics (default for uvfits file output).\n"
 	"  -nogeom            Disable geometric corrections.\n"
 	"  -noalign           Do not align GPU boxes according to the time in their header.\n"
@@ -108,12 +185,29 @@ void usage()
 	"  -offline-gpubox-format Assume the GPU Box do not have an initial HDU for metadata. This is\n"
 	"                     used for offline correlation of VCS observations.\n"
 	"  -skipwrite         Skip the writing step completely: only collect statistics.\n"
+	"  -resume            Continue an interrupted run from the checkpoint next to the output\n"
+	"                     measurement set or flag files. Checkpoints are written after each chunk, and\n"
+	"                     SIGTERM stops the run at the next checkpoint. Only a single measurement set or\n"
+	"                     flag files written in one pass can be resumed, without shards, extra outputs\n"
+	"                     or -bda. Statistics of a resumed band are not collected; use 'aoquality collect'.\n"
 	"  -apply <file>      Apply a solution file after averaging. The solution file should have as many\n"
 	"                     channels as that the observation will have after the given averaging settings.\n"
 	"  -full-apply <file> Apply a solution file before averaging. The solution file should have as many\n"
 	"                     channels as the observation.\n"
+	"                     Solution files with multiple intervals are applied per interval, based on\n"
+	"                     the time range in their header.\n"
 	"  -flag-strategy <file> Use the specified aoflagger strategy.\n"
 	"  -use-dysco         Compress the Measurement Set using Dysco.\n"
+	"  -compactweights    Store the weights of the Measurement Set only in rows where they differ from\n"
+	"                     the previous row. Without averaging, the weights are the same for every row;\n"
+	"                     with averaging, they only change where flagged samples were averaged.\n"
+	"  -shm-timeout <s>   Seconds that shared memory output waits for a consumer to attach or to read a\n"
+	"                     row before failing. Default is 600.\n"
+	"  -uvh5-deflate <level>\n"
+	"                     Compress the data of UVH5 output with the shuffle and deflate filters at the\n"
+	"                     given level (1-9). Default is 0: no compression.\n"
+	"  -shards <n>        Write the Measurement Set as n parts of equally many coarse channels, each by\n"
+	"                     its own thread, and combine them in a concatenated table with the output name.\n"
 	"  -dysco-config <data bits> <weight bits> <distribution> <truncation> <normalization>\n"
 	"                     Set advanced Dysco options.\n"
 	"  -version           Output version and exit.\n"
@@ -152,6 +246,9 @@ int cotterMain(int argc, const char* const* argv)
 	bool saveQualityStatistics = false;
 	bool allowMissingFiles = false;
 	size_t nCPUs = 0, sbStart = 1;
+	bool follow = false;
+	double followTimeout = 0.0;
+	size_t followWindowScans = 0;
 	while(argi!=argc)
 	{
 		if(argv[argi][0] == '-')
@@ -178,6 +275,52 @@ int cotterMain(int argc, const char* const* argv)
 					cotter.SetOutputFormat(Cotter::FlagsOutputFormat);
 					cotter.SetRemoveFlaggedAntennae(false);
 				}
+				else if(isColumnarFile(outputFilename))
+				{
+					cotter.SetCollectStatistics(saveQualityStatistics);
+					cotter.SetOutputFormat(Cotter::ColumnarOutputFormat);
+				}
+				else if(isUVH5File(outputFilename))
+				{
+#ifdef HAVE_HDF5
+					cotter.SetCollectStatistics(saveQualityStatistics);
+					cotter.SetOutputFormat(Cotter::UVH5OutputFormat);
+#else
+					throw std::runtime_error(noUVH5Message);
+#endif
+				}
+				else if(isSharedMemoryName(outputFilename))
+				{
+					cotter.SetCollectStatistics(saveQualityStatistics);
+					cotter.SetOutputFormat(Cotter::SharedMemoryOutputFormat);
+				}
+			}
+			else if(param == "extra-output")
+			{
+				const std::string filename = argv[argi+1];
+				const double timeRes = atof(argv[argi+2]), freqRes = atof(argv[argi+3]);
+				argi += 3;
+				if(isFitsFile(filename))
+					cotter.AddExtraOutput(filename, Cotter::FitsOutputFormat, timeRes, freqRes);
+				else if(isMWAFlagFile(filename))
+				{
+					cotter.AddExtraOutput(filename, Cotter::FlagsOutputFormat, timeRes, freqRes);
+					cotter.SetRemoveFlaggedAntennae(false);
+				}
+				else if(isColumnarFile(filename))
+					cotter.AddExtraOutput(filename, Cotter::ColumnarOutputFormat, timeRes, freqRes);
+				else if(isUVH5File(filename))
+				{
+#ifdef HAVE_HDF5
+					cotter.AddExtraOutput(filename, Cotter::UVH5OutputFormat, timeRes, freqRes);
+#else
+					throw std::runtime_error(noUVH5Message);
+#endif
+				}
+				else if(isSharedMemoryName(filename))
+					cotter.AddExtraOutput(filename, Cotter::SharedMemoryOutputFormat, timeRes, freqRes);
+				else
+					cotter.AddExtraOutput(filename, Cotter::MSOutputFormat, timeRes, freqRes);
 			}
 			else if(param == "m")
 			{
@@ -222,6 +365,22 @@ int cotterMain(int argc, const char* const* argv)
 			{
 				cotter.SetRFIDetection(false);
 			}
+			else if(param == "compactvis")
+			{
+				cotter.SetCompactVisibilities(true);
+			}
+			else if(param == "skippruned")
+			{
+				cotter.SetSkipPrunedBaselines(true);
+			}
+			else if(param == "statsavg")
+			{
+				++argi;
+				size_t timeFactor = atoi(argv[argi]);
+				++argi;
+				size_t frequencyFactor = atoi(argv[argi]);
+				cotter.SetStatisticsResolution(timeFactor, frequencyFactor);
+			}
 			else if(param == "nostats")
 			{
 				cotter.SetCollectStatistics(false);
@@ -238,6 +397,44 @@ int cotterMain(int argc, const char* const* argv)
 			{
 				cotter.SetDisableGeometricCorrections(true);
 			}
+			else if(param == "parallelbands")
+			{
+				cotter.SetProcessBandsInParallel(true);
+			}
+			else if(param == "readahead")
+			{
+				++argi;
+				cotter.SetReadahead(atoi(argv[argi]));
+			}
+			else if(param == "hduindex")
+			{
+				cotter.SetHDUIndex(true, std::string());
+			}
+			else if(param == "hduindexdir")
+			{
+				++argi;
+				cotter.SetHDUIndex(true, argv[argi]);
+			}
+			else if(param == "follow")
+			{
+				++argi;
+				followTimeout = atof(argv[argi]);
+				follow = true;
+			}
+			else if(param == "followwindow")
+			{
+				++argi;
+				followWindowScans = atoi(argv[argi]);
+			}
+			else if(param == "numa")
+			{
+				cotter.SetNUMAAware(true);
+			}
+			else if(param == "sbpass")
+			{
+				++argi;
+				cotter.SetSubbandsPerPass(atoi(argv[argi]));
+			}
 			else if(param == "noalign")
 			{
 				cotter.SetDoAlign(false);
@@ -284,6 +481,14 @@ int cotterMain(int argc, const char* const* argv)
 				++argi;
 				freqRes = atof(argv[argi]);
 			}
+			else if(param == "bda")
+			{
+				const double decorrelation = atof(argv[argi+1]);
+				if(decorrelation <= 0.0 || decorrelation >= 1.0)
+					throw std::runtime_error("The decorrelation of -bda should be between 0 and 1");
+				cotter.SetBaselineDependentAveraging(decorrelation, atof(argv[argi+2]) * (M_PI/180.0), atof(argv[argi+3]), atof(argv[argi+4]));
+				argi += 4;
+			}
 			else if(param == "centre")
 			{
 				++argi;
@@ -371,6 +576,10 @@ int cotterMain(int argc, const char* const* argv)
 			{
 				cotter.SetSkipWriting(true);
 			}
+			else if(param == "resume")
+			{
+				cotter.SetResume(true);
+			}
 			else if(param == "offline-gpubox-format")
 			{
 				cotter.SetOfflineGPUBoxFormat(true);
@@ -396,6 +605,28 @@ int cotterMain(int argc, const char* const* argv)
 			{
 				cotter.SetUseDysco(true);
 			}
+			else if(param == "compactweights")
+			{
+				cotter.SetCompactWeights(true);
+			}
+			else if(param == "shm-timeout")
+			{
+				++argi;
+				cotter.SetSharedMemoryTimeout(atof(argv[argi]));
+			}
+			else if(param == "uvh5-deflate")
+			{
+				++argi;
+				const int level = atoi(argv[argi]);
+				if(level < 0 || level > 9)
+					throw std::runtime_error("The deflate level of -uvh5-deflate should be between 0 and 9");
+				cotter.SetUVH5DeflateLevel(level);
+			}
+			else if(param == "shards")
+			{
+				++argi;
+				cotter.SetShardCount(atoi(argv[argi]));
+			}
 			else if(param == "dysco-config")
 			{
 				cotter.SetAdvancedDyscoOptions(atoi(argv[argi+1]), atoi(argv[argi+2]), argv[argi+3], atof(argv[argi+4]), argv[argi+5]);
@@ -492,6 +723,8 @@ int cotterMain(int argc, const char* const* argv)
 	}
 	
 	cotter.SetFileSets(fileSets);
+	if(follow)
+		cotter.SetFollow(followTimeout, followWindowScans);
 	cotter.SetMaxBufferSize(memSize*memPercentage/(100*(sizeof(float)*2+1)));
 	if(nCPUs == 0)
 		cotter.SetThreadCount(sysconf(_SC_NPROCESSORS_ONLN));
@@ -0,0 +1,91 @@
+#include "memorymodel.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+size_t MemoryModel::Bytes(size_t scanCount, size_t threadCount) const
+{
+	size_t total = 0;
+	for(const Item& item : _items)
+	{
+		const size_t bytes = item.bytesFixed + scanCount * item.bytesPerScan;
+		total += item.perThread ? bytes * threadCount : bytes;
+	}
+	return total;
+}
+
+size_t MemoryModel::MaxScans(size_t budget, size_t threadCount) const
+{
+	const size_t fixed = Bytes(0, threadCount);
+	if(fixed >= budget)
+		return 0;
+	const size_t perScan = Bytes(1, threadCount) - fixed;
+	if(perScan == 0)
+		return std::numeric_limits<size_t>::max();
+	return (budget - fixed) / perScan;
+}
+
+void MemoryModel::Report(std::ostream& stream, size_t scanCount, size_t threadCount) const
+{
+	for(const Item& item : _items)
+	{
+		const size_t bytes = item.bytesFixed + scanCount * item.bytesPerScan;
+		stream << "  " << item.name << ": ";
+		if(item.perThread)
+			stream << threadCount << " x " << ToString(bytes) << '\n';
+		else
+			stream << ToString(bytes) << '\n';
+	}
+	stream << "  Total: " << ToString(Bytes(scanCount, threadCount)) << '\n';
+}
+
+size_t MemoryModel::readStatusField(const char* field)
+{
+	std::ifstream file("/proc/self/status");
+	std::string line;
+	const size_t fieldLength = strlen(field);
+	while(std::getline(file, line))
+	{
+		if(line.compare(0, fieldLength, field) == 0 && line.size() > fieldLength && line[fieldLength] == ':')
+		{
+			// The value is given in kB
+			return size_t(strtoull(line.c_str() + fieldLength + 1, nullptr, 10)) * 1024;
+		}
+	}
+	return 0;
+}
+
+size_t MemoryModel::ResidentSetSize()
+{
+	return readStatusField("VmRSS");
+}
+
+size_t MemoryModel::PeakResidentSetSize()
+{
+	return readStatusField("VmHWM");
+}
+
+bool MemoryModel::ResetPeakResidentSetSize()
+{
+	// Writing "5" to clear_refs resets the peak RSS (Linux 4.0 and later)
+	std::ofstream file("/proc/self/clear_refs");
+	file << "5";
+	file.flush();
+	return file.good();
+}
+
+std::string MemoryModel::ToString(size_t bytes)
+{
+	std::ostringstream str;
+	if(bytes >= size_t(1024)*1024*1024)
+		str << round(double(bytes) * 10.0 / (1024.0*1024.0*1024.0)) / 10.0 << " GB";
+	else if(bytes >= 1024*1024)
+		str << round(double(bytes) * 10.0 / (1024.0*1024.0)) / 10.0 << " MB";
+	else
+		str << round(double(bytes) * 10.0 / 1024.0) / 10.0 << " KB";
+	return str.str();
+}
@@ -0,0 +1,76 @@
+#ifndef MEMORY_MODEL_H
+#define MEMORY_MODEL_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * Estimates the memory that is needed to process a chunk, from a list of the
+ * major allocations. Each allocation has a fixed part and a part that scales with
+ * the number of scans in the chunk, and is either made once or once per
+ * processing thread. From this, the longest chunk that fits in a budget can be
+ * calculated.
+ *
+ * The class also provides access to the resident set size of the process, so
+ * that the model can be compared with the actual usage.
+ */
+class MemoryModel
+{
+	public:
+		/** Adds an allocation of bytesFixed + scanCount * bytesPerScan bytes. */
+		void Add(const std::string& name, size_t bytesFixed, size_t bytesPerScan)
+		{
+			_items.push_back(Item{name, bytesFixed, bytesPerScan, false});
+		}
+
+		/** Adds an allocation that each processing thread makes. */
+		void AddPerThread(const std::string& name, size_t bytesFixed, size_t bytesPerScan)
+		{
+			_items.push_back(Item{name, bytesFixed, bytesPerScan, true});
+		}
+
+		/** Total number of bytes for a chunk of the given length. */
+		size_t Bytes(size_t scanCount, size_t threadCount) const;
+
+		/**
+		 * The largest number of scans for which @ref Bytes() does not exceed the budget.
+		 * @returns 0 if not even the fixed allocations fit.
+		 */
+		size_t MaxScans(size_t budget, size_t threadCount) const;
+
+		/** Writes a line per allocation with its size for a chunk of the given length. */
+		void Report(std::ostream& stream, size_t scanCount, size_t threadCount) const;
+
+		/** Current resident set size of this process in bytes, or 0 if not available. */
+		static size_t ResidentSetSize();
+
+		/**
+		 * Highest resident set size of this process in bytes since the start or the last
+		 * call to @ref ResetPeakResidentSetSize(), or 0 if not available.
+		 */
+		static size_t PeakResidentSetSize();
+
+		/**
+		 * Resets the peak resident set size to the current size, such that the peak of
+		 * a processing stage can be measured. This affects the entire process.
+		 * @returns false if the kernel does not support this.
+		 */
+		static bool ResetPeakResidentSetSize();
+
+		/** Formats a number of bytes for output, e.g. "1.5 GB". */
+		static std::string ToString(size_t bytes);
+
+	private:
+		struct Item
+		{
+			std::string name;
+			size_t bytesFixed, bytesPerScan;
+			bool perThread;
+		};
+		std::vector<Item> _items;
+
+		static size_t readStatusField(const char* field);
+};
+
+#endif
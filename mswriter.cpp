@@ -3,18 +3,22 @@
 #include <casacore/ms/MeasurementSets/MeasurementSet.h>
 
 #include <casacore/tables/DataMan/DataManager.h>
+#include <casacore/tables/DataMan/IncrStMan.h>
 #include <casacore/tables/Tables/ArrayColumn.h>
 #include <casacore/tables/Tables/ArrColDesc.h>
 #include <casacore/tables/Tables/ScalarColumn.h>
 #include <casacore/tables/Tables/SetupNewTab.h>
 #include <casacore/tables/Tables/TableRecord.h>
 
+#include <casacore/casa/Arrays/Slicer.h>
 #include <casacore/casa/Containers/Record.h>
 
 #include <casacore/measures/TableMeasures/TableMeasDesc.h>
 
 #include <casacore/measures/Measures/MFrequency.h>
 
+#include <stdexcept>
+
 using namespace casacore;
 
 class MSWriterData
@@ -51,7 +55,15 @@ MSWriter::MSWriter(const std::string& filename) :
 	_isInitialized(false),
 	_rowIndex(0),
 	_filename(filename),
-	_useDysco(false)
+	_useDysco(false),
+	_uniformWeights(false),
+	_isChannelRange(false),
+	_updateExisting(false),
+	_isResuming(false),
+	_hasRowWindows(false),
+	_channelStart(0),
+	_rangeChannelCount(0),
+	_dataDescId(0)
 {
 }
 
@@ -59,6 +71,7 @@ MSWriter::~MSWriter()
 {
 	if(!_isInitialized)
 		initialize();
+	std::lock_guard<std::recursive_mutex> lock(TableMutex());
 	delete _data;
 }
 
@@ -72,10 +85,72 @@ void MSWriter::EnableCompression(size_t dataBitRate, size_t weightBitRate, const
 	_data->_dyscoDistTruncation = distTruncation;
 }
 
+void MSWriter::SetChannelRange(size_t channelStart, bool updateExisting, const std::string& bandName, const std::vector<ChannelInfo>& bandChannels, double refFreq, double totalBandwidth)
+{
+	_isChannelRange = true;
+	_updateExisting = updateExisting;
+	_channelStart = channelStart;
+	_bandInfo.name = bandName;
+	_bandInfo.channels = bandChannels;
+	_bandInfo.refFreq = refFreq;
+	_bandInfo.totalBandwidth = totalBandwidth;
+}
+
+void MSWriter::SetSpectralWindows(const std::vector<SpectralWindow>& windows, size_t dataWindowIndex)
+{
+	_windows = windows;
+	_dataDescId = dataWindowIndex;
+	_bandInfo.name = windows[dataWindowIndex].name;
+	_bandInfo.channels = windows[dataWindowIndex].channels;
+	_bandInfo.refFreq = windows[dataWindowIndex].refFreq;
+	_bandInfo.totalBandwidth = windows[dataWindowIndex].totalBandwidth;
+}
+
+size_t MSWriter::AddSpectralWindow(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth)
+{
+	if(_isInitialized)
+		throw std::runtime_error("Spectral windows should be added before rows are written to " + _filename);
+	if(_isChannelRange || (!_windows.empty() && !_hasRowWindows))
+		throw std::runtime_error("Rows with different channel resolutions can not be written in passes or shards");
+	if(_windows.empty())
+		_windows.push_back(SpectralWindow{_bandInfo.name, _bandInfo.channels, _bandInfo.refFreq, _bandInfo.totalBandwidth});
+	_windows.push_back(SpectralWindow{name, channels, refFreq, totalBandwidth});
+	_hasRowWindows = true;
+	return _windows.size() - 1;
+}
+
+void MSWriter::SetResume(size_t rowCount)
+{
+	_isResuming = true;
+	_rowIndex = rowCount;
+}
+
 void MSWriter::initialize()
 {
+	std::lock_guard<std::recursive_mutex> lock(TableMutex());
 	_isInitialized = true;
 	
+	if(_isChannelRange && _useDysco)
+		throw std::runtime_error("Writing a range of channels is not possible with Dysco compression");
+	if(_isResuming && _useDysco)
+		throw std::runtime_error("Resuming is not possible with Dysco compression, as it can not overwrite rows");
+	if(_isChannelRange && _uniformWeights)
+		throw std::runtime_error("Writing a range of channels is not possible with uniform weights");
+	if(_hasRowWindows && _useDysco)
+		throw std::runtime_error("Rows with different channel resolutions can not be compressed with Dysco, which requires the same shape in every row");
+	if(_hasRowWindows && (_isResuming || _uniformWeights))
+		throw std::runtime_error("Rows with different channel resolutions can not be resumed or stored with uniform weights");
+	if(_updateExisting)
+	{
+		openExisting();
+		return;
+	}
+	if(_isResuming)
+	{
+		openForResume();
+		return;
+	}
+	
 	TableDesc tableDesc = MS::requiredTableDesc();
 	
 	DataManagerCtor dyscoConstructor = 0;
@@ -86,6 +161,12 @@ void MSWriter::initialize()
 	}
 	
 	SetupNewTable newTab(_filename, tableDesc, Table::New);
+	if(_uniformWeights)
+	{
+		IncrementalStMan weightStMan("WeightISM");
+		newTab.bindColumn(MS::columnName(casacore::MSMainEnums::WEIGHT), weightStMan);
+		newTab.bindColumn(MS::columnName(casacore::MSMainEnums::SIGMA), weightStMan);
+	}
 	_data->_ms = MeasurementSet(newTab);
 	MeasurementSet &ms = _data->_ms;
 	ms.createDefaultSubtables(Table::New);
@@ -100,6 +181,11 @@ void MSWriter::initialize()
 		std::unique_ptr<DataManager> dyscoStMan(dyscoConstructor("DyscoData", dyscoSpec));
 		ms.addColumn(dataColumnDesc, *dyscoStMan);
 	}
+	else if(_hasRowWindows) {
+		// The rows of each spectral window have their own number of channels
+		dataColumnDesc.setNdim(2);
+		ms.addColumn(dataColumnDesc);
+	}
 	else {
 		dataColumnDesc.setShape(dataShape);
 		dataColumnDesc.setOptions(ColumnDesc::FixedShape);
@@ -113,6 +199,16 @@ void MSWriter::initialize()
 		std::unique_ptr<DataManager> dyscoStMan(dyscoConstructor("DyscoWeight", dyscoSpec));
 		ms.addColumn(weightSpectrumColumnDesc, *dyscoStMan);
 	}
+	else if(_uniformWeights) {
+		weightSpectrumColumnDesc.setShape(dataShape);
+		weightSpectrumColumnDesc.setOptions(ColumnDesc::FixedShape);
+		IncrementalStMan weightSpectrumStMan("WeightSpectrumISM");
+		ms.addColumn(weightSpectrumColumnDesc, weightSpectrumStMan);
+	}
+	else if(_hasRowWindows) {
+		weightSpectrumColumnDesc.setNdim(2);
+		ms.addColumn(weightSpectrumColumnDesc);
+	}
 	else {
 		weightSpectrumColumnDesc.setShape(dataShape);
 		weightSpectrumColumnDesc.setOptions(ColumnDesc::FixedShape);
@@ -133,6 +229,20 @@ void MSWriter::initialize()
 	MSSource sourceTable(newSourceTable);
 	ms.rwKeywordSet().defineTable(MS::keywordName(casacore::MSMainEnums::SOURCE), sourceTable);
 	
+	initializeColumns();
+	
+	writeBandInfo();
+	writeAntennae();
+	writePolarizationForLinearPols();
+	writeField();
+	writeSource();
+	writeObservation();
+	writeHistoryItem();
+}
+
+void MSWriter::initializeColumns()
+{
+	MeasurementSet &ms = _data->_ms;
 	_data->_timeCol = ScalarColumn<double>(ms, MS::columnName(casacore::MSMainEnums::TIME));
 	_data->_timeCentroidCol = ScalarColumn<double>(ms, MS::columnName(casacore::MSMainEnums::TIME_CENTROID));
 	_data->_antenna1Col = ScalarColumn<int>(ms, MS::columnName(casacore::MSMainEnums::ANTENNA1));
@@ -149,14 +259,33 @@ void MSWriter::initialize()
 	_data->_weightCol = ArrayColumn<float>(ms, MS::columnName(casacore::MSMainEnums::WEIGHT));
 	_data->_weightSpectrumCol = ArrayColumn<float>(ms, MS::columnName(casacore::MSMainEnums::WEIGHT_SPECTRUM));
 	_data->_flagCol = ArrayColumn<bool>(ms, MS::columnName(casacore::MSMainEnums::FLAG));
+}
+
+void MSWriter::openForResume()
+{
+	_data->_ms = MeasurementSet(_filename, Table::Update);
+	initializeColumns();
 	
-	writeBandInfo();
-	writeAntennae();
-	writePolarizationForLinearPols();
-	writeField();
-	writeSource();
-	writeObservation();
-	writeHistoryItem();
+	if(_data->_ms.nrow() < _rowIndex)
+		throw std::runtime_error("Measurement set " + _filename + " has fewer rows than the checkpoint specifies; can not resume");
+	if(size_t(_data->_dataCol.shapeColumn()[1]) != _bandInfo.channels.size())
+		throw std::runtime_error("Measurement set " + _filename + " has a different number of channels than the resumed run");
+}
+
+void MSWriter::openExisting()
+{
+	_data->_ms = MeasurementSet(_filename, Table::Update);
+	MeasurementSet &ms = _data->_ms;
+	
+	_data->_antenna1Col = ScalarColumn<int>(ms, MS::columnName(casacore::MSMainEnums::ANTENNA1));
+	_data->_antenna2Col = ScalarColumn<int>(ms, MS::columnName(casacore::MSMainEnums::ANTENNA2));
+	_data->_dataCol = ArrayColumn<std::complex<float> >(ms, MS::columnName(casacore::MSMainEnums::DATA));
+	_data->_weightCol = ArrayColumn<float>(ms, MS::columnName(casacore::MSMainEnums::WEIGHT));
+	_data->_weightSpectrumCol = ArrayColumn<float>(ms, MS::columnName(casacore::MSMainEnums::WEIGHT_SPECTRUM));
+	_data->_flagCol = ArrayColumn<bool>(ms, MS::columnName(casacore::MSMainEnums::FLAG));
+	
+	if(size_t(_data->_dataCol.shapeColumn()[1]) < _channelStart + _rangeChannelCount)
+		throw std::runtime_error("Measurement set " + _filename + " has fewer channels than the channel range that is to be written");
 }
 
 void MSWriterData::GetDyscoSpec(casacore::Record& dyscoSpec) const
@@ -179,6 +308,19 @@ void MSWriterData::GetDyscoSpec(casacore::Record& dyscoSpec) const
 
 void MSWriter::WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow)
 {
+	if(_isChannelRange)
+	{
+		// The full band was given to SetChannelRange()
+		_rangeChannelCount = channels.size();
+		_bandInfo.flagRow = flagRow;
+		return;
+	}
+	if(!_windows.empty())
+	{
+		// The windows were given to SetSpectralWindows()
+		_bandInfo.flagRow = flagRow;
+		return;
+	}
 	_bandInfo.name = name;
 	_bandInfo.channels = channels;
 	_bandInfo.refFreq = refFreq;
@@ -220,6 +362,16 @@ void MSWriter::WriteHistoryItem(const std::string &commandLine, const std::strin
 }
 
 void MSWriter::writeBandInfo()
+{
+	if(_windows.empty())
+		writeSpectralWindow(SpectralWindow{_bandInfo.name, _bandInfo.channels, _bandInfo.refFreq, _bandInfo.totalBandwidth});
+	else {
+		for(const SpectralWindow& window : _windows)
+			writeSpectralWindow(window);
+	}
+}
+
+void MSWriter::writeSpectralWindow(const SpectralWindow& window)
 {
 	MeasurementSet &ms = _data->_ms;
 	MSSpectralWindow spwTable = ms.spectralWindow();
@@ -236,22 +388,22 @@ void MSWriter::writeBandInfo()
 	ScalarColumn<double> totalBWCol = ScalarColumn<double>(spwTable, spwTable.columnName(MSSpectralWindowEnums::TOTAL_BANDWIDTH));
 	ScalarColumn<bool> flagRowCol = ScalarColumn<bool>(spwTable, spwTable.columnName(MSSpectralWindowEnums::FLAG_ROW));
 
-	const size_t nChannels = _bandInfo.channels.size();
+	const size_t nChannels = window.channels.size();
 	size_t rowIndex = spwTable.nrow();
 	spwTable.addRow();
 	numChanCol.put(rowIndex, nChannels);
-	nameCol.put(rowIndex, _bandInfo.name);
-	refFreqCol.put(rowIndex, _bandInfo.refFreq);
+	nameCol.put(rowIndex, window.name);
+	refFreqCol.put(rowIndex, window.refFreq);
 	
 	casacore::Vector<double>
 		chanFreqVec(nChannels), chanWidthVec(nChannels),
 		effectiveBWVec(nChannels), resolutionVec(nChannels);
-	for(size_t ch=0; ch!=_bandInfo.channels.size(); ++ch)
+	for(size_t ch=0; ch!=window.channels.size(); ++ch)
 	{
-		chanFreqVec[ch] = _bandInfo.channels[ch].chanFreq;
-		chanWidthVec[ch] = _bandInfo.channels[ch].chanWidth;
-		effectiveBWVec[ch] = _bandInfo.channels[ch].effectiveBW;
-		resolutionVec[ch] = _bandInfo.channels[ch].resolution;
+		chanFreqVec[ch] = window.channels[ch].chanFreq;
+		chanWidthVec[ch] = window.channels[ch].chanWidth;
+		effectiveBWVec[ch] = window.channels[ch].effectiveBW;
+		resolutionVec[ch] = window.channels[ch].resolution;
 	}
 	chanFreqCol.put(rowIndex, chanFreqVec);
 	chanWidthCol.put(rowIndex, chanWidthVec);
@@ -259,7 +411,7 @@ void MSWriter::writeBandInfo()
 	effectiveBWCol.put(rowIndex, effectiveBWVec);
 	resolutionCol.put(rowIndex, resolutionVec);
 	
-	totalBWCol.put(rowIndex, _bandInfo.totalBandwidth);
+	totalBWCol.put(rowIndex, window.totalBandwidth);
 	flagRowCol.put(rowIndex, _bandInfo.flagRow);
 	
 	writeDataDescEntry(rowIndex, 0, false);
@@ -492,35 +644,83 @@ void MSWriter::AddRows(size_t count)
 {
 	if(!_isInitialized)
 		initialize();
-	_data->_ms.addRow(count);
+	if(_updateExisting)
+	{
+		// The rows were added by the first pass
+		if(_rowIndex + count > _data->_ms.nrow())
+			throw std::runtime_error("More rows are written to " + _filename + " than it has");
+	}
+	else if(_isResuming)
+	{
+		// Rows after the checkpoint might exist already; these are overwritten
+		if(_rowIndex + count > _data->_ms.nrow())
+			_data->_ms.addRow(_rowIndex + count - _data->_ms.nrow());
+	}
+	else {
+		_data->_ms.addRow(count);
+	}
+}
+
+casacore::MeasurementSet& MSWriter::OpenMeasurementSet()
+{
+	if(!_isInitialized)
+		initialize();
+	return _data->_ms;
+}
+
+void MSWriter::Flush()
+{
+	if(_isInitialized)
+		_data->_ms.flush();
 }
 
 void MSWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
 {
-	_data->_timeCol.put(_rowIndex, time);
-	_data->_timeCentroidCol.put(_rowIndex, timeCentroid);
-	_data->_antenna1Col.put(_rowIndex, antenna1);
-	_data->_antenna2Col.put(_rowIndex, antenna2);
-	_data->_dataDescIdCol.put(_rowIndex, 0);
-	
-	casacore::Vector<double> uvwVec(3);
-	uvwVec[0] = u; uvwVec[1] = v; uvwVec[2] = w;
-	_data->_uvwCol.put(_rowIndex, uvwVec);
-	
-	_data->_intervalCol.put(_rowIndex, interval);
-	_data->_exposureCol.put(_rowIndex, interval);
-	_data->_processorIdCol.put(_rowIndex, -1);
-	_data->_scanNumberCol.put(_rowIndex, 1);
-	_data->_stateIdCol.put(_rowIndex, -1);
-	
+	const size_t nChannels = _isChannelRange ? _rangeChannelCount : _bandInfo.channels.size();
+	writeRow(_dataDescId, nChannels, time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights);
+}
+
+void MSWriter::WriteWindowRow(size_t window, double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	if(!_hasRowWindows)
+		Writer::WriteWindowRow(window, time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights);
+	else
+		writeRow(window, _windows[window].channels.size(), time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights);
+}
+
+void MSWriter::writeRow(size_t dataDescId, size_t nChannels, double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
 	size_t nPol = 4;
 	
-	casacore::Vector<float> sigmaArr(nPol);
-	for(size_t p=0; p!=nPol; ++p) sigmaArr[p] = 1.0;
-	_data->_sigmaCol.put(_rowIndex, sigmaArr);
+	if(_updateExisting)
+	{
+		if(_data->_antenna1Col(_rowIndex) != int(antenna1) || _data->_antenna2Col(_rowIndex) != int(antenna2))
+			throw std::runtime_error("Rows written to " + _filename + " do not match the rows of the first pass");
+	}
+	else {
+		_data->_timeCol.put(_rowIndex, time);
+		_data->_timeCentroidCol.put(_rowIndex, timeCentroid);
+		_data->_antenna1Col.put(_rowIndex, antenna1);
+		_data->_antenna2Col.put(_rowIndex, antenna2);
+		_data->_dataDescIdCol.put(_rowIndex, dataDescId);
+		
+		casacore::Vector<double> uvwVec(3);
+		uvwVec[0] = u; uvwVec[1] = v; uvwVec[2] = w;
+		_data->_uvwCol.put(_rowIndex, uvwVec);
+		
+		_data->_intervalCol.put(_rowIndex, interval);
+		_data->_exposureCol.put(_rowIndex, interval);
+		_data->_processorIdCol.put(_rowIndex, -1);
+		_data->_scanNumberCol.put(_rowIndex, 1);
+		_data->_stateIdCol.put(_rowIndex, -1);
+		
+		casacore::Vector<float> sigmaArr(nPol);
+		for(size_t p=0; p!=nPol; ++p) sigmaArr[p] = 1.0;
+		_data->_sigmaCol.put(_rowIndex, sigmaArr);
+	}
 	
-	size_t valCount = _bandInfo.channels.size() * nPol;
-	casacore::IPosition shape(2, nPol, _bandInfo.channels.size());
+	size_t valCount = nChannels * nPol;
+	casacore::IPosition shape(2, nPol, nChannels);
 	casacore::Array<std::complex<float> > dataArr(shape);
 	casacore::Array<bool> flagArr(shape);
 	casacore::Array<float> weightSpectrumArr(shape);
@@ -536,18 +736,31 @@ void MSWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_
 		*weightSpectrumPtr = weights[i]; ++weightSpectrumPtr;
 	}
 	
+	// WEIGHT holds the sum over all channels, so later passes add to it
 	casacore::Vector<float> weightsArr(nPol);
-	for(size_t p=0; p!=nPol; ++p) weightsArr[p] = 0.0;
-	for(size_t ch=0; ch!=_bandInfo.channels.size(); ++ch)
+	if(_updateExisting)
+		weightsArr = _data->_weightCol(_rowIndex);
+	else
+		for(size_t p=0; p!=nPol; ++p) weightsArr[p] = 0.0;
+	for(size_t ch=0; ch!=nChannels; ++ch)
 	{
 		for(size_t p=0; p!=nPol; ++p)
 			weightsArr[p] += weights[ch*nPol + p];
 	}
 	
-	_data->_dataCol.put(_rowIndex, dataArr);
-	_data->_flagCol.put(_rowIndex, flagArr);
+	if(_isChannelRange)
+	{
+		casacore::Slicer slicer(casacore::IPosition(2, 0, _channelStart), shape);
+		_data->_dataCol.putSlice(_rowIndex, slicer, dataArr);
+		_data->_flagCol.putSlice(_rowIndex, slicer, flagArr);
+		_data->_weightSpectrumCol.putSlice(_rowIndex, slicer, weightSpectrumArr);
+	}
+	else {
+		_data->_dataCol.put(_rowIndex, dataArr);
+		_data->_flagCol.put(_rowIndex, flagArr);
+		_data->_weightSpectrumCol.put(_rowIndex, weightSpectrumArr);
+	}
 	_data->_weightCol.put(_rowIndex, weightsArr);
-	_data->_weightSpectrumCol.put(_rowIndex, weightSpectrumArr);
 	
 	++_rowIndex;
 }
@@ -4,17 +4,46 @@
 #include "writer.h"
 
 #include <complex>
+#include <mutex>
 #include <vector>
 #include <string>
 
+namespace casacore {
+	class MeasurementSet;
+}
+
 class MSWriter : public Writer
 {
 	public:
+		struct SpectralWindow
+		{
+			std::string name;
+			std::vector<ChannelInfo> channels;
+			double refFreq, totalBandwidth;
+		};
+		
 		MSWriter(const std::string& filename);
 		virtual ~MSWriter() final override;
 		
 		void EnableCompression(size_t dataBitRate, size_t weightBitRate, const std::string& distribution, double distTruncation, const std::string& normalization);
 		
+		/**
+		 * Write only a range of the channels of each row, so that a band can be written in several
+		 * passes. The band info given to WriteBandInfo() then describes the channels in the range,
+		 * whereas the full band is given here. The first pass creates the measurement set. Later passes
+		 * should set @p updateExisting, in which case the rows of the first pass are updated, and all
+		 * other tables are left as they are. All passes should therefore write the same rows in the same order.
+		 */
+		void SetChannelRange(size_t channelStart, bool updateExisting, const std::string& bandName, const std::vector<ChannelInfo>& bandChannels, double refFreq, double totalBandwidth);
+		
+		/**
+		 * Write the rows as one of several spectral windows, so that a band can be split over
+		 * measurement sets that are combined into one multi-window set afterwards. All windows
+		 * are written to the SPECTRAL_WINDOW and DATA_DESCRIPTION tables, so that all parts have
+		 * the same subtables, and the rows refer to window @p dataWindowIndex.
+		 */
+		void SetSpectralWindows(const std::vector<SpectralWindow>& windows, size_t dataWindowIndex);
+		
 		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override;
 		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override;
 		virtual void WritePolarizationForLinearPols(bool flagRow) final override;
@@ -23,9 +52,54 @@ class MSWriter : public Writer
 		virtual void WriteObservation(const ObservationInfo& observation) final override;
 		virtual void WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params) final override;
 		
+		/**
+		 * Continue writing an existing measurement set of which the first @p rowCount rows are
+		 * complete. The tables other than the main table are left as they are, and rows after
+		 * @p rowCount are overwritten.
+		 */
+		void SetResume(size_t rowCount);
+		
+		/**
+		 * Store the weights with the incremental storage manager, which only stores a value when it
+		 * differs from the previous row. This makes WEIGHT_SPECTRUM, WEIGHT and SIGMA take almost no
+		 * space when the weights are the same for every row, as is the case without averaging. Rows
+		 * with different weights, such as averaged rows with flagged samples, are simply stored.
+		 */
+		void SetUniformWeights() { _uniformWeights = true; }
+		
+		const std::string& Filename() const { return _filename; }
+		
+		/**
+		 * The measurement set as opened by the writer, so that it can be finished without
+		 * opening it again. All rows should have been written, and the writer should stay
+		 * alive while the set is used.
+		 */
+		casacore::MeasurementSet& OpenMeasurementSet();
+		
+		/**
+		 * Casacore keeps the open tables in a global cache and registers its storage managers
+		 * globally, so measurement sets that are written from several threads are created,
+		 * opened and closed with this mutex locked. Rows only change the state of their own
+		 * table, and are written to different sets concurrently. The mutex is recursive, so that
+		 * code that holds it can use writers that have not opened their set yet.
+		 */
+		static std::recursive_mutex& TableMutex()
+		{
+			static std::recursive_mutex mutex;
+			return mutex;
+		}
+		
 		virtual void AddRows(size_t count) final override;
+		virtual void Flush() final override;
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
 		
+		/**
+		 * Adds a window for rows with another channel resolution. The DATA, FLAG and
+		 * WEIGHT_SPECTRUM columns then have a variable shape, which Dysco does not support.
+		 */
+		virtual size_t AddSpectralWindow(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth) final override;
+		virtual void WriteWindowRow(size_t window, double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		
 		virtual bool CanWriteStatistics() const final override
 		{
 			return true;
@@ -35,19 +109,26 @@ class MSWriter : public Writer
 		void writePolarizationForLinearPols();
 		void writeFeedEntries();
 		void writeBandInfo();
+		void writeSpectralWindow(const SpectralWindow& window);
 		void writeAntennae();
 		void writeSource();
 		void writeField();
 		void writeObservation();
 		void writeHistoryItem();
 		void initialize();
+		void openExisting();
+		void openForResume();
+		void initializeColumns();
+		void writeRow(size_t dataDescId, size_t nChannels, double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights);
 		
 		class MSWriterData *_data;
 		bool _isInitialized;
 		size_t _rowIndex;
 		
 		std::string _filename;
-		bool _useDysco;
+		bool _useDysco, _uniformWeights;
+		bool _isChannelRange, _updateExisting, _isResuming, _hasRowWindows;
+		size_t _channelStart, _rangeChannelCount;
 		
 		std::vector<AntennaInfo> _antennae;
 		double _antennaDate;
@@ -60,6 +141,8 @@ class MSWriter : public Writer
 			double totalBandwidth;
 			bool flagRow;
 		} _bandInfo;
+		std::vector<SpectralWindow> _windows;
+		size_t _dataDescId;
 		
 		double _arrayX, _arrayY, _arrayZ;
 		SourceInfo _source;
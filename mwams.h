@@ -3,6 +3,10 @@
 
 #include <string>
 
+namespace casacore {
+	class MeasurementSet;
+}
+
 struct MWAMSEnums
 {
 	enum MWATables
@@ -56,6 +60,9 @@ class MWAMS
 		
 		MWAMS(const std::string &filename);
 		
+		/** Adds the MWA fields to a set that is already open, e.g. by MSWriter. */
+		explicit MWAMS(casacore::MeasurementSet& measurementSet);
+		
 		~MWAMS();
 		
 		void InitializeMWAFields()
@@ -0,0 +1,85 @@
+#include "numanodes.h"
+
+#include <cstdlib>
+#include <fstream>
+
+#include <pthread.h>
+#include <sched.h>
+
+NUMANodes::NUMANodes()
+{
+	cpu_set_t available;
+	CPU_ZERO(&available);
+	const bool hasAffinity = sched_getaffinity(0, sizeof(available), &available) == 0;
+	
+	// Node numbers need not be consecutive, so try a reasonable range
+	for(int node=0; node!=1024; ++node)
+	{
+		std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+		if(!file.good())
+			continue;
+		std::string line;
+		std::getline(file, line);
+		std::vector<int> cpus;
+		for(int cpu : ParseCPUList(line))
+		{
+			if(!hasAffinity || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &available)))
+				cpus.push_back(cpu);
+		}
+		if(!cpus.empty())
+		{
+			_nodeNumbers.push_back(node);
+			_nodeCPUs.emplace_back(std::move(cpus));
+		}
+	}
+	
+	if(_nodeCPUs.empty())
+	{
+		std::vector<int> cpus;
+		for(int cpu=0; cpu!=CPU_SETSIZE; ++cpu)
+		{
+			if(hasAffinity && CPU_ISSET(cpu, &available))
+				cpus.push_back(cpu);
+		}
+		_nodeNumbers.push_back(0);
+		_nodeCPUs.emplace_back(std::move(cpus));
+	}
+}
+
+bool NUMANodes::PinCurrentThread(size_t nodeIndex) const
+{
+	const std::vector<int>& cpus = _nodeCPUs[nodeIndex];
+	if(cpus.empty())
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(int cpu : cpus)
+		CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+std::vector<int> NUMANodes::ParseCPUList(const std::string& str)
+{
+	std::vector<int> cpus;
+	size_t pos = 0;
+	while(pos < str.size())
+	{
+		size_t end = str.find(',', pos);
+		if(end == std::string::npos)
+			end = str.size();
+		const std::string range = str.substr(pos, end-pos);
+		const size_t dash = range.find('-');
+		if(dash == std::string::npos)
+		{
+			if(!range.empty())
+				cpus.push_back(atoi(range.c_str()));
+		}
+		else {
+			const int first = atoi(range.substr(0, dash).c_str()), last = atoi(range.substr(dash+1).c_str());
+			for(int cpu=first; cpu<=last; ++cpu)
+				cpus.push_back(cpu);
+		}
+		pos = end+1;
+	}
+	return cpus;
+}
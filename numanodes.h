@@ -0,0 +1,40 @@
+#ifndef NUMA_NODES_H
+#define NUMA_NODES_H
+
+#include <string>
+#include <vector>
+
+/**
+ * Describes the NUMA nodes of the machine and the CPUs that belong to them, as far as
+ * they are available to this process. The topology is read from
+ * /sys/devices/system/node. When it is not available, all CPUs are
+ * placed in a single node.
+ */
+class NUMANodes
+{
+	public:
+		NUMANodes();
+		
+		size_t NodeCount() const { return _nodeCPUs.size(); }
+		
+		/** The (Linux) node number, as used by e.g. numactl. */
+		int NodeNumber(size_t nodeIndex) const { return _nodeNumbers[nodeIndex]; }
+		
+		const std::vector<int>& CPUs(size_t nodeIndex) const { return _nodeCPUs[nodeIndex]; }
+		
+		/**
+		 * Restricts the calling thread to the CPUs of the given node. Memory that is
+		 * first touched by the thread afterwards will be placed on that node.
+		 * @returns false if the affinity could not be set.
+		 */
+		bool PinCurrentThread(size_t nodeIndex) const;
+		
+		/** Parses a list like "0-3,8,10-11" as used in sysfs. */
+		static std::vector<int> ParseCPUList(const std::string& str);
+		
+	private:
+		std::vector<int> _nodeNumbers;
+		std::vector<std::vector<int>> _nodeCPUs;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef PACKED_FLAG_MASK_H
+#define PACKED_FLAG_MASK_H
+
+#include <aoflagger.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * A read-only flag mask, like aoflagger::FlagMask, that stores a single bit per
+ * sample instead of a byte. Each channel is stored as a row of 64-bit words, in
+ * which bit (x % 64) of word (x / 64) holds the flag of time step x. This takes
+ * 8 times less memory than a FlagMask, which is used to keep the flags of a chunk
+ * until they are written.
+ */
+class PackedFlagMask
+{
+	public:
+		PackedFlagMask() : _width(0), _height(0), _wordsPerRow(0) { }
+
+		explicit PackedFlagMask(const aoflagger::FlagMask& mask) :
+			_width(mask.Width()), _height(mask.Height()), _wordsPerRow((_width + 63) / 64),
+			_words(_wordsPerRow * _height, 0)
+		{
+			for(size_t y=0; y!=_height; ++y)
+				Pack(mask.Buffer() + y*mask.HorizontalStride(), _words.data() + y*_wordsPerRow, _width);
+		}
+
+		size_t Width() const { return _width; }
+		size_t Height() const { return _height; }
+
+		bool Value(size_t x, size_t y) const
+		{
+			return (_words[y*_wordsPerRow + x/64] >> (x%64)) & 1;
+		}
+
+		/**
+		 * Expands the flags of time step x into the row layout of the writer, in which
+		 * each channel has four polarizations: output[y*4 + p] is set to Value(x, y).
+		 */
+		void ExpandColumn(size_t x, bool* output) const
+		{
+			const uint64_t* wordPtr = _words.data() + x/64;
+			const size_t bit = x%64;
+			for(size_t y=0; y!=_height; ++y)
+			{
+				// Set the four polarizations with a single 32-bit store
+				const uint32_t flags = uint32_t((*wordPtr >> bit) & 1) * 0x01010101u;
+				memcpy(output + y*4, &flags, sizeof(flags));
+				wordPtr += _wordsPerRow;
+			}
+		}
+
+		/** Packs a row of boolean flags into ceil(width/64) words. */
+		static void Pack(const bool* flags, uint64_t* words, size_t width)
+		{
+			size_t x = 0;
+#ifdef __SSE2__
+			// Per 16 flags, move the comparison results of the bytes into 16 bits
+			const __m128i zero = _mm_setzero_si128();
+			for(; x+64 <= width; x+=64)
+			{
+				uint64_t word = 0;
+				for(size_t i=0; i!=4; ++i)
+				{
+					const __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(flags + x + i*16));
+					const uint64_t bits = uint16_t(~_mm_movemask_epi8(_mm_cmpeq_epi8(values, zero)));
+					word |= bits << (i*16);
+				}
+				words[x/64] = word;
+			}
+#endif
+			for(; x<width; x+=64)
+			{
+				uint64_t word = 0;
+				const size_t end = std::min<size_t>(width - x, 64);
+				for(size_t i=0; i!=end; ++i)
+					word |= uint64_t(flags[x+i] ? 1 : 0) << i;
+				words[x/64] = word;
+			}
+		}
+
+	private:
+		size_t _width, _height, _wordsPerRow;
+		std::vector<uint64_t> _words;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#include "readahead.h"
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+	// Requests are aligned to pages and split in parts of at most this size
+	const long long pageSize = 4096, maxRequestSize = 16*1024*1024;
+}
+
+Readahead::Readahead(size_t hdusAhead, size_t threadCount) :
+	_hdusAhead(hdusAhead),
+	_requests(1024)
+{
+	for(size_t i=0; i!=std::max<size_t>(1, threadCount); ++i)
+		_threads.emplace_back(&Readahead::threadFunc, this);
+}
+
+Readahead::~Readahead()
+{
+	_requests.write_end();
+	for(std::thread& t : _threads)
+		t.join();
+	for(int fd : _fds)
+	{
+		if(fd >= 0)
+			close(fd);
+	}
+}
+
+void Readahead::AddFile(const std::string& filename)
+{
+	// Failing to open is not an error: the file is then simply not read ahead
+	_fds.push_back(filename.empty() ? -1 : open(filename.c_str(), O_RDONLY));
+	_requestedUntil.push_back(0);
+}
+
+void Readahead::Advance(size_t fileIndex, long long hduStart, long long hduEnd)
+{
+	const int fd = _fds[fileIndex];
+	if(fd < 0 || hduEnd <= hduStart)
+		return;
+	
+	const long long
+		windowEnd = hduEnd + (long long) _hdusAhead * (hduEnd - hduStart),
+		end = ((windowEnd + pageSize - 1) / pageSize) * pageSize;
+	// When the reader moved backwards, e.g. because it was restarted, start over
+	if(_requestedUntil[fileIndex] > end)
+		_requestedUntil[fileIndex] = 0;
+	const long long start = (std::max(_requestedUntil[fileIndex], hduEnd) / pageSize) * pageSize;
+	
+	for(long long offset = start; offset < end; offset += maxRequestSize)
+		_requests.write(Request{fd, offset, std::min(maxRequestSize, end - offset)});
+	_requestedUntil[fileIndex] = end;
+}
+
+void Readahead::threadFunc()
+{
+	Request request;
+	while(_requests.read(request))
+	{
+#ifdef __linux__
+		readahead(request.fd, request.offset, request.length);
+#else
+		posix_fadvise(request.fd, request.offset, request.length, POSIX_FADV_WILLNEED);
+#endif
+	}
+}
@@ -0,0 +1,57 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include "lane.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Keeps the upcoming HDUs of a set of files in flight, so that a sequential reader does
+ * not have to wait on the storage latency of every HDU. The files are opened separately from
+ * the reader, and requests are made with readahead() (or posix_fadvise() when that is not
+ * available) from a few background threads. This only fills the page cache; the reader
+ * itself reads as before.
+ */
+class Readahead
+{
+	public:
+		/**
+		 * @param hdusAhead Number of HDUs following the current one to keep in flight per file.
+		 * @param threadCount Number of threads that issue the requests.
+		 */
+		Readahead(size_t hdusAhead, size_t threadCount);
+		~Readahead();
+		
+		/** Adds a file; its index is the order in which files are added. An empty filename
+		 * adds a placeholder for an unavailable file. */
+		void AddFile(const std::string& filename);
+		
+		/**
+		 * Called when the reader moves to an HDU of a file. Requests the following HDUs,
+		 * assuming they have the same size as this one.
+		 * @param hduStart Byte offset of the header of the current HDU.
+		 * @param hduEnd Byte offset of the end of the data of the current HDU.
+		 */
+		void Advance(size_t fileIndex, long long hduStart, long long hduEnd);
+		
+	private:
+		struct Request
+		{
+			int fd;
+			long long offset, length;
+		};
+		
+		Readahead(const Readahead&) = delete;
+		Readahead& operator=(const Readahead&) = delete;
+		void threadFunc();
+		
+		const size_t _hdusAhead;
+		std::vector<int> _fds;
+		std::vector<long long> _requestedUntil;
+		ao::lane<Request> _requests;
+		std::vector<std::thread> _threads;
+};
+
+#endif
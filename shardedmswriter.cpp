@@ -0,0 +1,150 @@
+#include "shardedmswriter.h"
+#include "mswriter.h"
+#include "threadedwriter.h"
+
+#include <casacore/tables/Tables/Table.h>
+
+#include <casacore/casa/Containers/Block.h>
+
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+ShardedMSWriter::ShardedMSWriter(const std::string& filename, size_t shardCount) :
+	_shardChannelCount(0)
+{
+	for(size_t i=0; i!=shardCount; ++i)
+	{
+		_filenames.push_back(ShardFilename(filename, i));
+		std::unique_ptr<MSWriter> msWriter(new MSWriter(_filenames.back()));
+		_msWriters.push_back(msWriter.get());
+		_shards.emplace_back(new ThreadedWriter(std::move(msWriter)));
+	}
+}
+
+ShardedMSWriter::~ShardedMSWriter()
+{
+}
+
+void ShardedMSWriter::EnableCompression(size_t dataBitRate, size_t weightBitRate, const std::string& distribution, double distTruncation, const std::string& normalization)
+{
+	for(MSWriter* msWriter : _msWriters)
+		msWriter->EnableCompression(dataBitRate, weightBitRate, distribution, distTruncation, normalization);
+}
+
+void ShardedMSWriter::SetUniformWeights()
+{
+	for(MSWriter* msWriter : _msWriters)
+		msWriter->SetUniformWeights();
+}
+
+std::string ShardedMSWriter::ShardFilename(const std::string& filename, size_t shardIndex)
+{
+	std::ostringstream str;
+	str << "-shard" << std::setw(2) << std::setfill('0') << shardIndex;
+	const size_t dotPos = filename.rfind('.');
+	const size_t slashPos = filename.rfind('/');
+	if(dotPos == std::string::npos || (slashPos != std::string::npos && dotPos < slashPos))
+		return filename + str.str();
+	else
+		return filename.substr(0, dotPos) + str.str() + filename.substr(dotPos);
+}
+
+void ShardedMSWriter::Combine(const std::vector<std::string>& shardFilenames, const std::string& filename)
+{
+	casacore::Block<casacore::String> names(shardFilenames.size());
+	for(size_t i=0; i!=shardFilenames.size(); ++i)
+		names[i] = shardFilenames[i];
+	casacore::Table concatenation(names);
+	concatenation.rename(filename, casacore::Table::New);
+}
+
+void ShardedMSWriter::WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow)
+{
+	if(channels.size() % _shards.size() != 0)
+		throw std::runtime_error("The number of channels can not be divided over the shards");
+	_shardChannelCount = channels.size() / _shards.size();
+
+	std::vector<MSWriter::SpectralWindow> windows(_shards.size());
+	for(size_t i=0; i!=_shards.size(); ++i)
+	{
+		MSWriter::SpectralWindow& window = windows[i];
+		std::ostringstream windowName;
+		windowName << name << '_' << i;
+		window.name = windowName.str();
+		window.channels.assign(channels.begin() + i*_shardChannelCount, channels.begin() + (i+1)*_shardChannelCount);
+		window.refFreq = 0.5 * (window.channels.front().chanFreq + window.channels.back().chanFreq);
+		window.totalBandwidth = totalBandwidth / _shards.size();
+	}
+	for(size_t i=0; i!=_shards.size(); ++i)
+	{
+		_msWriters[i]->SetSpectralWindows(windows, i);
+		_shards[i]->WriteBandInfo(windows[i].name, windows[i].channels, windows[i].refFreq, windows[i].totalBandwidth, flagRow);
+	}
+}
+
+void ShardedMSWriter::WriteAntennae(const std::vector<AntennaInfo>& antennae, double time)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->WriteAntennae(antennae, time);
+}
+
+void ShardedMSWriter::WritePolarizationForLinearPols(bool flagRow)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->WritePolarizationForLinearPols(flagRow);
+}
+
+void ShardedMSWriter::WriteSource(const SourceInfo& source)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->WriteSource(source);
+}
+
+void ShardedMSWriter::WriteField(const FieldInfo& field)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->WriteField(field);
+}
+
+void ShardedMSWriter::WriteObservation(const ObservationInfo& observation)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->WriteObservation(observation);
+}
+
+void ShardedMSWriter::WriteHistoryItem(const std::string& commandLine, const std::string& application, const std::vector<std::string>& params)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->WriteHistoryItem(commandLine, application, params);
+}
+
+void ShardedMSWriter::SetArrayLocation(double x, double y, double z)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->SetArrayLocation(x, y, z);
+}
+
+void ShardedMSWriter::AddRows(size_t count)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->AddRows(count);
+}
+
+void ShardedMSWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	// Each threaded writer copies its part of the row, and writes it while the
+	// next shard receives its part
+	const size_t shardValueCount = _shardChannelCount * 4;
+	for(size_t i=0; i!=_shards.size(); ++i)
+	{
+		const size_t offset = i * shardValueCount;
+		_shards[i]->WriteRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, data + offset, flags + offset, weights + offset);
+	}
+}
+
+void ShardedMSWriter::Flush()
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->Flush();
+}
@@ -0,0 +1,70 @@
+#ifndef SHARDED_MS_WRITER_H
+#define SHARDED_MS_WRITER_H
+
+#include "writer.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class MSWriter;
+
+/**
+ * Writes a band into several measurement sets ("shards") at the same time, each
+ * holding an equal part of the channels. Every shard has its own writer thread, so
+ * that the rows are written in parallel instead of by a single casacore table.
+ *
+ * Each shard stores its channels as a separate spectral window, while the subtables
+ * of all shards list all windows. After writing, @ref Combine() concatenates the
+ * shards into a virtual table that can be opened as a single multi-window set.
+ */
+class ShardedMSWriter : public Writer
+{
+	public:
+		ShardedMSWriter(const std::string& filename, size_t shardCount);
+		virtual ~ShardedMSWriter() final override;
+
+		void EnableCompression(size_t dataBitRate, size_t weightBitRate, const std::string& distribution, double distTruncation, const std::string& normalization);
+		/** See @ref MSWriter::SetUniformWeights(). */
+		void SetUniformWeights();
+
+		/** Name of a shard of a measurement set, e.g. "obs-shard01.ms" for "obs.ms". */
+		static std::string ShardFilename(const std::string& filename, size_t shardIndex);
+
+		/**
+		 * Makes a persistent concatenation of the shards with the given name. The
+		 * subtables of the first shard are used for the combined set.
+		 */
+		static void Combine(const std::vector<std::string>& shardFilenames, const std::string& filename);
+
+		const std::vector<std::string>& ShardFilenames() const { return _filenames; }
+		/** The writers of the shards; these are owned by this writer. */
+		const std::vector<MSWriter*>& ShardWriters() const { return _msWriters; }
+
+		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override;
+		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override;
+		virtual void WritePolarizationForLinearPols(bool flagRow) final override;
+		virtual void WriteSource(const SourceInfo& source) final override;
+		virtual void WriteField(const FieldInfo& field) final override;
+		virtual void WriteObservation(const ObservationInfo& observation) final override;
+		virtual void WriteHistoryItem(const std::string& commandLine, const std::string& application, const std::vector<std::string>& params) final override;
+		virtual void SetArrayLocation(double x, double y, double z) final override;
+
+		virtual void AddRows(size_t count) final override;
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		virtual void Flush() final override;
+
+		virtual bool CanWriteStatistics() const final override
+		{
+			return true;
+		}
+
+	private:
+		std::vector<std::string> _filenames;
+		// The threaded writers of the shards, and the measurement set writers they own
+		std::vector<std::unique_ptr<Writer>> _shards;
+		std::vector<MSWriter*> _msWriters;
+		size_t _shardChannelCount;
+};
+
+#endif
@@ -0,0 +1,278 @@
+#include "sharedmemoryring.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+	const char ringMagic[8] = { 'C', 'O', 'T', 'T', 'R', 'I', 'N', 'G' };
+
+	void* mapObject(int fd, size_t size, const std::string& name)
+	{
+		void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(address == MAP_FAILED)
+			throw std::runtime_error("Could not map shared memory " + name + ": " + strerror(errno));
+		return address;
+	}
+
+	bool isProcessAlive(int32_t pid)
+	{
+		return kill(pid, 0) == 0 || errno == EPERM;
+	}
+
+	// Locks the mutex of the ring for the lifetime of the object. When the other process
+	// died while holding it, the counters are still consistent, because they only change
+	// by single stores, so the mutex is marked consistent and the caller checks whether
+	// the other process is still alive.
+	class RingLock
+	{
+		public:
+			explicit RingLock(SharedMemoryRing::Header& header) : _mutex(header.mutex)
+			{
+				check(pthread_mutex_lock(&_mutex));
+			}
+			~RingLock()
+			{
+				pthread_mutex_unlock(&_mutex);
+			}
+			/** Waits for the condition to be signalled, or at most one second to poll the other process. */
+			void Wait(pthread_cond_t& condition)
+			{
+				timespec deadline;
+				clock_gettime(CLOCK_MONOTONIC, &deadline);
+				deadline.tv_sec += 1;
+				const int result = pthread_cond_timedwait(&condition, &_mutex, &deadline);
+				if(result != ETIMEDOUT)
+					check(result);
+			}
+		private:
+			void check(int result)
+			{
+				if(result == EOWNERDEAD)
+					pthread_mutex_consistent(&_mutex);
+				else if(result != 0)
+					throw std::runtime_error(std::string("Could not lock shared memory ring: ") + strerror(result));
+			}
+			pthread_mutex_t& _mutex;
+	};
+
+	/** Waits until isDone() returns true while the consumer frees slots, with the lock held. */
+	template<typename Condition>
+	void waitForConsumer(RingLock& lock, SharedMemoryRing::Header& header, const std::string& name, double timeout, Condition isDone)
+	{
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+		while(!isDone())
+		{
+			if(header.isConsumerDetached)
+				throw std::runtime_error("The consumer of shared memory " + name + " detached before reading all rows");
+			if(header.consumerPid != 0 && !isProcessAlive(header.consumerPid))
+				throw std::runtime_error("The consumer of shared memory " + name + " has stopped");
+			if(std::chrono::steady_clock::now() > deadline)
+			{
+				if(header.consumerPid == 0)
+					throw std::runtime_error("No consumer attached to shared memory " + name + " within " + std::to_string(timeout) + " s");
+				else
+					throw std::runtime_error("The consumer of shared memory " + name + " did not read a row within " + std::to_string(timeout) + " s");
+			}
+			lock.Wait(header.notFull);
+		}
+	}
+}
+
+size_t SharedMemoryRing::SlotSize(size_t valuesPerRow)
+{
+	const size_t size = sizeof(RowHeader) + valuesPerRow * (sizeof(std::complex<float>) + sizeof(float) + 1);
+	// Keep the doubles of the next slot aligned
+	return (size + 7) / 8 * 8;
+}
+
+SharedMemoryRing SharedMemoryRing::Create(const std::string& name, size_t channelCount, size_t antennaCount, size_t slotCount, const double* channelFrequencies, double consumerTimeout)
+{
+	SharedMemoryRing ring;
+	ring._name = name;
+	ring._size = ObjectSize(channelCount, slotCount);
+	ring._isOwner = true;
+	ring._consumerTimeout = consumerTimeout;
+
+	shm_unlink(name.c_str());
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if(fd < 0)
+		throw std::runtime_error("Could not create shared memory " + name + ": " + strerror(errno));
+	if(ftruncate(fd, ring._size) != 0)
+	{
+		close(fd);
+		shm_unlink(name.c_str());
+		throw std::runtime_error("Could not allocate " + std::to_string(ring._size) + " bytes of shared memory for " + name);
+	}
+	ring._header = static_cast<Header*>(mapObject(fd, ring._size, name));
+	close(fd);
+
+	// The new object is zero-filled, so isReady stays 0 until the header is complete
+	Header& header = *ring._header;
+	memcpy(header.magic, ringMagic, sizeof(ringMagic));
+	header.version = Version;
+	header.channelCount = channelCount;
+	header.antennaCount = antennaCount;
+	header.valuesPerRow = channelCount * 4;
+	header.slotCount = slotCount;
+	header.slotSize = SlotSize(channelCount * 4);
+	header.producerPid = getpid();
+	// The mutex stays usable when the other process dies while holding it
+	pthread_mutexattr_t mutexAttr;
+	pthread_mutexattr_init(&mutexAttr);
+	pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mutexAttr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&header.mutex, &mutexAttr);
+	pthread_mutexattr_destroy(&mutexAttr);
+	pthread_condattr_t condAttr;
+	pthread_condattr_init(&condAttr);
+	pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+	pthread_cond_init(&header.notFull, &condAttr);
+	pthread_cond_init(&header.notEmpty, &condAttr);
+	pthread_condattr_destroy(&condAttr);
+	memcpy(const_cast<double*>(ring.ChannelFrequencies()), channelFrequencies, channelCount * sizeof(double));
+	__atomic_store_n(&header.isReady, 1, __ATOMIC_RELEASE);
+	return ring;
+}
+
+SharedMemoryRing SharedMemoryRing::Open(const std::string& name, double timeoutSeconds)
+{
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeoutSeconds);
+	int fd = -1;
+	struct stat objectStatus;
+	for(;;)
+	{
+		if(fd < 0)
+			fd = shm_open(name.c_str(), O_RDWR, 0);
+		if(fd >= 0 && fstat(fd, &objectStatus) == 0 && size_t(objectStatus.st_size) >= sizeof(Header))
+		{
+			const Header* header = static_cast<const Header*>(mapObject(fd, sizeof(Header), name));
+			const bool isReady = __atomic_load_n(&header->isReady, __ATOMIC_ACQUIRE) != 0;
+			munmap(const_cast<Header*>(header), sizeof(Header));
+			if(isReady)
+				break;
+		}
+		if(std::chrono::steady_clock::now() > deadline)
+		{
+			if(fd >= 0)
+				close(fd);
+			throw std::runtime_error("Timeout while waiting for shared memory " + name);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	SharedMemoryRing ring;
+	ring._name = name;
+	ring._size = objectStatus.st_size;
+	ring._header = static_cast<Header*>(mapObject(fd, ring._size, name));
+	close(fd);
+	if(memcmp(ring._header->magic, ringMagic, sizeof(ringMagic)) != 0 || ring._header->version != Version)
+		throw std::runtime_error("Shared memory " + name + " does not hold a ring buffer of this version of Cotter");
+	
+	Header& header = *ring._header;
+	RingLock lock(header);
+	if(header.consumerPid != 0 && !header.isConsumerDetached && isProcessAlive(header.consumerPid))
+		throw std::runtime_error("Shared memory " + name + " already has a consumer");
+	header.consumerPid = getpid();
+	header.isConsumerDetached = 0;
+	ring._isConsumer = true;
+	pthread_cond_broadcast(&header.notFull);
+	return ring;
+}
+
+SharedMemoryRing::SharedMemoryRing(SharedMemoryRing&& source) :
+	_name(std::move(source._name)),
+	_header(source._header),
+	_size(source._size),
+	_isOwner(source._isOwner),
+	_isConsumer(source._isConsumer),
+	_consumerTimeout(source._consumerTimeout)
+{
+	source._header = nullptr;
+	source._isOwner = false;
+	source._isConsumer = false;
+}
+
+SharedMemoryRing::~SharedMemoryRing()
+{
+	if(_header)
+	{
+		// Tell the other process that this one is gone, so that it does not wait for it
+		try {
+			if((_isOwner && !_header->isFinished) || _isConsumer)
+			{
+				RingLock lock(*_header);
+				if(_isOwner)
+				{
+					_header->isAborted = 1;
+					pthread_cond_broadcast(&_header->notEmpty);
+				}
+				else {
+					_header->isConsumerDetached = 1;
+					pthread_cond_broadcast(&_header->notFull);
+				}
+			}
+		} catch(std::exception&) {
+		}
+		munmap(_header, _size);
+	}
+	if(_isOwner)
+		shm_unlink(_name.c_str());
+}
+
+unsigned char* SharedMemoryRing::BeginWrite()
+{
+	RingLock lock(*_header);
+	waitForConsumer(lock, *_header, _name, _consumerTimeout, [&]() {
+		return _header->writtenRows - _header->readRows != _header->slotCount;
+	});
+	return slot(_header->writtenRows);
+}
+
+void SharedMemoryRing::EndWrite()
+{
+	RingLock lock(*_header);
+	++_header->writtenRows;
+	pthread_cond_signal(&_header->notEmpty);
+}
+
+void SharedMemoryRing::Finish()
+{
+	RingLock lock(*_header);
+	_header->isFinished = 1;
+	pthread_cond_broadcast(&_header->notEmpty);
+	waitForConsumer(lock, *_header, _name, _consumerTimeout, [&]() {
+		return _header->readRows == _header->writtenRows;
+	});
+}
+
+const unsigned char* SharedMemoryRing::BeginRead()
+{
+	RingLock lock(*_header);
+	while(_header->readRows == _header->writtenRows && !_header->isFinished)
+	{
+		if(_header->isAborted || !isProcessAlive(_header->producerPid))
+			throw std::runtime_error("The producer of shared memory " + _name + " stopped before the end of the stream");
+		lock.Wait(_header->notEmpty);
+	}
+	if(_header->readRows == _header->writtenRows)
+		return nullptr;
+	return slot(_header->readRows);
+}
+
+void SharedMemoryRing::EndRead()
+{
+	RingLock lock(*_header);
+	++_header->readRows;
+	pthread_cond_signal(&_header->notFull);
+}
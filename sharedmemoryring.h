@@ -0,0 +1,129 @@
+#ifndef SHARED_MEMORY_RING_H
+#define SHARED_MEMORY_RING_H
+
+#include <complex>
+#include <cstddef>
+#include <string>
+
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * A ring buffer of visibility rows in POSIX shared memory, through which Cotter
+ * streams its output to a consumer process on the same node (see SharedMemoryWriter
+ * and the reference consumer shmconsumer).
+ *
+ * The shared memory object (shm_open() name, e.g. "/cotter") starts with a
+ * @ref SharedMemoryRing::Header, followed by the frequencies of the channels as
+ * doubles in Hz, followed by slotCount slots of slotSize bytes. Each slot holds one row:
+ * a @ref SharedMemoryRing::RowHeader, then valuesPerRow complex float visibilities,
+ * valuesPerRow float weights and valuesPerRow one-byte flags, where valuesPerRow
+ * is channelCount x 4 with the polarization changing fastest. All values are in the
+ * native byte order.
+ *
+ * Row i is stored in slot i % slotCount. The producer waits while the ring is full
+ * (writtenRows - readRows == slotCount) and the consumer waits while it is empty; both
+ * wait on the process-shared condition variables in the header, and update the
+ * counters with the robust mutex held. When all rows have been written, the producer
+ * sets isFinished and waits until the consumer has read every row before removing the
+ * object, so that a consumer that starts late still receives all rows. There can be
+ * only one consumer.
+ *
+ * The consumer stores its process id in consumerPid when it attaches and sets
+ * isConsumerDetached when it closes the ring. The producer fails when the consumer
+ * has detached or stopped, or when it had to wait longer than its timeout for a
+ * consumer to attach or to read a row. A producer that stops before the end of the
+ * stream sets isAborted, and the consumer also fails when the producer process with
+ * producerPid has stopped.
+ */
+class SharedMemoryRing
+{
+	public:
+		static const uint32_t Version = 2;
+
+		struct Header
+		{
+			char magic[8]; // "COTTRING"
+			uint32_t version;
+			uint32_t isReady; // set when the producer has initialized the header
+			uint64_t channelCount, antennaCount, valuesPerRow;
+			uint64_t slotCount, slotSize;
+			pthread_mutex_t mutex;
+			pthread_cond_t notFull, notEmpty;
+			uint64_t writtenRows, readRows;
+			uint32_t isFinished;
+			int32_t producerPid, consumerPid;
+			uint32_t isConsumerDetached, isAborted;
+		};
+
+		struct RowHeader
+		{
+			double time, timeCentroid, interval;
+			double u, v, w;
+			uint32_t antenna1, antenna2;
+		};
+
+		/**
+		 * Creates the shared memory object as producer; an existing object with the name is replaced.
+		 * @param consumerTimeout Seconds to wait for a consumer to attach or to free a slot.
+		 */
+		static SharedMemoryRing Create(const std::string& name, size_t channelCount, size_t antennaCount, size_t slotCount, const double* channelFrequencies, double consumerTimeout);
+
+		/** Opens an object made by the producer as its consumer, waiting at most timeoutSeconds for it to appear. */
+		static SharedMemoryRing Open(const std::string& name, double timeoutSeconds);
+
+		SharedMemoryRing(SharedMemoryRing&& source);
+		~SharedMemoryRing();
+
+		const Header& GetHeader() const { return *_header; }
+		const double* ChannelFrequencies() const { return reinterpret_cast<const double*>(_header + 1); }
+
+		/** Waits until a slot is free, and returns it to be filled by the producer. */
+		unsigned char* BeginWrite();
+		/** Publishes the slot returned by BeginWrite(). */
+		void EndWrite();
+		/**
+		 * Marks the end of the stream, and waits until the consumer has read all rows. When
+		 * the producer is destructed without finishing, the stream is marked as aborted.
+		 */
+		void Finish();
+
+		/** Waits for the next row and returns its slot, or nullptr when the stream has ended. */
+		const unsigned char* BeginRead();
+		/** Releases the slot returned by BeginRead() to the producer. */
+		void EndRead();
+
+		static size_t SlotSize(size_t valuesPerRow);
+		static size_t ObjectSize(size_t channelCount, size_t slotCount)
+		{
+			return sizeof(Header) + channelCount * sizeof(double) + slotCount * SlotSize(channelCount * 4);
+		}
+
+		static RowHeader& GetRowHeader(unsigned char* slot) { return *reinterpret_cast<RowHeader*>(slot); }
+		static const RowHeader& GetRowHeader(const unsigned char* slot) { return *reinterpret_cast<const RowHeader*>(slot); }
+		std::complex<float>* Data(unsigned char* slot) const { return reinterpret_cast<std::complex<float>*>(slot + sizeof(RowHeader)); }
+		const std::complex<float>* Data(const unsigned char* slot) const { return reinterpret_cast<const std::complex<float>*>(slot + sizeof(RowHeader)); }
+		float* Weights(unsigned char* slot) const { return reinterpret_cast<float*>(Data(slot) + _header->valuesPerRow); }
+		const float* Weights(const unsigned char* slot) const { return reinterpret_cast<const float*>(Data(slot) + _header->valuesPerRow); }
+		unsigned char* Flags(unsigned char* slot) const { return reinterpret_cast<unsigned char*>(Weights(slot) + _header->valuesPerRow); }
+		const unsigned char* Flags(const unsigned char* slot) const { return reinterpret_cast<const unsigned char*>(Weights(slot) + _header->valuesPerRow); }
+
+	private:
+		SharedMemoryRing() : _header(nullptr), _size(0), _isOwner(false), _isConsumer(false), _consumerTimeout(0.0) { }
+		SharedMemoryRing(const SharedMemoryRing&) = delete;
+		SharedMemoryRing& operator=(const SharedMemoryRing&) = delete;
+
+		unsigned char* slot(uint64_t row) const
+		{
+			unsigned char* slots = reinterpret_cast<unsigned char*>(_header) + sizeof(Header) + _header->channelCount * sizeof(double);
+			return slots + (row % _header->slotCount) * _header->slotSize;
+		}
+
+		std::string _name;
+		Header* _header;
+		size_t _size;
+		bool _isOwner, _isConsumer;
+		double _consumerTimeout;
+};
+
+#endif
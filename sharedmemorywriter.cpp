@@ -0,0 +1,60 @@
+#include "sharedmemorywriter.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+SharedMemoryWriter::SharedMemoryWriter(const std::string& name, size_t ringSize, double consumerTimeout) :
+	_name(name),
+	_ringSize(ringSize),
+	_antennaCount(0),
+	_consumerTimeout(consumerTimeout)
+{
+}
+
+SharedMemoryWriter::~SharedMemoryWriter()
+{
+}
+
+void SharedMemoryWriter::Finish()
+{
+	if(_ring)
+	{
+		std::cout << "Waiting until the consumer of " << _name << " has read all rows...\n";
+		_ring->Finish();
+	}
+}
+
+void SharedMemoryWriter::WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow)
+{
+	if(_ring)
+		throw std::runtime_error("Shared memory " + _name + " can only receive a single band");
+	std::vector<double> frequencies(channels.size());
+	for(size_t ch=0; ch!=channels.size(); ++ch)
+		frequencies[ch] = channels[ch].chanFreq;
+	const size_t slotCount = std::max<size_t>(1, _ringSize / SharedMemoryRing::SlotSize(channels.size() * 4));
+	_ring.reset(new SharedMemoryRing(SharedMemoryRing::Create(_name, channels.size(), _antennaCount, slotCount, frequencies.data(), _consumerTimeout)));
+	std::cout << "Streaming rows to shared memory " << _name << " (" << slotCount << " rows in ring).\n";
+}
+
+void SharedMemoryWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	const size_t values = _ring->GetHeader().valuesPerRow;
+	unsigned char* slot = _ring->BeginWrite();
+	SharedMemoryRing::RowHeader& row = SharedMemoryRing::GetRowHeader(slot);
+	row.time = time;
+	row.timeCentroid = timeCentroid;
+	row.interval = interval;
+	row.u = u;
+	row.v = v;
+	row.w = w;
+	row.antenna1 = antenna1;
+	row.antenna2 = antenna2;
+	memcpy(_ring->Data(slot), data, values * sizeof(std::complex<float>));
+	memcpy(_ring->Weights(slot), weights, values * sizeof(float));
+	unsigned char* slotFlags = _ring->Flags(slot);
+	for(size_t i=0; i!=values; ++i)
+		slotFlags[i] = flags[i] ? 1 : 0;
+	_ring->EndWrite();
+}
@@ -0,0 +1,54 @@
+#ifndef SHARED_MEMORY_WRITER_H
+#define SHARED_MEMORY_WRITER_H
+
+#include "sharedmemoryring.h"
+#include "writer.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Streams the rows into a shared memory ring buffer, from which a process on the same
+ * node can read them while Cotter runs, instead of reading them back from a
+ * measurement set. See @ref SharedMemoryRing for the layout and protocol. Writing
+ * blocks while the ring is full, at most for the consumer timeout. After the last row,
+ * Finish() waits until the consumer has read all rows; a writer that is destructed
+ * without finishing marks the stream as aborted. Only the rows and the channel
+ * frequencies are published; other metadata is not.
+ */
+class SharedMemoryWriter : public Writer
+{
+	public:
+		/**
+		 * @param ringSize Approximate size of the ring in bytes.
+		 * @param consumerTimeout Seconds to wait for a consumer to attach or to read a row.
+		 */
+		SharedMemoryWriter(const std::string& name, size_t ringSize, double consumerTimeout);
+		virtual ~SharedMemoryWriter() final override;
+
+		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override;
+		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override
+		{
+			_antennaCount = antennae.size();
+		}
+		virtual void WritePolarizationForLinearPols(bool flagRow) final override { }
+		virtual void WriteSource(const SourceInfo& source) final override { }
+		virtual void WriteField(const FieldInfo& field) final override { }
+		virtual void WriteObservation(const ObservationInfo& observation) final override { }
+		virtual void WriteHistoryItem(const std::string& commandLine, const std::string& application, const std::vector<std::string>& params) final override { }
+
+		virtual void AddRows(size_t count) final override { }
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+
+		/** Ends the stream after the last row, and waits until the consumer has read all rows. */
+		void Finish();
+
+	private:
+		std::string _name;
+		size_t _ringSize, _antennaCount;
+		double _consumerTimeout;
+		std::unique_ptr<SharedMemoryRing> _ring;
+};
+
+#endif
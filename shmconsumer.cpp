@@ -0,0 +1,166 @@
+#include "sharedmemoryring.h"
+#include "sharedmemorywriter.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+	struct ConsumeResult
+	{
+		size_t rowCount, flaggedCount, valueCount, errorCount;
+		double seconds;
+		size_t bytes;
+	};
+
+	/**
+	 * Reads all rows from the ring. When verify is set, the rows should be those of
+	 * produceRows(), and rows with unexpected values are counted as errors.
+	 */
+	ConsumeResult consume(const std::string& name, double timeout, bool verify)
+	{
+		SharedMemoryRing ring = SharedMemoryRing::Open(name, timeout);
+		const SharedMemoryRing::Header& header = ring.GetHeader();
+		std::cout << "Attached to " << name << ": " << header.channelCount << " channels";
+		if(header.channelCount != 0)
+			std::cout << " from " << ring.ChannelFrequencies()[0]*1e-6 << " MHz";
+		std::cout << ", " << header.antennaCount << " antennas, " << header.slotCount << " slots.\n";
+
+		ConsumeResult result = ConsumeResult();
+		const auto start = std::chrono::steady_clock::now();
+		while(const unsigned char* slot = ring.BeginRead())
+		{
+			const SharedMemoryRing::RowHeader& row = SharedMemoryRing::GetRowHeader(slot);
+			const unsigned char* flags = ring.Flags(slot);
+			for(size_t i=0; i!=header.valuesPerRow; ++i)
+				result.flaggedCount += flags[i];
+			if(verify)
+			{
+				const std::complex<float> expected(float(result.rowCount), float(row.antenna2));
+				if(size_t(row.time) != result.rowCount || ring.Data(slot)[header.valuesPerRow-1] != expected)
+					++result.errorCount;
+			}
+			ring.EndRead();
+			++result.rowCount;
+		}
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		result.valueCount = result.rowCount * header.valuesPerRow;
+		result.bytes = result.rowCount * header.slotSize;
+		return result;
+	}
+
+	/** Writes synthetic rows through a SharedMemoryWriter, as Cotter would. */
+	void produceRows(const std::string& name, size_t channelCount, size_t rowCount, size_t ringSize)
+	{
+		SharedMemoryWriter writer(name, ringSize, 10.0);
+		writer.WriteAntennae(std::vector<Writer::AntennaInfo>(128), 0.0);
+		std::vector<Writer::ChannelInfo> channels(channelCount);
+		for(size_t ch=0; ch!=channelCount; ++ch)
+			channels[ch].chanFreq = 167e6 + ch*10e3;
+		writer.WriteBandInfo("benchmark", channels, 167e6, channelCount*10e3, false);
+
+		const size_t valueCount = channelCount * 4;
+		std::vector<std::complex<float>> data(valueCount);
+		std::unique_ptr<bool[]> flags(new bool[valueCount]);
+		std::vector<float> weights(valueCount, 1.0);
+		for(size_t i=0; i!=valueCount; ++i)
+			flags[i] = (i % 64 == 0);
+		for(size_t row=0; row!=rowCount; ++row)
+		{
+			const size_t antenna1 = row % 128, antenna2 = (row / 128) % 128;
+			data[valueCount-1] = std::complex<float>(float(row), float(antenna2));
+			writer.WriteRow(row, row, antenna1, antenna2, 1.0, 2.0, 3.0, 1.0, data.data(), flags.get(), weights.data());
+		}
+		writer.Finish();
+	}
+
+	int benchmark(size_t channelCount, size_t rowCount, size_t ringSize)
+	{
+		const std::string name = "/cotter-benchmark-" + std::to_string(getpid());
+		std::cout << "Streaming " << rowCount << " rows of " << channelCount << " channels through " << name << "...\n";
+		pid_t producer = fork();
+		if(producer < 0)
+		{
+			std::cerr << "Could not start the producer process\n";
+			return 1;
+		}
+		if(producer == 0)
+		{
+			try {
+				produceRows(name, channelCount, rowCount, ringSize);
+			} catch(std::exception& e) {
+				std::cerr << "Producer: " << e.what() << '\n';
+				_exit(1);
+			}
+			_exit(0);
+		}
+
+		ConsumeResult result;
+		try {
+			result = consume(name, 10.0, true);
+		} catch(std::exception& e) {
+			// Stop the producer, which may be waiting for the ring, and remove what it leaves
+			std::cerr << "Consumer: " << e.what() << '\n';
+			kill(producer, SIGTERM);
+			waitpid(producer, nullptr, 0);
+			shm_unlink(name.c_str());
+			return 1;
+		}
+		int status = 0;
+		waitpid(producer, &status, 0);
+		std::cout << "Read " << result.rowCount << " rows (" << result.bytes/(1024.0*1024.0) << " MiB) in " << result.seconds << " s: "
+			<< result.rowCount/result.seconds << " rows/s, " << result.bytes/(1024.0*1024.0)/result.seconds << " MiB/s.\n";
+		if(result.rowCount != rowCount || result.errorCount != 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			std::cout << "FAILED: expected " << rowCount << " rows, " << result.errorCount << " rows had unexpected values.\n";
+			return 1;
+		}
+		std::cout << "All rows were received correctly.\n";
+		return 0;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		std::cout <<
+			"shmconsumer is the reference consumer of the shared memory output of Cotter, which is written when\n"
+			"the output name starts with 'shm:'. It reads all rows and reports their number and the fraction of\n"
+			"flagged values. See sharedmemoryring.h for the layout of the shared memory.\n\n"
+			"Syntax: shmconsumer <name> [timeout in s]\n"
+			"   e.g. 'cotter -o shm:/cotter ...' and 'shmconsumer /cotter'.\n"
+			"Or:     shmconsumer -benchmark [channels] [rows] [ring size in MB]\n"
+			"   measures the throughput by streaming synthetic rows from a child process on this machine.\n";
+		return -1;
+	}
+	try {
+		const std::string firstArgument = argv[1];
+		if(firstArgument == "-benchmark")
+		{
+			const size_t
+				channelCount = argc > 2 ? atoi(argv[2]) : 768,
+				rowCount = argc > 3 ? atoi(argv[3]) : 100000,
+				ringSize = (argc > 4 ? atoi(argv[4]) : 256) * size_t(1024*1024);
+			return benchmark(channelCount, rowCount, ringSize);
+		}
+		else {
+			const double timeout = argc > 2 ? atof(argv[2]) : 60.0;
+			ConsumeResult result = consume(firstArgument, timeout, false);
+			std::cout << "Read " << result.rowCount << " rows in " << result.seconds << " s; "
+				<< (result.valueCount == 0 ? 0.0 : 100.0 * result.flaggedCount / result.valueCount) << "% of the values are flagged.\n";
+		}
+	} catch(std::exception& e) {
+		std::cerr << e.what() << '\n';
+		return 1;
+	}
+	return 0;
+}
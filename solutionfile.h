@@ -4,6 +4,7 @@
 #include <cstring>
 #include <string>
 #include <fstream>
+#include <sstream>
 #include <complex>
 #include <stdexcept>
 #include <vector>
@@ -47,7 +48,7 @@ class SolutionFile
 	/** Empty constructor. After constructing, either @ref OpenForReading() should be called or the parameters should
 	 * be initialized and @ref OpenForWriting() or @ref OpenInMemory() should be called.
 	 */
-  SolutionFile() : _outputStream(0), _inputStream(0), _readPointer(nullptr)
+  SolutionFile() : _outputStream(0), _inputStream(0), _readPointer(nullptr), _startTime(0.0), _endTime(0.0)
   {
     strcpy(_header.intro, "MWAOCAL");
     _header.fileType = 0; // Complex jones solutions
@@ -86,6 +87,16 @@ class SolutionFile
 		_header.intervalCount = intervalCount;
 	}
 
+	/** Start time of the first solution interval, in the same units as the TIME column of
+	 * the measurement set that was calibrated. Intervals are of equal length and together span
+	 * the range from @ref StartTime() to @ref EndTime(). */
+	double StartTime() const { return _startTime; }
+	void SetStartTime(double startTime) { _startTime = startTime; }
+
+	/** End time of the last solution interval. */
+	double EndTime() const { return _endTime; }
+	void SetEndTime(double endTime) { _endTime = endTime; }
+
 	/** Open a new file on disk for writing. After calling this method,
 	 * data can be appended with the @ref WriteSolution() method.
 	 * @param filename Name of file to write.
@@ -97,9 +108,8 @@ class SolutionFile
 		_data.clear();
 		
 		_outputStream->write(reinterpret_cast<const char*>(&_header), sizeof(_header));
-		double timeStart = 0.0, timeEnd = 0.0;
-		_outputStream->write(reinterpret_cast<const char*>(&timeStart), sizeof(timeStart));
-		_outputStream->write(reinterpret_cast<const char*>(&timeEnd), sizeof(timeEnd)); 
+		_outputStream->write(reinterpret_cast<const char*>(&_startTime), sizeof(_startTime));
+		_outputStream->write(reinterpret_cast<const char*>(&_endTime), sizeof(_endTime)); 
   }
   
   /** Open a file for writing and reading. This allows a calibration algorithm to use this class
@@ -124,20 +134,77 @@ class SolutionFile
 	void OpenForReading(const char *filename)
 	{
 		delete _inputStream;
-		_inputStream = new std::ifstream(filename);
-		if(_inputStream->bad())
+		_inputStream = new std::ifstream(filename, std::ios::in | std::ios::binary);
+		if(!_inputStream->good())
 			throw std::runtime_error("Error reading input solutions file");
 		_inputStream->read(reinterpret_cast<char*>(&_header), sizeof(_header));
-		double timeStart, timeEnd;
-		_inputStream->read(reinterpret_cast<char*>(&timeStart), sizeof(timeStart));
-		_inputStream->read(reinterpret_cast<char*>(&timeEnd), sizeof(timeEnd)); 
+		_inputStream->read(reinterpret_cast<char*>(&_startTime), sizeof(_startTime));
+		_inputStream->read(reinterpret_cast<char*>(&_endTime), sizeof(_endTime)); 
 		if(_inputStream->bad())
 			throw std::runtime_error("Error reading header from solutions file");
 	}
 
+	/** Total number of complex values in the file, i.e. nIntervals * nAntennas * nChannels * nPols. */
+	size_t SolutionCount() const
+	{
+		return size_t(_header.intervalCount) * _header.antennaCount * _header.channelCount * _header.polarizationCount;
+	}
+
+	/** Read all solutions from the file with a single read. This method should be called directly after
+	 * @ref OpenForReading(), instead of calling @ref ReadNextSolution(). The size of the file is checked
+	 * against the header before reading.
+	 * @param destination Array of at least @ref SolutionCount() elements, which will be filled in the
+	 * same order as the file (see the class description).
+	 */
+	void ReadAllSolutions(std::complex<double>* destination)
+	{
+		if(_inputStream == 0)
+			throw std::runtime_error("ReadAllSolutions() called on a solution file that was not opened for reading");
+		const std::streamoff payloadStart = _inputStream->tellg();
+		_inputStream->seekg(0, std::ios::end);
+		const std::streamoff payloadSize = _inputStream->tellg() - payloadStart;
+		const std::streamoff expectedSize = SolutionCount() * sizeof(std::complex<double>);
+		if(payloadSize != expectedSize)
+		{
+			std::ostringstream s;
+			s << "Solution file has an unexpected size: header specifies " << _header.intervalCount << " intervals, "
+				<< _header.antennaCount << " antennas, " << _header.channelCount << " channels and " << _header.polarizationCount
+				<< " polarizations, which requires " << expectedSize << " bytes of solutions, but the file holds " << payloadSize << " bytes.";
+			throw std::runtime_error(s.str());
+		}
+		_inputStream->seekg(payloadStart, std::ios::beg);
+		_inputStream->read(reinterpret_cast<char*>(destination), expectedSize);
+		if(!_inputStream->good())
+			throw std::runtime_error("Error reading solutions from solutions file");
+	}
+
+	/** Read all solutions into memory with a single read. Afterwards, the solutions can be accessed
+	 * directly with @ref Solutions() or @ref Solution(). @ref ReadNextSolution() will keep working,
+	 * and will then return the values from memory.
+	 */
+	void ReadAllSolutions()
+	{
+		_data.resize(SolutionCount());
+		ReadAllSolutions(_data.data());
+		delete _inputStream;
+		_inputStream = 0;
+		_readPointer = _data.data();
+	}
+
+	/** Array of all solutions, ordered as in the file. Only available after the solutions were
+	 * read with @ref ReadAllSolutions() or when the file was opened in memory. */
+	const std::complex<double>* Solutions() const { return _data.data(); }
+
+	/** Solution for a single interval, antenna, channel and polarization. Only available after
+	 * the solutions were read with @ref ReadAllSolutions() or when the file was opened in memory. */
+	const std::complex<double>& Solution(size_t interval, size_t antenna, size_t channel, size_t polarization) const
+	{
+		return _data[((interval * _header.antennaCount + antenna) * _header.channelCount + channel) * _header.polarizationCount + polarization];
+	}
+
 	/** Read a complex solution from the file.
 	 * This method should be called nIntervals * nAntennas * nChannels * nPols(=4) times. Four reads 
-	 * will give one Jones matrix.
+	 * will give one Jones matrix. For large files, @ref ReadAllSolutions() is considerably faster.
 	 */
   std::complex<double> ReadNextSolution() {
 		if(_inputStream == 0)
@@ -181,6 +248,7 @@ class SolutionFile
   std::ifstream *_inputStream;
 	std::vector<std::complex<double> > _data;
 	std::complex<double>* _readPointer;
+	double _startTime, _endTime;
 };
 
 #endif
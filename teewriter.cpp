@@ -0,0 +1,126 @@
+#include "teewriter.h"
+#include "geometry.h"
+
+#include <cmath>
+
+void TeeWriter::FinishAlignedBranches()
+{
+	for(size_t i=0; i!=_branches.size(); ++i)
+	{
+		if(_isActive[i] && _branches[i]->IsTimeAligned(0, 0))
+			_isActive[i] = false;
+	}
+}
+
+void TeeWriter::SetArrayLocation(double x, double y, double z)
+{
+	_arrayX = x;
+	_arrayY = y;
+	_arrayZ = z;
+	for(std::unique_ptr<Writer>& branch : _branches)
+		branch->SetArrayLocation(x, y, z);
+}
+
+void TeeWriter::SetOffsetsPerGPUBox(const std::vector<int>& offsets)
+{
+	for(std::unique_ptr<Writer>& branch : _branches)
+		branch->SetOffsetsPerGPUBox(offsets);
+}
+
+void TeeWriter::WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow)
+{
+	for(std::unique_ptr<Writer>& branch : _branches)
+		branch->WriteBandInfo(name, channels, refFreq, totalBandwidth, flagRow);
+}
+
+void TeeWriter::WriteAntennae(const std::vector<AntennaInfo>& antennae, double time)
+{
+	// Undo the rotation and offset of Cotter::writeAntennae() for branches with local positions
+	std::vector<AntennaInfo> localAntennae(antennae);
+	const double longitude = atan2(_arrayY, _arrayX);
+	for(AntennaInfo& antenna : localAntennae)
+	{
+		antenna.x -= _arrayX;
+		antenna.y -= _arrayY;
+		antenna.z -= _arrayZ;
+		Geometry::Rotate(-longitude, antenna.x, antenna.y);
+	}
+	for(std::unique_ptr<Writer>& branch : _branches)
+		branch->WriteAntennae(branch->AreAntennaPositionsLocal() ? localAntennae : antennae, time);
+}
+
+void TeeWriter::WritePolarizationForLinearPols(bool flagRow)
+{
+	for(std::unique_ptr<Writer>& branch : _branches)
+		branch->WritePolarizationForLinearPols(flagRow);
+}
+
+void TeeWriter::WriteSource(const SourceInfo& source)
+{
+	for(std::unique_ptr<Writer>& branch : _branches)
+		branch->WriteSource(source);
+}
+
+void TeeWriter::WriteField(const FieldInfo& field)
+{
+	for(std::unique_ptr<Writer>& branch : _branches)
+		branch->WriteField(field);
+}
+
+void TeeWriter::WriteObservation(const ObservationInfo& observation)
+{
+	for(std::unique_ptr<Writer>& branch : _branches)
+		branch->WriteObservation(observation);
+}
+
+void TeeWriter::WriteHistoryItem(const std::string& commandLine, const std::string& application, const std::vector<std::string>& params)
+{
+	for(std::unique_ptr<Writer>& branch : _branches)
+		branch->WriteHistoryItem(commandLine, application, params);
+}
+
+void TeeWriter::AddRows(size_t count)
+{
+	for(size_t i=0; i!=_branches.size(); ++i)
+	{
+		if(_isActive[i])
+			_branches[i]->AddRows(count);
+	}
+}
+
+void TeeWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	// The threaded writers of the branches copy the row, so that the next branch
+	// receives it while the previous ones are writing
+	for(size_t i=0; i!=_branches.size(); ++i)
+	{
+		if(_isActive[i])
+			_branches[i]->WriteRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights);
+	}
+}
+
+void TeeWriter::Flush()
+{
+	for(std::unique_ptr<Writer>& branch : _branches)
+		branch->Flush();
+}
+
+bool TeeWriter::IsTimeAligned(size_t antenna1, size_t antenna2)
+{
+	for(size_t i=0; i!=_branches.size(); ++i)
+	{
+		if(_isActive[i] && !_branches[i]->IsTimeAligned(antenna1, antenna2))
+			return false;
+	}
+	return true;
+}
+
+bool TeeWriter::CanWriteStatistics() const
+{
+	for(const std::unique_ptr<Writer>& branch : _branches)
+	{
+		if(branch->CanWriteStatistics())
+			return true;
+	}
+	return false;
+}
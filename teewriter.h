@@ -0,0 +1,63 @@
+#ifndef TEE_WRITER_H
+#define TEE_WRITER_H
+
+#include "writer.h"
+
+#include <memory>
+#include <vector>
+
+/**
+ * Writes the same rows to several writer chains ("branches"), so that e.g. a
+ * measurement set, a uvfits file and flag files are produced from a single read
+ * and flagging pass. Each branch can have its own averaging and output format, and
+ * should have a ThreadedWriter as outer writer, so that the branches write in
+ * parallel and the slowest branch sets the pace.
+ *
+ * The antenna positions are given to the tee in global coordinates; branches that
+ * write local positions (see @ref Writer::AreAntennaPositionsLocal()) receive them
+ * converted back to the local meridian.
+ */
+class TeeWriter : public Writer
+{
+	public:
+		TeeWriter() : _arrayX(0.0), _arrayY(0.0), _arrayZ(0.0) { }
+		virtual ~TeeWriter() final override { }
+
+		void AddBranch(std::unique_ptr<Writer>&& branch)
+		{
+			_branches.emplace_back(std::move(branch));
+			_isActive.push_back(true);
+		}
+
+		/**
+		 * Stops writing rows to the branches that are currently aligned to their
+		 * averaging interval. This should be called after the last row with data, so that
+		 * the rows that align the other branches do not add a timestep to these.
+		 */
+		void FinishAlignedBranches();
+
+		virtual void SetArrayLocation(double x, double y, double z) final override;
+		virtual void SetOffsetsPerGPUBox(const std::vector<int>& offsets) final override;
+
+		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override;
+		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override;
+		virtual void WritePolarizationForLinearPols(bool flagRow) final override;
+		virtual void WriteSource(const SourceInfo& source) final override;
+		virtual void WriteField(const FieldInfo& field) final override;
+		virtual void WriteObservation(const ObservationInfo& observation) final override;
+		virtual void WriteHistoryItem(const std::string& commandLine, const std::string& application, const std::vector<std::string>& params) final override;
+
+		virtual void AddRows(size_t count) final override;
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		virtual void Flush() final override;
+
+		virtual bool IsTimeAligned(size_t antenna1, size_t antenna2) final override;
+		virtual bool CanWriteStatistics() const final override;
+
+	private:
+		std::vector<std::unique_ptr<Writer>> _branches;
+		std::vector<bool> _isActive;
+		double _arrayX, _arrayY, _arrayZ;
+};
+
+#endif
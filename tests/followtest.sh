@@ -0,0 +1,52 @@
+#!/bin/bash
+# Tests the follow mode of Cotter. gpuboxappender grows copies of the gpubox files while
+# Cotter follows them, and stops before the end of the observation, so that Cotter has to
+# detect the end by the follow timeout. The output should be identical to that of a normal
+# run on the complete copies: the same number of rows, and the scans after the end of the
+# files flagged instead of filled with earlier scans.
+#
+# Syntax: followtest.sh <cotter> <gpuboxappender> <data directory> [HDUs]
+# The data directory should hold the metafits file and the gpubox files of one observation,
+# which should have more scans than the number of HDUs that are appended (default 8).
+
+set -e
+
+cotter="$1"
+appender="$2"
+data="$3"
+hdus="${4:-8}"
+metafits=$(ls "${data}"/*.metafits | head -n 1)
+gpuboxes=("${data}"/*gpubox*.fits)
+
+work=$(mktemp -d)
+appenderPid=
+trap '[ -n "${appenderPid}" ] && kill ${appenderPid} 2>/dev/null; rm -rf "${work}"' EXIT
+mkdir "${work}/live"
+
+"${appender}" -stop ${hdus} 0.5 "${work}/live" "${gpuboxes[@]}" > "${work}/appender.log" &
+appenderPid=$!
+# The primary headers of all files have been written when the appender reports what it appends
+until grep -q Appending "${work}/appender.log"; do
+	kill -0 ${appenderPid}
+	sleep 0.1
+done
+
+options=(-norfi -nostats -m "${metafits}")
+"${cotter}" -follow 5 -followwindow 3 "${options[@]}" -o "${work}/follow.cvis" "${work}"/live/*gpubox*.fits
+wait ${appenderPid}
+appenderPid=
+"${cotter}" "${options[@]}" -o "${work}/reference.cvis" "${work}"/live/*gpubox*.fits
+
+followRows=$(grep '^rows ' "${work}/follow.cvis/header")
+referenceRows=$(grep '^rows ' "${work}/reference.cvis/header")
+if [ "${followRows}" != "${referenceRows}" ]; then
+	echo "FAILED: follow mode wrote ${followRows#rows } rows instead of ${referenceRows#rows }."
+	exit 1
+fi
+for column in time antennas uvw data flags weights; do
+	if ! cmp -s "${work}/follow.cvis/${column}" "${work}/reference.cvis/${column}"; then
+		echo "FAILED: column '${column}' written in follow mode differs from a normal run."
+		exit 1
+	fi
+done
+echo "Follow mode wrote the same ${referenceRows#rows } rows as a normal run."
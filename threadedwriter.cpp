@@ -7,6 +7,7 @@ ThreadedWriter::ThreadedWriter(std::unique_ptr<Writer>&& parentWriter) :
 	_isWriterReady(false),
 	_isBufferReady(false),
 	_isFinishing(false),
+	_bufferedWindow(0),
 	_bufferedData(0),
 	_bufferedFlags(0),
 	_bufferedWeights(0),
@@ -32,6 +33,7 @@ ThreadedWriter::~ThreadedWriter()
 void ThreadedWriter::WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow)
 {
 	_arraySize = channels.size() * 4;
+	_windowArraySizes.assign(1, _arraySize);
 	_bufferedData = new std::complex<float>[_arraySize];
 	_bufferedFlags = new bool[_arraySize];
 	_bufferedWeights = new float[_arraySize];
@@ -51,7 +53,32 @@ void ThreadedWriter::AddRows(size_t rowCount)
 	ParentWriter().AddRows(rowCount);
 }
 
+void ThreadedWriter::Flush()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	
+	// Wait until the last row has been written
+	while(!_isWriterReady || _isBufferReady)
+		_bufferChangeCondition.wait(lock);
+	
+	ParentWriter().Flush();
+}
+
+size_t ThreadedWriter::AddSpectralWindow(const std::string& name, const std::vector<Writer::ChannelInfo>& channels, double refFreq, double totalBandwidth)
+{
+	// The buffers hold a row of the band, which has the most channels
+	if(channels.size() * 4 > _arraySize)
+		throw std::runtime_error("A spectral window can not have more channels than the band");
+	_windowArraySizes.push_back(channels.size() * 4);
+	return ForwardingWriter::AddSpectralWindow(name, channels, refFreq, totalBandwidth);
+}
+
 void ThreadedWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	WriteWindowRow(0, time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights);
+}
+
+void ThreadedWriter::WriteWindowRow(size_t window, double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
 {
 	std::unique_lock<std::mutex> lock(_mutex);
 	
@@ -59,6 +86,8 @@ void ThreadedWriter::WriteRow(double time, double timeCentroid, size_t antenna1,
 	while(!_isWriterReady || _isBufferReady)
 		_bufferChangeCondition.wait(lock);
 	
+	const size_t arraySize = _windowArraySizes[window];
+	_bufferedWindow = window;
 	_bufferedTime = time;
 	_bufferedTimeCentroid = timeCentroid;
 	_bufferedAntenna1 = antenna1;
@@ -67,9 +96,9 @@ void ThreadedWriter::WriteRow(double time, double timeCentroid, size_t antenna1,
 	_bufferedV = v;
 	_bufferedW = w;
 	_bufferedInterval = interval;
-	memcpy(_bufferedData, data, _arraySize * sizeof(std::complex<float>));
-	memcpy(_bufferedFlags, flags, _arraySize * sizeof(bool));
-	memcpy(_bufferedWeights, weights, _arraySize * sizeof(float));
+	memcpy(_bufferedData, data, arraySize * sizeof(std::complex<float>));
+	memcpy(_bufferedFlags, flags, arraySize * sizeof(bool));
+	memcpy(_bufferedWeights, weights, arraySize * sizeof(float));
 	
 	_isBufferReady = true;
 	_bufferChangeCondition.notify_all();
@@ -93,7 +122,10 @@ void ThreadedWriter::writerThreadFunc()
 		{
 			lock.unlock();
 			
-			ParentWriter().WriteRow(_bufferedTime, _bufferedTimeCentroid, _bufferedAntenna1, _bufferedAntenna2, _bufferedU, _bufferedV, _bufferedW, _bufferedInterval, _bufferedData, _bufferedFlags, _bufferedWeights);
+			if(_bufferedWindow == 0)
+				ParentWriter().WriteRow(_bufferedTime, _bufferedTimeCentroid, _bufferedAntenna1, _bufferedAntenna2, _bufferedU, _bufferedV, _bufferedW, _bufferedInterval, _bufferedData, _bufferedFlags, _bufferedWeights);
+			else
+				ParentWriter().WriteWindowRow(_bufferedWindow, _bufferedTime, _bufferedTimeCentroid, _bufferedAntenna1, _bufferedAntenna2, _bufferedU, _bufferedV, _bufferedW, _bufferedInterval, _bufferedData, _bufferedFlags, _bufferedWeights);
 			
 			lock.lock();
 			_isBufferReady = false;
@@ -21,14 +21,23 @@ class ThreadedWriter : public ForwardingWriter
 		
 		virtual void AddRows(size_t rowCount) final override;
 		
+		virtual void Flush() final override;
+		
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
 		
+		virtual size_t AddSpectralWindow(const std::string& name, const std::vector<Writer::ChannelInfo>& channels, double refFreq, double totalBandwidth) final override;
+		
+		virtual void WriteWindowRow(size_t window, double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		
 	private:
 		std::condition_variable _bufferChangeCondition;
 		std::mutex _mutex;
 		bool _isWriterReady, _isBufferReady, _isFinishing;
 		
 		size_t _arraySize;
+		// Number of values per row of each spectral window
+		std::vector<size_t> _windowArraySizes;
+		size_t _bufferedWindow;
 		double _bufferedTime, _bufferedTimeCentroid;
 		size_t _bufferedAntenna1, _bufferedAntenna2;
 		double _bufferedU, _bufferedV, _bufferedW;
@@ -0,0 +1,338 @@
+#include "uvh5writer.h"
+#include "geometry.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+
+namespace {
+	// Target size of the chunks of the data datasets
+	const size_t maxChunkBytes = 4*1024*1024;
+
+	// The serial HDF5 library is not thread safe, and writers in different threads
+	// (e.g. branches of a TeeWriter) may write at the same time
+	std::mutex hdf5Mutex;
+
+	template<typename T>
+	T check(T result, const std::string& message)
+	{
+		if(result < 0)
+			throw std::runtime_error("HDF5 error: " + message);
+		return result;
+	}
+
+	/** Creates a dataset of rows with the given row shape, which can be extended along the rows. */
+	hid_t createRowDataset(hid_t group, const char* name, hid_t type, const std::vector<hsize_t>& rowShape, const std::vector<hsize_t>& chunkShape, int deflateLevel)
+	{
+		std::vector<hsize_t> dims(1, 0), maxDims(1, H5S_UNLIMITED);
+		dims.insert(dims.end(), rowShape.begin(), rowShape.end());
+		maxDims.insert(maxDims.end(), rowShape.begin(), rowShape.end());
+		hid_t space = check(H5Screate_simple(dims.size(), dims.data(), maxDims.data()), "could not create dataspace");
+		hid_t properties = check(H5Pcreate(H5P_DATASET_CREATE), "could not create property list");
+		check(H5Pset_chunk(properties, chunkShape.size(), chunkShape.data()), "could not set chunk size");
+		if(deflateLevel != 0)
+		{
+			check(H5Pset_shuffle(properties), "could not enable shuffle filter");
+			check(H5Pset_deflate(properties, deflateLevel), "could not enable deflate filter");
+		}
+		hid_t dataset = check(H5Dcreate2(group, name, type, space, H5P_DEFAULT, properties, H5P_DEFAULT), std::string("could not create dataset ") + name);
+		H5Pclose(properties);
+		H5Sclose(space);
+		return dataset;
+	}
+
+	/** Extends a row dataset and writes the rows in one hyperslab. */
+	void appendRows(hid_t dataset, hid_t memType, const void* values, size_t rowCount)
+	{
+		hid_t space = check(H5Dget_space(dataset), "could not get dataspace");
+		const int rank = H5Sget_simple_extent_ndims(space);
+		std::vector<hsize_t> dims(rank);
+		H5Sget_simple_extent_dims(space, dims.data(), nullptr);
+		H5Sclose(space);
+
+		std::vector<hsize_t> start(rank, 0), count(dims);
+		start[0] = dims[0];
+		count[0] = rowCount;
+		dims[0] += rowCount;
+		check(H5Dset_extent(dataset, dims.data()), "could not extend dataset");
+
+		space = check(H5Dget_space(dataset), "could not get dataspace");
+		check(H5Sselect_hyperslab(space, H5S_SELECT_SET, start.data(), nullptr, count.data(), nullptr), "could not select rows");
+		hid_t memSpace = check(H5Screate_simple(rank, count.data(), nullptr), "could not create dataspace");
+		check(H5Dwrite(dataset, memType, memSpace, space, H5P_DEFAULT, values), "could not write rows");
+		H5Sclose(memSpace);
+		H5Sclose(space);
+	}
+
+	/**
+	 * Writes a complete dataset. An existing dataset is overwritten in place, because
+	 * HDF5 does not reclaim the space of deleted datasets; it should have the same shape.
+	 * An empty dims gives a scalar.
+	 */
+	void writeDataset(hid_t group, const char* name, hid_t type, const std::vector<hsize_t>& dims, const void* values)
+	{
+		hid_t dataset;
+		if(check(H5Lexists(group, name, H5P_DEFAULT), "could not query dataset") > 0)
+		{
+			dataset = check(H5Dopen2(group, name, H5P_DEFAULT), std::string("could not open dataset ") + name);
+		}
+		else {
+			hid_t space = dims.empty() ?
+				check(H5Screate(H5S_SCALAR), "could not create dataspace") :
+				check(H5Screate_simple(dims.size(), dims.data(), nullptr), "could not create dataspace");
+			dataset = check(H5Dcreate2(group, name, type, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT), std::string("could not create dataset ") + name);
+			H5Sclose(space);
+		}
+		const herr_t result = H5Dwrite(dataset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, values);
+		H5Dclose(dataset);
+		check(result, std::string("could not write dataset ") + name);
+	}
+
+	void writeScalar(hid_t group, const char* name, int64_t value)
+	{
+		writeDataset(group, name, H5T_NATIVE_INT64, std::vector<hsize_t>(), &value);
+	}
+
+	void writeScalar(hid_t group, const char* name, double value)
+	{
+		writeDataset(group, name, H5T_NATIVE_DOUBLE, std::vector<hsize_t>(), &value);
+	}
+
+	/** Writes fixed-length strings, as numpy (and therefore pyuvdata) does. */
+	void writeStrings(hid_t group, const char* name, const std::vector<std::string>& values, bool isScalar)
+	{
+		size_t length = 1;
+		for(const std::string& value : values)
+			length = std::max(length, value.size());
+		std::vector<char> buffer(length * values.size(), 0);
+		for(size_t i=0; i!=values.size(); ++i)
+			std::copy(values[i].begin(), values[i].end(), buffer.begin() + i*length);
+		hid_t type = check(H5Tcopy(H5T_C_S1), "could not create string type");
+		H5Tset_size(type, length);
+		H5Tset_strpad(type, H5T_STR_NULLPAD);
+		writeDataset(group, name, type, isScalar ? std::vector<hsize_t>() : std::vector<hsize_t>(1, values.size()), buffer.data());
+		H5Tclose(type);
+	}
+
+	void writeString(hid_t group, const char* name, const std::string& value)
+	{
+		writeStrings(group, name, std::vector<std::string>(1, value), true);
+	}
+}
+
+UVH5Writer::UVH5Writer(const std::string& filename, int deflateLevel) :
+	_visData(-1), _flags(-1), _nsamples(-1),
+	_timeArray(-1), _integrationTime(-1), _uvwArray(-1), _ant1Array(-1), _ant2Array(-1),
+	_deflateLevel(deflateLevel),
+	_rowCount(0), _timeCount(0), _lastBlockTime(0.0), _isHeaderWritten(false),
+	_phaseCentreRA(0.0), _phaseCentreDec(0.0),
+	_arrayX(0.0), _arrayY(0.0), _arrayZ(0.0)
+{
+	std::lock_guard<std::mutex> lock(hdf5Mutex);
+	if(deflateLevel != 0 && (H5Zfilter_avail(H5Z_FILTER_DEFLATE) <= 0 || H5Zfilter_avail(H5Z_FILTER_SHUFFLE) <= 0))
+		throw std::runtime_error("The HDF5 library does not support the deflate filter, which is required for compressing " + filename);
+	_file = check(H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT), "could not create " + filename);
+	_headerGroup = check(H5Gcreate2(_file, "Header", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT), "could not create header group");
+	_dataGroup = check(H5Gcreate2(_file, "Data", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT), "could not create data group");
+
+	// pyuvdata requires complex values as a compound of "r" and "i", and booleans
+	// as the enum type of h5py
+	_complexType = check(H5Tcreate(H5T_COMPOUND, sizeof(std::complex<float>)), "could not create complex type");
+	H5Tinsert(_complexType, "r", 0, H5T_NATIVE_FLOAT);
+	H5Tinsert(_complexType, "i", sizeof(float), H5T_NATIVE_FLOAT);
+	_boolType = check(H5Tenum_create(H5T_NATIVE_INT8), "could not create bool type");
+	int8_t value = 0;
+	H5Tenum_insert(_boolType, "FALSE", &value);
+	value = 1;
+	H5Tenum_insert(_boolType, "TRUE", &value);
+}
+
+UVH5Writer::~UVH5Writer()
+{
+	// Errors are reported by the explicit Flush() after the last row; a destructor can not throw
+	try {
+		Flush();
+	} catch(std::exception& e) {
+		std::cerr << "Error while closing UVH5 file: " << e.what() << '\n';
+	}
+	std::lock_guard<std::mutex> lock(hdf5Mutex);
+	for(hid_t dataset : { _visData, _flags, _nsamples, _timeArray, _integrationTime, _uvwArray, _ant1Array, _ant2Array })
+	{
+		if(dataset >= 0)
+			H5Dclose(dataset);
+	}
+	H5Tclose(_boolType);
+	H5Tclose(_complexType);
+	H5Gclose(_dataGroup);
+	H5Gclose(_headerGroup);
+	H5Fclose(_file);
+}
+
+void UVH5Writer::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	if(_block.RowCount() != 0 && time != _block.time)
+	{
+		std::lock_guard<std::mutex> lock(hdf5Mutex);
+		writeBlock();
+	}
+	_block.time = time;
+	const size_t values = _channels.size() * 4;
+	_block.data.insert(_block.data.end(), data, data + values);
+	for(size_t i=0; i!=values; ++i)
+		_block.flags.push_back(flags[i] ? 1 : 0);
+	_block.nsamples.insert(_block.nsamples.end(), weights, weights + values);
+	_block.times.push_back(time / (60.0*60.0*24.0) + 2400000.5);
+	_block.intervals.push_back(interval);
+	_block.uvws.push_back(u);
+	_block.uvws.push_back(v);
+	_block.uvws.push_back(w);
+	_block.antenna1.push_back(antenna1);
+	_block.antenna2.push_back(antenna2);
+
+	const size_t antennaCount = std::max(_antennae.size(), std::max(antenna1, antenna2) + 1);
+	if(_isAntennaUsed.size() < antennaCount)
+	{
+		_isAntennaUsed.resize(antennaCount, false);
+		_isBaselineUsed.resize(antennaCount * antennaCount, false);
+	}
+	_isAntennaUsed[antenna1] = true;
+	_isAntennaUsed[antenna2] = true;
+	_isBaselineUsed[antenna1 * antennaCount + antenna2] = true;
+}
+
+void UVH5Writer::createDatasets(size_t rowsPerTimestep)
+{
+	const hsize_t
+		channelCount = _channels.size(),
+		valueBytes = 4 * sizeof(std::complex<float>),
+		chunkRows = std::max<hsize_t>(1, std::min<hsize_t>(rowsPerTimestep, maxChunkBytes / valueBytes)),
+		chunkChannels = std::max<hsize_t>(1, std::min<hsize_t>(channelCount, maxChunkBytes / (chunkRows * valueBytes)));
+	const std::vector<hsize_t>
+		dataShape{ 1, channelCount, 4 },
+		dataChunk{ chunkRows, 1, chunkChannels, 4 };
+	_visData = createRowDataset(_dataGroup, "visdata", _complexType, dataShape, dataChunk, _deflateLevel);
+	_flags = createRowDataset(_dataGroup, "flags", _boolType, dataShape, dataChunk, _deflateLevel);
+	_nsamples = createRowDataset(_dataGroup, "nsamples", H5T_NATIVE_FLOAT, dataShape, dataChunk, _deflateLevel);
+
+	const std::vector<hsize_t> rowChunk{ chunkRows }, uvwChunk{ chunkRows, 3 };
+	_timeArray = createRowDataset(_headerGroup, "time_array", H5T_NATIVE_DOUBLE, {}, rowChunk, 0);
+	_integrationTime = createRowDataset(_headerGroup, "integration_time", H5T_NATIVE_DOUBLE, {}, rowChunk, 0);
+	_uvwArray = createRowDataset(_headerGroup, "uvw_array", H5T_NATIVE_DOUBLE, { 3 }, uvwChunk, 0);
+	_ant1Array = createRowDataset(_headerGroup, "ant_1_array", H5T_NATIVE_INT32, {}, rowChunk, 0);
+	_ant2Array = createRowDataset(_headerGroup, "ant_2_array", H5T_NATIVE_INT32, {}, rowChunk, 0);
+}
+
+void UVH5Writer::writeBlock()
+{
+	const size_t rowCount = _block.RowCount();
+	if(rowCount == 0)
+		return;
+	if(_visData < 0)
+		createDatasets(rowCount);
+
+	appendRows(_visData, _complexType, _block.data.data(), rowCount);
+	appendRows(_flags, _boolType, _block.flags.data(), rowCount);
+	appendRows(_nsamples, H5T_NATIVE_FLOAT, _block.nsamples.data(), rowCount);
+	appendRows(_timeArray, H5T_NATIVE_DOUBLE, _block.times.data(), rowCount);
+	appendRows(_integrationTime, H5T_NATIVE_DOUBLE, _block.intervals.data(), rowCount);
+	appendRows(_uvwArray, H5T_NATIVE_DOUBLE, _block.uvws.data(), rowCount);
+	appendRows(_ant1Array, H5T_NATIVE_INT32, _block.antenna1.data(), rowCount);
+	appendRows(_ant2Array, H5T_NATIVE_INT32, _block.antenna2.data(), rowCount);
+
+	_rowCount += rowCount;
+	// A flush can split a timestep over two blocks
+	if(_timeCount == 0 || _block.time != _lastBlockTime)
+		++_timeCount;
+	_lastBlockTime = _block.time;
+
+	_block.data.clear();
+	_block.flags.clear();
+	_block.nsamples.clear();
+	_block.times.clear();
+	_block.intervals.clear();
+	_block.uvws.clear();
+	_block.antenna1.clear();
+	_block.antenna2.clear();
+}
+
+void UVH5Writer::writeHeader()
+{
+	if(_visData < 0)
+		createDatasets(std::max<size_t>(1, _antennae.size() * (_antennae.size() + 1) / 2));
+
+	// The counts grow with the rows; the other values are given before the first row
+	size_t antennaDataCount = std::count(_isAntennaUsed.begin(), _isAntennaUsed.end(), true);
+	size_t baselineCount = std::count(_isBaselineUsed.begin(), _isBaselineUsed.end(), true);
+	writeScalar(_headerGroup, "Nblts", int64_t(_rowCount));
+	writeScalar(_headerGroup, "Ntimes", int64_t(_timeCount));
+	writeScalar(_headerGroup, "Nbls", int64_t(baselineCount));
+	writeScalar(_headerGroup, "Nants_data", int64_t(antennaDataCount));
+	if(_isHeaderWritten)
+		return;
+	_isHeaderWritten = true;
+
+	double latitude, longitude, altitude;
+	Geometry::XYZ2Geodetic(_arrayX, _arrayY, _arrayZ, latitude, longitude, altitude);
+	writeScalar(_headerGroup, "latitude", latitude * (180.0 / M_PI));
+	writeScalar(_headerGroup, "longitude", longitude * (180.0 / M_PI));
+	writeScalar(_headerGroup, "altitude", altitude);
+	writeString(_headerGroup, "telescope_name", _telescopeName);
+	writeString(_headerGroup, "instrument", _telescopeName);
+	writeString(_headerGroup, "object_name", _sourceName);
+	writeString(_headerGroup, "history", _history);
+	writeString(_headerGroup, "version", "1.0");
+	writeString(_headerGroup, "x_orientation", "east");
+
+	writeString(_headerGroup, "phase_type", "phased");
+	writeScalar(_headerGroup, "phase_center_ra", _phaseCentreRA);
+	writeScalar(_headerGroup, "phase_center_dec", _phaseCentreDec);
+	writeScalar(_headerGroup, "phase_center_epoch", 2000.0);
+	writeString(_headerGroup, "phase_center_frame", "fk5");
+
+	writeScalar(_headerGroup, "Nants_telescope", int64_t(_antennae.size()));
+	writeScalar(_headerGroup, "Nfreqs", int64_t(_channels.size()));
+	writeScalar(_headerGroup, "Npols", int64_t(4));
+	writeScalar(_headerGroup, "Nspws", int64_t(1));
+
+	// Antenna positions are relative to the array position in the ECEF frame
+	std::vector<std::string> names;
+	std::vector<int32_t> numbers;
+	std::vector<double> positions, diameters;
+	for(size_t i=0; i!=_antennae.size(); ++i)
+	{
+		const AntennaInfo& antenna = _antennae[i];
+		names.push_back(antenna.name);
+		numbers.push_back(i);
+		positions.push_back(antenna.x - _arrayX);
+		positions.push_back(antenna.y - _arrayY);
+		positions.push_back(antenna.z - _arrayZ);
+		diameters.push_back(antenna.diameter);
+	}
+	const hsize_t antennaCount = _antennae.size();
+	writeStrings(_headerGroup, "antenna_names", names, false);
+	writeDataset(_headerGroup, "antenna_numbers", H5T_NATIVE_INT32, { antennaCount }, numbers.data());
+	writeDataset(_headerGroup, "antenna_positions", H5T_NATIVE_DOUBLE, { antennaCount, 3 }, positions.data());
+	writeDataset(_headerGroup, "antenna_diameters", H5T_NATIVE_DOUBLE, { antennaCount }, diameters.data());
+
+	std::vector<double> frequencies;
+	for(const ChannelInfo& channel : _channels)
+		frequencies.push_back(channel.chanFreq);
+	writeDataset(_headerGroup, "freq_array", H5T_NATIVE_DOUBLE, { 1, hsize_t(_channels.size()) }, frequencies.data());
+	writeScalar(_headerGroup, "channel_width", _channels.front().chanWidth);
+	const int32_t spectralWindow = 0;
+	writeDataset(_headerGroup, "spw_array", H5T_NATIVE_INT32, { 1 }, &spectralWindow);
+	// Cotter's polarization order XX, XY, YX, YY in AIPS codes
+	const int32_t polarizations[4] = { -5, -7, -8, -6 };
+	writeDataset(_headerGroup, "polarization_array", H5T_NATIVE_INT32, { 4 }, polarizations);
+}
+
+void UVH5Writer::Flush()
+{
+	std::lock_guard<std::mutex> lock(hdf5Mutex);
+	writeBlock();
+	if(!_channels.empty())
+		writeHeader();
+	check(H5Fflush(_file, H5F_SCOPE_GLOBAL), "could not flush file");
+}
@@ -0,0 +1,110 @@
+#ifndef UVH5_WRITER_H
+#define UVH5_WRITER_H
+
+#include "writer.h"
+
+#include <hdf5.h>
+
+#include <complex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * Writes the UVH5 format of pyuvdata, an HDF5 file with the metadata in the /Header
+ * group and the visibilities, flags and weights ("nsamples") in the /Data group.
+ *
+ * Rows are collected until the time changes, and each timestep is then appended to
+ * the datasets with one write. The data datasets are chunked with all rows of a
+ * timestep and as many channels as fit in about 4 MB per chunk, so that every write
+ * covers whole chunks and readers can select time blocks and channel ranges without
+ * decompressing the rest of the file. The row-independent header values are written
+ * at the first flush, and the counts of rows, times, baselines and antennas are
+ * rewritten in place at every flush.
+ */
+class UVH5Writer : public Writer
+{
+	public:
+		/**
+		 * @param deflateLevel When non-zero, the data are compressed with the shuffle and
+		 * deflate filters at this level (1-9).
+		 */
+		UVH5Writer(const std::string& filename, int deflateLevel);
+		virtual ~UVH5Writer() final override;
+
+		virtual void SetArrayLocation(double x, double y, double z) final override
+		{
+			_arrayX = x;
+			_arrayY = y;
+			_arrayZ = z;
+		}
+
+		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override
+		{
+			_channels = channels;
+		}
+		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override
+		{
+			_antennae = antennae;
+		}
+		virtual void WritePolarizationForLinearPols(bool flagRow) final override { }
+		virtual void WriteSource(const SourceInfo& source) final override
+		{
+			_sourceName = source.name;
+		}
+		virtual void WriteField(const FieldInfo& field) final override
+		{
+			_phaseCentreRA = field.phaseDirRA;
+			_phaseCentreDec = field.phaseDirDec;
+		}
+		virtual void WriteObservation(const ObservationInfo& observation) final override
+		{
+			_telescopeName = observation.telescopeName;
+		}
+		virtual void WriteHistoryItem(const std::string& commandLine, const std::string& application, const std::vector<std::string>& params) final override
+		{
+			_history = "Created by " + application + ": " + commandLine + "\n";
+		}
+
+		virtual void AddRows(size_t count) final override { }
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		virtual void Flush() final override;
+
+	private:
+		/** The rows of one timestep, in the layout of the UVH5 datasets */
+		struct Block
+		{
+			double time;
+			std::vector<std::complex<float>> data;
+			std::vector<int8_t> flags;
+			std::vector<float> nsamples;
+			std::vector<double> times, intervals, uvws;
+			std::vector<int32_t> antenna1, antenna2;
+			size_t RowCount() const { return times.size(); }
+		};
+
+		void createDatasets(size_t rowsPerTimestep);
+		void writeBlock();
+		void writeHeader();
+
+		hid_t _file, _dataGroup, _headerGroup;
+		hid_t _complexType, _boolType;
+		hid_t _visData, _flags, _nsamples;
+		hid_t _timeArray, _integrationTime, _uvwArray, _ant1Array, _ant2Array;
+		int _deflateLevel;
+
+		Block _block;
+		size_t _rowCount, _timeCount;
+		double _lastBlockTime;
+		bool _isHeaderWritten;
+		std::vector<bool> _isAntennaUsed, _isBaselineUsed;
+
+		std::vector<ChannelInfo> _channels;
+		std::vector<AntennaInfo> _antennae;
+		std::string _sourceName, _telescopeName, _history;
+		double _phaseCentreRA, _phaseCentreDec;
+		double _arrayX, _arrayY, _arrayZ;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define WRITER_H
 
 #include <string>
+#include <stdexcept>
 #include <vector>
 #include <complex>
 
@@ -74,6 +75,31 @@ class Writer
 		virtual void AddRows(size_t count) = 0;
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) = 0;
 		
+		/**
+		 * Adds a spectral window with another channel resolution, for rows that are averaged
+		 * per baseline. The band of WriteBandInfo() is window 0. This should be called before
+		 * rows are added. Returns the index of the window for WriteWindowRow().
+		 */
+		virtual size_t AddSpectralWindow(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth)
+		{
+			throw std::runtime_error("This output format does not support rows with different channel resolutions");
+		}
+		
+		/**
+		 * Writes a row of a window returned by AddSpectralWindow(); data, flags and weights
+		 * hold the channels of that window. */
+		virtual void WriteWindowRow(size_t window, double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+		{
+			if(window != 0)
+				throw std::runtime_error("This output format does not support rows with different channel resolutions");
+			WriteRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights);
+		}
+		
+		/**
+		 * Makes sure that all rows written so far are stored, so that the output is consistent
+		 * up to this point, for example before recording a checkpoint. */
+		virtual void Flush() { }
+		
 		virtual bool AreAntennaPositionsLocal() const { return false; }
 		virtual bool CanWriteStatistics() const { return false; }
 		